@@ -0,0 +1,72 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fixtures.h"
+
+#include <connection.h>
+#include <syncdata.h>
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+using Fixtures::TestRoom;
+using Fixtures::timelineJson;
+
+class TestDropDuplicates : public QObject {
+    Q_OBJECT
+
+private:
+    Connection* connection = nullptr;
+
+private Q_SLOTS:
+    void initTestCase();
+    void dropDuplicates();
+    void benchmarkDropDuplicates();
+    void cleanupTestCase();
+};
+
+void TestDropDuplicates::initTestCase()
+{
+    connection = Connection::makeMockConnection("@bob:localhost"_ls);
+    connection->setCacheState(false);
+}
+
+void TestDropDuplicates::dropDuplicates()
+{
+    TestRoom room(connection, QStringLiteral("!dedup:localhost"),
+                  JoinState::Join);
+    // Each event comes three times within the batch
+    room.updateData({ room.id(), JoinState::Join, timelineJson(0, 100, 3) });
+    QCOMPARE(room.timelineSize(), 100);
+    QCOMPARE(room.messageEvents().front()->id(),
+             QStringLiteral("$event0:localhost"));
+    QCOMPARE(room.messageEvents().back()->id(),
+             QStringLiteral("$event99:localhost"));
+
+    // Half of the next batch is already in the timeline
+    room.updateData({ room.id(), JoinState::Join, timelineJson(50, 100, 2) });
+    QCOMPARE(room.timelineSize(), 150);
+    QCOMPARE(room.messageEvents().back()->id(),
+             QStringLiteral("$event149:localhost"));
+}
+
+void TestDropDuplicates::benchmarkDropDuplicates()
+{
+    // 10000 events in the batch, every event in two copies
+    const auto batchJson = timelineJson(0, 5000, 2);
+    QBENCHMARK {
+        TestRoom room(connection, QStringLiteral("!dedupbench:localhost"),
+                      JoinState::Join);
+        room.updateData({ room.id(), JoinState::Join, batchJson });
+        QCOMPARE(room.timelineSize(), 5000);
+    }
+}
+
+void TestDropDuplicates::cleanupTestCase()
+{
+    delete connection;
+}
+
+QTEST_GUILESS_MAIN(TestDropDuplicates)
+#include "dropduplicatestest.moc"
@@ -0,0 +1,125 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fixtures.h"
+
+#include <eventitem.h>
+#include <events/encryptedevent.h>
+#include <events/roommessageevent.h>
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestEventItem : public QObject {
+    Q_OBJECT
+
+private:
+    static QJsonObject encryptedEventJson();
+
+private Q_SLOTS:
+    void packMessage();
+    void encryptedNotPacked();
+    void packDecrypted();
+    void stateNotPacked();
+};
+
+QJsonObject TestEventItem::encryptedEventJson()
+{
+    return { { "type"_ls, "m.room.encrypted"_ls },
+             { "event_id"_ls, "$encrypted:localhost"_ls },
+             { "sender"_ls, Fixtures::userId(1) },
+             { "room_id"_ls, Fixtures::roomId(0) },
+             { "origin_server_ts"_ls, 1'600'000'000'000 },
+             { "content"_ls,
+               QJsonObject { { "algorithm"_ls, "m.megolm.v1.aes-sha2"_ls },
+                             { "ciphertext"_ls, "AwgAEnAC0x1ld2Rg"_ls },
+                             { "sender_key"_ls, "senderkey"_ls },
+                             { "device_id"_ls, "DEVICE"_ls },
+                             { "session_id"_ls, "session"_ls } } } };
+}
+
+void TestEventItem::packMessage()
+{
+    const auto json = Fixtures::messageEvent(1, 1);
+    TimelineItem ti(loadEvent<RoomEvent>(json), 1);
+    QVERIFY(!ti.isPacked());
+    QCOMPARE(ti.packedSize(), qsizetype(0));
+
+    QVERIFY(ti.pack());
+    QVERIFY(ti.isPacked());
+    QVERIFY(ti.packedSize() > 0);
+    // The id is available without unpacking
+    QCOMPARE(ti.eventId(), json["event_id"_ls].toString());
+    QVERIFY(ti.isPacked());
+
+    // Any access to the event unpacks it
+    QCOMPARE(ti->fullJson(), json);
+    QVERIFY(!ti.isPacked());
+    const auto* rme = ti.viewAs<RoomMessageEvent>();
+    QVERIFY(rme);
+    QCOMPARE(rme->plainBody(), json["content"_ls]["body"_ls].toString());
+
+    // The blob is kept, and packing again reuses it
+    const auto packedSize = ti.packedSize();
+    QVERIFY(ti.pack());
+    QCOMPARE(ti.packedSize(), packedSize);
+    QCOMPARE(ti->id(), json["event_id"_ls].toString());
+}
+
+void TestEventItem::encryptedNotPacked()
+{
+    // Undecrypted events get replaced once the keys arrive
+    const auto json = encryptedEventJson();
+    TimelineItem ti(loadEvent<RoomEvent>(json), 1);
+    QVERIFY(!ti.pack());
+    QVERIFY(!ti.isPacked());
+    QCOMPARE(ti.packedSize(), qsizetype(0));
+    QCOMPARE(ti.eventId(), json["event_id"_ls].toString());
+}
+
+void TestEventItem::packDecrypted()
+{
+#ifdef Quotient_E2EE_ENABLED
+    const auto encryptedJson = encryptedEventJson();
+    const auto encrypted = loadEvent<EncryptedEvent>(encryptedJson);
+    const QJsonObject plaintext {
+        { "type"_ls, "m.room.message"_ls },
+        { "room_id"_ls, Fixtures::roomId(0) },
+        { "content"_ls, QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                      { "body"_ls, "Decrypted"_ls } } }
+    };
+    auto decrypted = encrypted->createDecrypted(
+        QString::fromUtf8(QJsonDocument(plaintext).toJson()));
+    decrypted->setOriginalEvent(loadEvent<RoomEvent>(encryptedJson));
+    const auto decryptedJson = decrypted->fullJson();
+
+    TimelineItem ti(std::move(decrypted), 1);
+    QVERIFY(ti.pack());
+    QVERIFY(ti.isPacked());
+
+    const auto* rme = ti.viewAs<RoomMessageEvent>();
+    QVERIFY(rme);
+    QCOMPARE(rme->fullJson(), decryptedJson);
+    QCOMPARE(rme->plainBody(), QStringLiteral("Decrypted"));
+    QCOMPARE(rme->id(), encryptedJson["event_id"_ls].toString());
+    // The original encrypted event survives the round-trip
+    QVERIFY(rme->originalEvent());
+    QVERIFY(rme->originalEvent()->is<EncryptedEvent>());
+    QCOMPARE(rme->originalEvent()->fullJson(), encryptedJson);
+#else
+    QSKIP("E2EE support is not enabled");
+#endif
+}
+
+void TestEventItem::stateNotPacked()
+{
+    TimelineItem ti(loadEvent<RoomEvent>(Fixtures::memberEvent(1, 1)), 1);
+    QVERIFY(!ti.pack());
+    QVERIFY(!ti.isPacked());
+    QCOMPARE(ti.packedSize(), qsizetype(0));
+}
+
+QTEST_GUILESS_MAIN(TestEventItem)
+#include "eventitemtest.moc"
@@ -0,0 +1,147 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <eventstats.h>
+
+#include <QtCore/QRandomGenerator>
+#include <QtTest/QtTest>
+
+#include <map>
+
+using namespace Quotient;
+
+static const EventStats NoEvents { 0, 0, false };
+
+class TestEventStatsIndex : public QObject {
+    Q_OBJECT
+
+private:
+    struct Counters {
+        bool notable = false;
+        bool highlight = false;
+    };
+    //! Plain counters to check EventStatsIndex against
+    using NaiveIndex = std::map<EventStatsIndex::index_t, Counters>;
+
+    static EventStats naiveSum(const NaiveIndex& naive,
+                               EventStatsIndex::index_t from,
+                               EventStatsIndex::index_t to);
+
+private Q_SLOTS:
+    void emptyIndex();
+    void appendAndUpdate();
+    void randomRanges();
+    void dropBefore();
+};
+
+EventStats TestEventStatsIndex::naiveSum(const NaiveIndex& naive,
+                                         EventStatsIndex::index_t from,
+                                         EventStatsIndex::index_t to)
+{
+    EventStats result { 0, 0, false };
+    for (auto it = naive.lower_bound(from); it != naive.end() && it->first < to;
+         ++it) {
+        result.notableCount += it->second.notable;
+        result.highlightCount += it->second.highlight;
+    }
+    return result;
+}
+
+void TestEventStatsIndex::emptyIndex()
+{
+    const EventStatsIndex index {};
+    QCOMPARE(index.sum(-100, 100), NoEvents);
+    QCOMPARE(index.sum(5, 5), NoEvents);
+    QCOMPARE(index.sum(10, -10), NoEvents);
+}
+
+void TestEventStatsIndex::appendAndUpdate()
+{
+    EventStatsIndex index;
+    // New events, in the order they come from sync
+    for (int i = 0; i < 10; ++i)
+        index.set(i, i % 2 == 0, i == 4);
+    // Historical events, from the newest to the oldest
+    for (int i = -1; i >= -10; --i)
+        index.set(i, true, i == -3);
+
+    QCOMPARE(index.sum(0, 10), (EventStats { 5, 1, false }));
+    QCOMPARE(index.sum(-10, 0), (EventStats { 10, 1, false }));
+    QCOMPARE(index.sum(-10, 10), (EventStats { 15, 2, false }));
+    QCOMPARE(index.sum(-3, 3), (EventStats { 5, 1, false }));
+    QCOMPARE(index.sum(-2, -1), (EventStats { 1, 0, false }));
+    QCOMPARE(index.sum(1, 2), (EventStats { 0, 0, false }));
+    // Out of the filled range
+    QCOMPARE(index.sum(-100, -10), NoEvents);
+    QCOMPARE(index.sum(10, 100), NoEvents);
+
+    // Updates of existing events, e.g. after decryption or redaction
+    index.set(1, true, true);
+    index.set(-3, false, false);
+    QCOMPARE(index.sum(0, 10), (EventStats { 6, 2, false }));
+    QCOMPARE(index.sum(-10, 0), (EventStats { 9, 0, false }));
+
+    // Setting a position beyond the end fills the gap with zeros
+    index.set(20, true, false);
+    QCOMPARE(index.sum(10, 20), NoEvents);
+    QCOMPARE(index.sum(10, 21), (EventStats { 1, 0, false }));
+}
+
+void TestEventStatsIndex::randomRanges()
+{
+    QRandomGenerator rng(42);
+    EventStatsIndex index;
+    NaiveIndex naive;
+    // Grow both trees by appending, as the timeline does
+    for (int i = 0; i < 1000; ++i) {
+        const Counters c { rng.bounded(2) == 1, rng.bounded(5) == 0 };
+        index.set(i, c.notable, c.highlight);
+        naive[i] = c;
+    }
+    for (int i = -1; i >= -1000; --i) {
+        const Counters c { rng.bounded(2) == 1, rng.bounded(5) == 0 };
+        index.set(i, c.notable, c.highlight);
+        naive[i] = c;
+    }
+
+    for (int round = 0; round < 2000; ++round) {
+        if (round % 4 == 0) {
+            // Update a random existing event
+            const auto i = rng.bounded(-1000, 1000);
+            const Counters c { rng.bounded(2) == 1, rng.bounded(5) == 0 };
+            index.set(i, c.notable, c.highlight);
+            naive[i] = c;
+        }
+        const auto from = rng.bounded(-1100, 1100);
+        const auto to = rng.bounded(-1100, 1100);
+        QCOMPARE(index.sum(from, to), naiveSum(naive, from, to));
+    }
+}
+
+void TestEventStatsIndex::dropBefore()
+{
+    EventStatsIndex index;
+    NaiveIndex naive;
+    for (int i = -100; i < 100; ++i) {
+        index.set(i, i % 3 == 0, i % 7 == 0);
+        naive[i] = { i % 3 == 0, i % 7 == 0 };
+    }
+
+    index.dropBefore(-40);
+    QCOMPARE(index.sum(-40, 100), naiveSum(naive, -40, 100));
+    QCOMPARE(index.sum(-40, -10), naiveSum(naive, -40, -10));
+    QCOMPARE(index.sum(-100, -40), NoEvents);
+
+    // The dropped positions can be filled again by loading the history
+    for (int i = -41; i >= -60; --i)
+        index.set(i, i % 3 == 0, i % 7 == 0);
+    QCOMPARE(index.sum(-60, 100), naiveSum(naive, -60, 100));
+
+    index.dropBefore(10);
+    QCOMPARE(index.sum(10, 100), naiveSum(naive, 10, 100));
+    QCOMPARE(index.sum(-100, 0), NoEvents);
+}
+
+QTEST_APPLESS_MAIN(TestEventStatsIndex)
+#include "eventstatstest.moc"
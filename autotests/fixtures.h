@@ -0,0 +1,124 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <room.h>
+#include <util.h>
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonObject>
+
+//! Generators of synthetic /sync payloads for autotests and benchmarks
+namespace Quotient::Fixtures {
+
+//! A Room that lets tests feed it with sync data and dump it to JSON
+class TestRoom : public Room {
+public:
+    using Room::Room;
+    using Room::toJson;
+    using Room::updateData;
+};
+
+inline QString userId(int n) { return QStringLiteral("@user%1:localhost").arg(n); }
+
+inline QString roomId(int n) { return QStringLiteral("!room%1:localhost").arg(n); }
+
+inline QJsonObject messageEvent(int n, int senderNum)
+{
+    return { { "type"_ls, "m.room.message"_ls },
+             { "event_id"_ls, QStringLiteral("$event%1:localhost").arg(n) },
+             { "sender"_ls, userId(senderNum) },
+             { "origin_server_ts"_ls, 1'600'000'000'000 + n },
+             { "content"_ls,
+               QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                             { "body"_ls,
+                               QStringLiteral("Message number %1 from %2")
+                                   .arg(n)
+                                   .arg(userId(senderNum)) } } } };
+}
+
+//! Make a member event for user \p userNum; the display name is "User N"
+//! unless \p displayName is given
+inline QJsonObject memberEvent(int n, int userNum,
+                               const QString& membership = QStringLiteral("join"),
+                               const QString& displayName = {})
+{
+    return { { "type"_ls, "m.room.member"_ls },
+             { "event_id"_ls, QStringLiteral("$member%1:localhost").arg(n) },
+             { "sender"_ls, userId(userNum) },
+             { "state_key"_ls, userId(userNum) },
+             { "origin_server_ts"_ls, 1'500'000'000'000 + n },
+             { "content"_ls,
+               QJsonObject { { "membership"_ls, membership },
+                             { "displayname"_ls,
+                               displayName.isEmpty()
+                                   ? QStringLiteral("User %1").arg(userNum)
+                                   : displayName } } } };
+}
+
+//! \brief Make a room object with only a timeline in it
+//!
+//! The timeline gets \p uniqueEvents text messages numbered from
+//! \p firstEventNum, each repeated \p copies times in a row.
+inline QJsonObject timelineJson(int firstEventNum, int uniqueEvents,
+                                int copies = 1)
+{
+    QJsonArray events;
+    for (int i = firstEventNum; i < firstEventNum + uniqueEvents; ++i) {
+        const auto eventJson = messageEvent(i, 0);
+        for (int c = 0; c < copies; ++c)
+            events.append(eventJson);
+    }
+    return { { "timeline"_ls, QJsonObject { { "events"_ls, events } } } };
+}
+
+//! \brief Make a room object as found in /sync responses or in the cache
+//!
+//! The room gets \p members joined members in the state and \p messages
+//! text messages in the timeline, sent by these members in turn.
+inline QJsonObject roomJson(int members, int messages, int firstEventNum = 0)
+{
+    QJsonArray stateEvents;
+    stateEvents.append(QJsonObject {
+        { "type"_ls, "m.room.create"_ls },
+        { "event_id"_ls, QStringLiteral("$create%1:localhost").arg(firstEventNum) },
+        { "sender"_ls, userId(0) },
+        { "state_key"_ls, ""_ls },
+        { "origin_server_ts"_ls, 1'500'000'000'000 },
+        { "content"_ls, QJsonObject { { "room_version"_ls, "9"_ls } } } });
+    for (int i = 0; i < members; ++i)
+        stateEvents.append(memberEvent(firstEventNum + i, i));
+
+    QJsonArray timelineEvents;
+    for (int i = 0; i < messages; ++i)
+        timelineEvents.append(
+            messageEvent(firstEventNum + i, members > 0 ? i % members : 0));
+
+    return {
+        { "state"_ls, QJsonObject { { "events"_ls, stateEvents } } },
+        { "timeline"_ls,
+          QJsonObject { { "events"_ls, timelineEvents },
+                        { "limited"_ls, true },
+                        { "prev_batch"_ls,
+                          QStringLiteral("prev%1").arg(firstEventNum) } } },
+        { "unread_notifications"_ls,
+          QJsonObject { { "notification_count"_ls, messages / 2 },
+                        { "highlight_count"_ls, 0 } } }
+    };
+}
+
+//! Make a /sync response with \p rooms joined rooms of the same shape
+inline QJsonObject syncJson(int rooms, int membersPerRoom, int messagesPerRoom)
+{
+    QJsonObject joinedRooms;
+    for (int i = 0; i < rooms; ++i)
+        joinedRooms.insert(roomId(i),
+                           roomJson(membersPerRoom, messagesPerRoom,
+                                    i * (membersPerRoom + messagesPerRoom)));
+    return { { "next_batch"_ls, "s1_benchmark"_ls },
+             { "rooms"_ls, QJsonObject { { "join"_ls, joinedRooms } } } };
+}
+
+} // namespace Quotient::Fixtures
@@ -0,0 +1,86 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "mediacache.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestMediaCache : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void keys();
+    void insertAndFind();
+    void eviction();
+    void cleanupTestCase();
+};
+
+void TestMediaCache::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    MediaCache::instance().clear();
+}
+
+void TestMediaCache::keys()
+{
+    const QUrl url(QStringLiteral("mxc://example.org/abcdef"));
+    const auto key = MediaCache::makeKey(url);
+    QCOMPARE(MediaCache::makeKey(
+                 QUrl(QStringLiteral("mxc://example.org/abcdef?user_id=@a:b"))),
+             key);
+    QVERIFY(MediaCache::makeKey(url, { 96, 96 }, QStringLiteral("crop")) != key);
+    QVERIFY(MediaCache::makeKey(url, { 96, 96 }, QStringLiteral("crop"))
+            != MediaCache::makeKey(url, { 96, 96 }, QStringLiteral("scale")));
+}
+
+void TestMediaCache::insertAndFind()
+{
+    auto& cache = MediaCache::instance();
+    const auto key = MediaCache::makeKey(QUrl(QStringLiteral("mxc://a/b")));
+    QVERIFY(!cache.find(key).isValid());
+    const auto data = QByteArrayLiteral("image data");
+    const auto inserted =
+        cache.insert(key, data,
+                     { {}, QStringLiteral("image/png"), "\"etag\"", {}, {} });
+    QVERIFY(inserted.isValid());
+
+    const auto found = cache.find(key);
+    QVERIFY(found.isValid());
+    QCOMPARE(found.contentType, QStringLiteral("image/png"));
+    QCOMPARE(found.etag, QByteArray("\"etag\""));
+    QVERIFY(!cache.needsRevalidation(found));
+    QFile file(found.fileName);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), data);
+
+    cache.remove(key);
+    QVERIFY(!cache.find(key).isValid());
+}
+
+void TestMediaCache::eviction()
+{
+    auto& cache = MediaCache::instance();
+    const auto oldMaxSize = cache.maxSize();
+    const QByteArray data(1000, 'x');
+    std::vector<QString> keys;
+    for (int i = 0; i < 3; ++i) {
+        keys.push_back(MediaCache::makeKey(
+            QUrl(QStringLiteral("mxc://a/%1").arg(i))));
+        QVERIFY(cache.insert(keys.back(), data, {}).isValid());
+    }
+    // Use the oldest entry so that the second one becomes the least recent
+    QVERIFY(cache.find(keys[0]).isValid());
+    cache.setMaxSize(cache.size() - 1);
+    QVERIFY(cache.find(keys[0]).isValid());
+    QVERIFY(!cache.find(keys[1]).isValid());
+    QVERIFY(cache.find(keys[2]).isValid());
+    QVERIFY(cache.size() <= cache.maxSize());
+    cache.setMaxSize(oldMaxSize);
+}
+
+void TestMediaCache::cleanupTestCase() { MediaCache::instance().clear(); }
+
+QTEST_GUILESS_MAIN(TestMediaCache)
+#include "mediacachetest.moc"
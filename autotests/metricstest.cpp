@@ -0,0 +1,104 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "metrics.h"
+#include "util.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestMetrics : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void counterAndGauge();
+    void histogram();
+    void prometheusText();
+    void exporter();
+};
+
+static Metrics::Counter testCounter { QLatin1String("test_events_total"),
+                                      QLatin1String("Test events") };
+static Metrics::Histogram testHistogram { QLatin1String("test_seconds"),
+                                          QLatin1String("Test durations") };
+
+static const Metrics::MetricSnapshot* findMetric(const Metrics::Snapshot& s,
+                                                 const QString& name)
+{
+    const auto it =
+        std::find_if(s.cbegin(), s.cend(),
+                     [&name](const auto& ms) { return ms.name == name; });
+    return it != s.cend() ? &*it : nullptr;
+}
+
+void TestMetrics::counterAndGauge()
+{
+    const auto initialValue = testCounter.value();
+    testCounter.add();
+    testCounter.add(41);
+    QCOMPARE(testCounter.value(), initialValue + 42);
+
+    {
+        Metrics::Gauge gauge { QLatin1String("test_depth"),
+                               QLatin1String("Test gauge") };
+        gauge.add(5);
+        gauge.add(-2);
+        QCOMPARE(gauge.value(), qint64(3));
+        const auto* ms = findMetric(Metrics::snapshot(), "test_depth"_ls);
+        QVERIFY(ms);
+        QCOMPARE(ms->type, Metrics::GaugeType);
+        QCOMPARE(ms->value, qint64(3));
+    }
+    // Destroyed metrics no more show up in snapshots
+    QVERIFY(!findMetric(Metrics::snapshot(), "test_depth"_ls));
+}
+
+void TestMetrics::histogram()
+{
+    const auto initialCount = testHistogram.count();
+    const auto initialBuckets = testHistogram.bucketCounts();
+    testHistogram.observe(50'000); // 50us - the first bucket
+    testHistogram.observe(1'000'000); // Exactly at the bound of 1ms
+    testHistogram.observe(10'000'000'000); // 10s - above all bounds
+    QCOMPARE(testHistogram.count(), initialCount + 3);
+    const auto buckets = testHistogram.bucketCounts();
+    QCOMPARE(buckets.front(), initialBuckets.front() + 1);
+    QCOMPARE(buckets[3], initialBuckets[3] + 1);
+    QCOMPARE(buckets.back(), initialBuckets.back() + 1);
+
+    const auto* ms = findMetric(Metrics::snapshot(), "test_seconds"_ls);
+    QVERIFY(ms);
+    QCOMPARE(size_t(ms->cumulativeCounts.size()),
+             Metrics::Histogram::BucketBounds.size() + 1);
+    QCOMPARE(ms->cumulativeCounts.back(), ms->count);
+    QVERIFY(std::is_sorted(ms->cumulativeCounts.cbegin(),
+                           ms->cumulativeCounts.cend()));
+}
+
+void TestMetrics::prometheusText()
+{
+    const auto text = Metrics::toPrometheusText();
+    QVERIFY(text.contains("# TYPE test_events_total counter\n"));
+    QVERIFY(text.contains("# TYPE test_seconds histogram\n"));
+    QVERIFY(text.contains("test_seconds_bucket{le=\"0.001\"} "));
+    QVERIFY(text.contains("test_seconds_bucket{le=\"+Inf\"} "));
+    QVERIFY(text.contains("test_seconds_count "));
+    QVERIFY(text.contains("# TYPE quotient_sync_parse_seconds histogram\n"));
+}
+
+void TestMetrics::exporter()
+{
+    int exportedTimes = 0;
+    Metrics::setExporter([&exportedTimes](const Metrics::Snapshot& s) {
+        ++exportedTimes;
+        QVERIFY(findMetric(s, "test_events_total"_ls));
+    });
+    Metrics::publish();
+    QCOMPARE(exportedTimes, 1);
+    Metrics::setExporter({});
+    Metrics::publish();
+    QCOMPARE(exportedTimes, 1);
+}
+
+QTEST_APPLESS_MAIN(TestMetrics)
+#include "metricstest.moc"
@@ -0,0 +1,162 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "pushruleengine.h"
+
+#include "events/roommessageevent.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestPushRuleEngine : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void emptyRules();
+    void contentRules_data();
+    void contentRules();
+    void overrideRules();
+    void idRules();
+
+private:
+    PushRuleEngine engine;
+};
+
+namespace {
+RoomEventPtr makeMessage(const QString& body,
+                         const QString& sender = "@bob:example.org"_ls)
+{
+    return loadEvent<RoomEvent>(QJsonObject {
+        { "type"_ls, "m.room.message"_ls },
+        { "event_id"_ls, "$event:example.org"_ls },
+        { "room_id"_ls, "!room:example.org"_ls },
+        { "sender"_ls, sender },
+        { "content"_ls,
+          QJsonObject { { "msgtype"_ls, "m.text"_ls }, { "body"_ls, body } } } });
+}
+} // namespace
+
+void TestPushRuleEngine::initTestCase()
+{
+    const auto json = QJsonDocument::fromJson(R"({
+        "override": [
+            { "rule_id": ".m.rule.master", "default": true, "enabled": false,
+              "conditions": [], "actions": [] },
+            { "rule_id": ".m.rule.suppress_notices", "default": true,
+              "enabled": true,
+              "conditions": [ { "kind": "event_match", "key": "content.msgtype",
+                                "pattern": "m.notice" } ],
+              "actions": [] },
+            { "rule_id": "ducks", "default": false, "enabled": true,
+              "conditions": [ { "kind": "event_match", "key": "content.body",
+                                "pattern": "d?ck*s" } ],
+              "actions": [ "notify" ] }
+        ],
+        "content": [
+            { "rule_id": ".m.rule.contains_user_name", "default": true,
+              "enabled": true, "pattern": "alice",
+              "actions": [ "notify", { "set_tweak": "highlight" } ] },
+            { "rule_id": "disabled", "default": false, "enabled": false,
+              "pattern": "cats", "actions": [ "notify" ] },
+            { "rule_id": "wildcard", "default": false, "enabled": true,
+              "pattern": "pizz*", "actions": [ "notify" ] },
+            { "rule_id": "quiet", "default": false, "enabled": true,
+              "pattern": "alice*", "actions": [ "dont_notify" ] }
+        ],
+        "room": [
+            { "rule_id": "!muted:example.org", "default": false,
+              "enabled": true, "actions": [ "dont_notify" ] }
+        ],
+        "sender": [
+            { "rule_id": "@carol:example.org", "default": false,
+              "enabled": true,
+              "actions": [ "notify", { "set_tweak": "highlight",
+                                       "value": false } ] }
+        ],
+        "underride": [
+            { "rule_id": ".m.rule.message", "default": true, "enabled": true,
+              "conditions": [ { "kind": "event_match", "key": "type",
+                                "pattern": "m.room.message" } ],
+              "actions": [ "notify" ] }
+        ]
+    })");
+    engine = PushRuleEngine(fromJson<PushRuleset>(json.object()));
+    QVERIFY(!engine.isEmpty());
+}
+
+void TestPushRuleEngine::emptyRules()
+{
+    const PushRuleEngine empty;
+    QVERIFY(empty.isEmpty());
+    QCOMPARE(empty.evaluate(*makeMessage(QStringLiteral("Hi alice")), nullptr)
+                 .type,
+             Notification::None);
+}
+
+void TestPushRuleEngine::contentRules_data()
+{
+    QTest::addColumn<QString>("body");
+    QTest::addColumn<Notification::Type>("type");
+
+    QTest::newRow("keyword") << QStringLiteral("Hi Alice!")
+                             << Notification::Highlight;
+    QTest::newRow("keyword at the end") << QStringLiteral("hi alice")
+                                        << Notification::Highlight;
+    QTest::newRow("not a word") << QStringLiteral("malice aforethought")
+                                << Notification::Basic;
+    QTest::newRow("longer keyword") << QStringLiteral("Alicevich")
+                                    << Notification::None;
+    QTest::newRow("disabled") << QStringLiteral("cats")
+                              << Notification::Basic;
+    QTest::newRow("wildcard") << QStringLiteral("PIZZAS tonight")
+                              << Notification::Basic;
+    QTest::newRow("override wins") << QStringLiteral("alice likes ducks")
+                                   << Notification::Basic;
+}
+
+void TestPushRuleEngine::contentRules()
+{
+    QFETCH(QString, body);
+    QFETCH(Notification::Type, type);
+    QCOMPARE(engine.evaluate(*makeMessage(body), nullptr).type, type);
+}
+
+void TestPushRuleEngine::overrideRules()
+{
+    auto notice = loadEvent<RoomEvent>(QJsonObject {
+        { "type"_ls, "m.room.message"_ls },
+        { "event_id"_ls, "$notice:example.org"_ls },
+        { "sender"_ls, "@bot:example.org"_ls },
+        { "content"_ls, QJsonObject { { "msgtype"_ls, "m.notice"_ls },
+                                      { "body"_ls, "alice"_ls } } } });
+    QCOMPARE(engine.evaluate(*notice, nullptr).type, Notification::None);
+    // No underride rule matches this type, only the override one
+    auto custom = loadEvent<RoomEvent>(QJsonObject {
+        { "type"_ls, "org.example.custom"_ls },
+        { "event_id"_ls, "$custom:example.org"_ls },
+        { "sender"_ls, "@bob:example.org"_ls },
+        { "content"_ls, QJsonObject { { "body"_ls, "some decks"_ls } } } });
+    QCOMPARE(engine.evaluate(*custom, nullptr).type, Notification::Basic);
+}
+
+void TestPushRuleEngine::idRules()
+{
+    QCOMPARE(engine
+                 .evaluate(*makeMessage(QStringLiteral("hello"),
+                                        QStringLiteral("@carol:example.org")),
+                           nullptr)
+                 .type,
+             Notification::Basic);
+    auto muted = loadEvent<RoomEvent>(QJsonObject {
+        { "type"_ls, "m.room.message"_ls },
+        { "event_id"_ls, "$muted:example.org"_ls },
+        { "room_id"_ls, "!muted:example.org"_ls },
+        { "sender"_ls, "@bob:example.org"_ls },
+        { "content"_ls, QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                      { "body"_ls, "hello"_ls } } } });
+    QCOMPARE(engine.evaluate(*muted, nullptr).type, Notification::None);
+}
+
+QTEST_GUILESS_MAIN(TestPushRuleEngine)
+#include "pushruleenginetest.moc"
@@ -0,0 +1,168 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fixtures.h"
+
+#include <connection.h>
+#include <syncdata.h>
+#include <user.h>
+
+#include <QtCore/QRandomGenerator>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+using Fixtures::TestRoom;
+
+class TestRoomMembers : public QObject {
+    Q_OBJECT
+
+private:
+    Connection* connection = nullptr;
+
+    //! Make a room object with member events for users [\p from, \p to)
+    static QJsonObject membersJson(int firstEventNum, int from, int to,
+                                   const QString& membership);
+
+private Q_SLOTS:
+    void initTestCase();
+    void bulkUpdate();
+    void sortedMembers();
+    void cleanupTestCase();
+};
+
+QJsonObject TestRoomMembers::membersJson(int firstEventNum, int from, int to,
+                                         const QString& membership)
+{
+    QJsonArray events;
+    for (int i = from; i < to; ++i)
+        events.append(
+            Fixtures::memberEvent(firstEventNum + i, i, membership));
+    return { { "state"_ls, QJsonObject { { "events"_ls, events } } } };
+}
+
+void TestRoomMembers::initTestCase()
+{
+    connection = Connection::makeMockConnection("@bob:localhost"_ls);
+    connection->setCacheState(false);
+}
+
+void TestRoomMembers::bulkUpdate()
+{
+    TestRoom room(connection, QStringLiteral("!bulk:localhost"),
+                  JoinState::Join);
+    QSignalSpy aboutToResetSpy(&room, &Room::memberListAboutToReset);
+    QSignalSpy resetSpy(&room, &Room::memberListReset);
+    QSignalSpy addedSpy(&room, &Room::userAdded);
+    QSignalSpy removedSpy(&room, &Room::userRemoved);
+    QSignalSpy aboutToRenameSpy(&room, &Room::memberAboutToRename);
+    QSignalSpy renamedSpy(&room, &Room::memberRenamed);
+    const auto checkOnlyResetSignals = [&](int resets) {
+        QCOMPARE(aboutToResetSpy.count(), resets);
+        QCOMPARE(resetSpy.count(), resets);
+        QCOMPARE(addedSpy.count(), 0);
+        QCOMPARE(removedSpy.count(), 0);
+        QCOMPARE(aboutToRenameSpy.count(), 0);
+        QCOMPARE(renamedSpy.count(), 0);
+    };
+
+    room.updateData({ room.id(), JoinState::Join,
+                      membersJson(0, 0, 1500, QStringLiteral("join")) });
+    checkOnlyResetSignals(1);
+    QCOMPARE(room.users().size(), 1500);
+    QVERIFY(room.membersLeft().isEmpty());
+
+    // Move most of the members out of the room
+    room.updateData({ room.id(), JoinState::Join,
+                      membersJson(10'000, 0, 1200, QStringLiteral("leave")) });
+    checkOnlyResetSignals(2);
+    QCOMPARE(room.users().size(), 300);
+    QCOMPARE(room.membersLeft().size(), 1200);
+
+    // Move most of those back, so that they are removed from membersLeft
+    room.updateData({ room.id(), JoinState::Join,
+                      membersJson(20'000, 0, 1100, QStringLiteral("join")) });
+    checkOnlyResetSignals(3);
+    QCOMPARE(room.users().size(), 1400);
+    const auto left = room.membersLeft();
+    QCOMPARE(left.size(), 100);
+    // The remaining users keep their order in the list
+    for (int i = 0; i < left.size(); ++i)
+        QCOMPARE(left[i]->id(), Fixtures::userId(1100 + i));
+}
+
+void TestRoomMembers::sortedMembers()
+{
+    TestRoom room(connection, QStringLiteral("!sorted:localhost"),
+                  JoinState::Join);
+    // Mirror the sorted list the way a list model would, only by the positions
+    // passed with the signals
+    QList<User*> model;
+    connect(&room, &Room::sortedMemberAboutToBeInserted, this,
+            [&model](User* member, int position) {
+                QVERIFY(position >= 0 && position <= model.size());
+                QVERIFY(!model.contains(member));
+            });
+    connect(&room, &Room::sortedMemberInserted, this,
+            [&model](User* member, int position) {
+                model.insert(position, member);
+            });
+    connect(&room, &Room::sortedMemberAboutToBeRemoved, this,
+            [&model](User* member, int position) {
+                QVERIFY(position >= 0 && position < model.size());
+                QCOMPARE(model.at(position), member);
+            });
+    connect(&room, &Room::sortedMemberRemoved, this,
+            [&model](User* member, int position) {
+                const auto* removed = model.takeAt(position);
+                QCOMPARE(removed, member);
+            });
+
+    // A small pool of names in mixed case, for plenty of namesakes
+    static const QStringList names {
+        QStringLiteral("alice"), QStringLiteral("Bob"),  QStringLiteral("carol"),
+        QStringLiteral("Dave"),  QStringLiteral("eve"),  QStringLiteral("Frank"),
+        QStringLiteral("grace"), QStringLiteral("Heidi")
+    };
+    QRandomGenerator rng(2022);
+    QSet<int> joined;
+    for (int n = 0; n < 1000; ++n) {
+        const auto userNum = int(rng.bounded(60));
+        QString membership = QStringLiteral("join");
+        // Members leave every other time; everybody else joins or gets renamed
+        if (joined.contains(userNum) && rng.bounded(2) == 0) {
+            membership = QStringLiteral("leave");
+            joined.remove(userNum);
+        } else
+            joined.insert(userNum);
+        const auto& name = names[int(rng.bounded(names.size()))];
+        room.updateData(
+            { room.id(), JoinState::Join,
+              { { "state"_ls,
+                  QJsonObject {
+                      { "events"_ls,
+                        QJsonArray { Fixtures::memberEvent(
+                            n, userNum, membership, name) } } } } } });
+
+        const auto sorted = room.sortedMembers();
+        QCOMPARE(sorted.size(), joined.size());
+        QCOMPARE(room.sortedMembersCount(), int(joined.size()));
+        QCOMPARE(model, sorted);
+        auto expected = room.users();
+        std::sort(expected.begin(), expected.end(), room.memberSorter());
+        QCOMPARE(sorted, expected);
+    }
+    for (int i = 0; i < model.size(); ++i) {
+        QCOMPARE(room.sortedMemberAt(i), model[i]);
+        QCOMPARE(room.sortedMemberPosition(model[i]), i);
+    }
+    QVERIFY(!room.sortedMemberAt(int(model.size())));
+}
+
+void TestRoomMembers::cleanupTestCase()
+{
+    delete connection;
+}
+
+QTEST_GUILESS_MAIN(TestRoomMembers)
+#include "roommemberstest.moc"
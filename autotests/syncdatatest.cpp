@@ -0,0 +1,290 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fixtures.h"
+
+#include <syncdata.h>
+
+#include <QtCore/QRandomGenerator>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestSyncData : public QObject {
+    Q_OBJECT
+
+private:
+    //! A /sync response with a bit of everything the parser has to get right
+    static QJsonObject payloadJson();
+    //! Turn whatever has been parsed into JSON, to compare results
+    static QJsonObject dump(SyncData& sd);
+    //! Feed \p payload cut at \p cuts and finish streaming
+    static bool stream(SyncData& sd, const QByteArray& payload,
+                       const std::vector<qsizetype>& cuts);
+
+private Q_SLOTS:
+    void initTestCase();
+    void splitAnywhere_data();
+    void splitAnywhere();
+    void byteByByte();
+    void randomChunks();
+    void minimal();
+    void malformed_data();
+    void malformed();
+    void truncated();
+
+private:
+    QByteArray payload;
+    QJsonObject expected;
+};
+
+template <typename EventsT>
+inline QJsonArray dumpEvents(const EventsT& events)
+{
+    QJsonArray result;
+    for (const auto& e : events)
+        result.append(e->fullJson());
+    return result;
+}
+
+QJsonObject TestSyncData::payloadJson()
+{
+    const QJsonObject trickyMessage {
+        { "type"_ls, "m.room.message"_ls },
+        { "event_id"_ls, "$tricky:localhost"_ls },
+        { "sender"_ls, Fixtures::userId(1) },
+        { "origin_server_ts"_ls, 1'600'000'000'000 },
+        { "content"_ls,
+          QJsonObject {
+              { "msgtype"_ls, "m.text"_ls },
+              // Escapes, braces and commas in strings, multi-byte UTF-8
+              { "body"_ls,
+                QStringLiteral("Quotes \" and \\ backslashes, {braces}, "
+                               "[brackets], commas; Привет, 😀 ü\n\t") },
+              { "x-weird \"key\" {,}"_ls, "}]\",:"_ls } } }
+    };
+    auto joinedRoom = Fixtures::roomJson(3, 5);
+    auto timeline = joinedRoom.value("timeline"_ls).toObject();
+    auto timelineEvents = timeline.value("events"_ls).toArray();
+    timelineEvents.append(trickyMessage);
+    timeline.insert("events"_ls, timelineEvents);
+    joinedRoom.insert("timeline"_ls, timeline);
+    joinedRoom.insert(
+        "summary"_ls,
+        QJsonObject { { "m.joined_member_count"_ls, 3 },
+                      { "m.heroes"_ls, QJsonArray { Fixtures::userId(1) } } });
+
+    const QJsonObject invitedRoom {
+        { "invite_state"_ls,
+          QJsonObject { { "events"_ls,
+                          QJsonArray { Fixtures::memberEvent(
+                              100, 0, QStringLiteral("invite")) } } } }
+    };
+    const QJsonObject leftRoom {
+        { "timeline"_ls,
+          QJsonObject { { "events"_ls,
+                          QJsonArray { Fixtures::memberEvent(
+                              101, 0, QStringLiteral("leave")) } } } }
+    };
+
+    return {
+        { "next_batch"_ls, "s72595_4483_1934"_ls },
+        { "account_data"_ls,
+          QJsonObject {
+              { "events"_ls,
+                QJsonArray { QJsonObject {
+                    { "type"_ls, "org.example.custom.config"_ls },
+                    { "content"_ls,
+                      QJsonObject { { "custom_config_key"_ls, "ключ"_ls },
+                                    { "nested"_ls,
+                                      QJsonArray { 1, true, QJsonValue(),
+                                                   2.5, "}"_ls } } } } } } } } },
+        { "device_one_time_keys_count"_ls,
+          QJsonObject { { "signed_curve25519"_ls, 20 } } },
+        { "rooms"_ls,
+          QJsonObject {
+              { "join"_ls,
+                QJsonObject { { Fixtures::roomId(0), joinedRoom },
+                              { Fixtures::roomId(1), Fixtures::roomJson(2, 1, 50) } } },
+              { "invite"_ls, QJsonObject { { Fixtures::roomId(2), invitedRoom } } },
+              { "leave"_ls, QJsonObject { { Fixtures::roomId(3), leftRoom } } } } },
+        { "presence"_ls, QJsonObject { { "events"_ls, QJsonArray() } } }
+    };
+}
+
+QJsonObject TestSyncData::dump(SyncData& sd)
+{
+    QJsonObject keysCount;
+    for (auto it = sd.deviceOneTimeKeysCount().cbegin();
+         it != sd.deviceOneTimeKeysCount().cend(); ++it)
+        keysCount.insert(it.key(), it.value());
+
+    auto roomData = sd.takeRoomData();
+    // The streaming parser follows the order of the payload, parseJson()
+    // goes by join states
+    std::sort(roomData.begin(), roomData.end(),
+              [](const SyncRoomData& l, const SyncRoomData& r) {
+                  return std::pair(l.joinState, l.roomId)
+                         < std::pair(r.joinState, r.roomId);
+              });
+    QJsonArray rooms;
+    for (const auto& rd : roomData)
+        rooms.append(QJsonObject {
+            { "id"_ls, rd.roomId },
+            { "join_state"_ls, int(rd.joinState) },
+            { "joined"_ls, rd.summary.joinedMemberCount.value_or(-1) },
+            { "invited"_ls, rd.summary.invitedMemberCount.value_or(-1) },
+            { "heroes"_ls,
+              QJsonArray::fromStringList(rd.summary.heroes.value_or(
+                  QStringList { "(omitted)"_ls })) },
+            { "state"_ls, dumpEvents(rd.state) },
+            { "timeline"_ls, dumpEvents(rd.timeline) },
+            { "ephemeral"_ls, dumpEvents(rd.ephemeral) },
+            { "account_data"_ls, dumpEvents(rd.accountData) },
+            { "limited"_ls, rd.timelineLimited },
+            { "prev_batch"_ls, rd.timelinePrevBatch },
+            { "partially_read"_ls, rd.partiallyReadCount.value_or(-1) },
+            { "unread"_ls, rd.unreadCount.value_or(-1) },
+            { "highlight"_ls, rd.highlightCount.value_or(-1) } });
+
+    return { { "next_batch"_ls, sd.nextBatch() },
+             { "presence"_ls, dumpEvents(sd.takePresenceData()) },
+             { "account_data"_ls, dumpEvents(sd.takeAccountData()) },
+             { "to_device"_ls, dumpEvents(sd.takeToDeviceEvents()) },
+             { "one_time_keys"_ls, keysCount },
+             { "rooms"_ls, rooms } };
+}
+
+bool TestSyncData::stream(SyncData& sd, const QByteArray& payload,
+                          const std::vector<qsizetype>& cuts)
+{
+    qsizetype from = 0;
+    for (const auto cut : cuts) {
+        if (!sd.parseChunk(payload.mid(from, cut - from)))
+            return false;
+        from = cut;
+    }
+    return sd.parseChunk(payload.mid(from)) && sd.finishStreaming();
+}
+
+void TestSyncData::initTestCase()
+{
+    const auto json = payloadJson();
+    payload = QJsonDocument(json).toJson(QJsonDocument::Indented);
+    SyncData sd;
+    sd.parseJson(json);
+    expected = dump(sd);
+    QCOMPARE(expected.value("rooms"_ls).toArray().size(), 4);
+}
+
+void TestSyncData::splitAnywhere_data()
+{
+    QTest::addColumn<bool>("compact");
+    QTest::newRow("indented") << false;
+    QTest::newRow("compact") << true;
+}
+
+void TestSyncData::splitAnywhere()
+{
+    QFETCH(bool, compact);
+    const auto data =
+        compact ? QJsonDocument(payloadJson()).toJson(QJsonDocument::Compact)
+                : payload;
+    // Cutting at every byte covers splits inside strings, escape sequences
+    // and multi-byte UTF-8 characters, as well as between nesting levels
+    QVERIFY(data.contains("\\\""));
+    QVERIFY(data.contains("\xD0\x9F")); // П
+    for (qsizetype cut = 1; cut < data.size(); ++cut) {
+        SyncData sd;
+        QVERIFY2(stream(sd, data, { cut }),
+                 qPrintable(QStringLiteral("Failed with a cut at %1").arg(cut)));
+        QCOMPARE(dump(sd), expected);
+    }
+}
+
+void TestSyncData::byteByByte()
+{
+    std::vector<qsizetype> cuts;
+    for (qsizetype cut = 1; cut < payload.size(); ++cut)
+        cuts.push_back(cut);
+    SyncData sd;
+    QVERIFY(stream(sd, payload, cuts));
+    QCOMPARE(dump(sd), expected);
+}
+
+void TestSyncData::randomChunks()
+{
+    QRandomGenerator rng(2022);
+    for (int round = 0; round < 200; ++round) {
+        std::vector<qsizetype> cuts;
+        for (qsizetype cut = rng.bounded(1, 64); cut < payload.size();
+             cut += rng.bounded(1, 64))
+            cuts.push_back(cut);
+        SyncData sd;
+        QVERIFY(stream(sd, payload, cuts));
+        QCOMPARE(dump(sd), expected);
+    }
+}
+
+void TestSyncData::minimal()
+{
+    // The well-formed sibling of the malformed cases below
+    SyncData sd;
+    QVERIFY(stream(sd, R"({"next_batch":"s1","rooms":{"join":{}}} )", {}));
+    QCOMPARE(sd.nextBatch(), QStringLiteral("s1"));
+    QVERIFY(sd.takeRoomData().empty());
+}
+
+void TestSyncData::malformed_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::newRow("not an object") << QByteArray("[]");
+    QTest::newRow("top-level trailing comma")
+        << QByteArray(R"({"next_batch":"s1",})");
+    QTest::newRow("top-level double comma")
+        << QByteArray(R"({"next_batch":"s1",,"presence":{}})");
+    QTest::newRow("trailing comma in rooms")
+        << QByteArray(R"({"rooms":{"join":{},}})");
+    QTest::newRow("trailing comma in a join state")
+        << QByteArray(R"({"rooms":{"join":{"!a:b":{},}}})");
+    QTest::newRow("trailing comma in a room")
+        << QByteArray(R"({"rooms":{"join":{"!a:b":{"timeline":{},}}}})");
+    QTest::newRow("trailing comma in a top-level value")
+        << QByteArray(R"({"account_data":{"events":[],}})");
+    QTest::newRow("leading comma") << QByteArray(R"({,"next_batch":"s1"})");
+    QTest::newRow("missing colon") << QByteArray(R"({"next_batch" "s1"})");
+    QTest::newRow("data after the end")
+        << QByteArray(R"({"next_batch":"s1"} {})");
+    QTest::newRow("garbage after the end")
+        << QByteArray(R"({"next_batch":"s1"}x)");
+}
+
+void TestSyncData::malformed()
+{
+    QFETCH(QByteArray, data);
+    // Whole and split in every place, the result should be the same
+    for (qsizetype cut = 0; cut < data.size(); ++cut) {
+        SyncData sd;
+        QVERIFY2(!stream(sd, data, cut > 0 ? std::vector { cut }
+                                           : std::vector<qsizetype>()),
+                 qPrintable(QStringLiteral("Accepted with a cut at %1").arg(cut)));
+    }
+}
+
+void TestSyncData::truncated()
+{
+    SyncData nothingFed;
+    QVERIFY(!nothingFed.finishStreaming());
+    for (qsizetype size = 0; size < payload.size(); size += 7) {
+        // Trailing whitespace is not a truncation
+        if (payload.left(size).trimmed() == payload.trimmed())
+            break;
+        SyncData sd;
+        QVERIFY2(!stream(sd, payload.left(size), {}),
+                 qPrintable(QStringLiteral("Accepted %1 bytes").arg(size)));
+    }
+}
+
+QTEST_APPLESS_MAIN(TestSyncData)
+#include "syncdatatest.moc"
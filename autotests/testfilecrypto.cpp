@@ -4,6 +4,13 @@
 
 #include "testfilecrypto.h"
 
+#include "fixtures.h"
+
+#include "connection.h"
+#include "mediacache.h"
+#include "mxcreply.h"
+#include "syncdata.h"
+#include "e2ee/filecipherdevice.h"
 #include "events/filesourceinfo.h"
 
 #include <qtest.h>
@@ -19,4 +26,92 @@ void TestFileCrypto::encryptDecryptData()
     QCOMPARE(decrypted.size(), data.size());
     QCOMPARE(decrypted, data);
 }
-QTEST_APPLESS_MAIN(TestFileCrypto)
+
+void TestFileCrypto::streamInChunks()
+{
+    QByteArray data(100'000, '\0');
+    for (int i = 0; i < data.size(); ++i)
+        data[i] = char(i % 251);
+    auto [file, cipherText] = encryptFile(data);
+
+    // Decrypt by writing odd-sized chunks, as DownloadFileJob does
+    QByteArray decrypted;
+    QBuffer target(&decrypted);
+    FileCipherDevice decryptor(FileCipherDevice::Decrypt, &target, file);
+    QVERIFY(decryptor.open(QIODevice::WriteOnly));
+    for (int pos = 0; pos < cipherText.size(); pos += 4097)
+        QVERIFY(decryptor.write(cipherText.mid(pos, 4097)) > 0);
+    QVERIFY(decryptor.hashMatches(file));
+    QCOMPARE(decrypted, data);
+
+    // Encrypt by reading, as uploads do; the result must be decryptable
+    QBuffer source(&data);
+    auto efm = newEncryptedFileMetadata();
+    FileCipherDevice encryptor(FileCipherDevice::Encrypt, &source, efm);
+    QVERIFY(encryptor.open(QIODevice::ReadOnly));
+    QCOMPARE(encryptor.size(), qint64(data.size()));
+    QByteArray streamed;
+    while (!encryptor.atEnd())
+        streamed += encryptor.read(1000);
+    efm.hashes.insert(QStringLiteral("sha256"),
+                      QString::fromLatin1(encryptor.ciphertextHash().toBase64(
+                          QByteArray::OmitTrailingEquals)));
+    QCOMPARE(decryptFile(streamed, efm), data);
+
+    // A corrupt ciphertext must not pass the hash check
+    cipherText[0] = char(cipherText[0] ^ 1);
+    QVERIFY(decryptFile(cipherText, file).isEmpty());
+}
+
+void TestFileCrypto::serveThroughMxcReply()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    auto* connection = Connection::makeMockConnection("@bob:localhost"_ls);
+    connection->setCacheState(false);
+    Fixtures::TestRoom room(connection, Fixtures::roomId(0), JoinState::Join);
+
+    const QByteArray data = "Attachment contents";
+    auto [file, cipherText] = encryptFile(data);
+    file.url = QUrl(QStringLiteral("mxc://localhost/attachment"));
+    const auto eventId = QStringLiteral("$attachment:localhost");
+    const QJsonObject eventJson {
+        { "type"_ls, "m.room.message"_ls },
+        { "event_id"_ls, eventId },
+        { "sender"_ls, Fixtures::userId(1) },
+        { "origin_server_ts"_ls, 1'600'000'000'000 },
+        { "content"_ls, QJsonObject { { "msgtype"_ls, "m.file"_ls },
+                                      { "body"_ls, "attachment"_ls },
+                                      { "file"_ls, toJson(file) } } }
+    };
+    room.updateData(
+        { room.id(), JoinState::Join,
+          { { "timeline"_ls,
+              QJsonObject { { "events"_ls, QJsonArray { eventJson } } } } } });
+
+    auto& cache = MediaCache::instance();
+    const auto cacheKey = MediaCache::makeKey(file.url);
+    QVERIFY(cache.insert(cacheKey, cipherText, {}).isValid());
+    {
+        MxcReply reply(nullptr, cacheKey, &room, eventId);
+        QSignalSpy finishedSpy(&reply, &QNetworkReply::finished);
+        QVERIFY(finishedSpy.wait());
+        QCOMPARE(reply.error(), QNetworkReply::NoError);
+        QCOMPARE(reply.readAll(), data);
+    }
+
+    // Nothing should be served from a tampered ciphertext
+    cipherText[0] = char(cipherText[0] ^ 1);
+    QVERIFY(cache.insert(cacheKey, cipherText, {}).isValid());
+    {
+        MxcReply reply(nullptr, cacheKey, &room, eventId);
+        QSignalSpy finishedSpy(&reply, &QNetworkReply::finished);
+        QVERIFY(finishedSpy.wait());
+        QVERIFY(reply.error() != QNetworkReply::NoError);
+        QVERIFY(reply.readAll().isEmpty());
+    }
+
+    cache.remove(cacheKey);
+    delete connection;
+}
+
+QTEST_GUILESS_MAIN(TestFileCrypto)
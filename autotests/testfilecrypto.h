@@ -9,4 +9,6 @@ class TestFileCrypto : public QObject
     Q_OBJECT
 private Q_SLOTS:
     void encryptDecryptData();
+    void streamInChunks();
+    void serveThroughMxcReply();
 };
@@ -0,0 +1,151 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fixtures.h"
+
+#include <connection.h>
+#include <syncdata.h>
+#include <events/roommemberevent.h>
+#include <events/simplestateevents.h>
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+using Fixtures::TestRoom;
+
+class TestTimelineLimits : public QObject {
+    Q_OBJECT
+
+private:
+    Connection* connection = nullptr;
+
+    static QJsonObject batchJson(const QJsonArray& events,
+                                 const QString& prevBatch);
+
+private Q_SLOTS:
+    void initTestCase();
+    void evictMessages();
+    void evictCurrentState();
+    void evictPacked();
+    void cleanupTestCase();
+};
+
+QJsonObject TestTimelineLimits::batchJson(const QJsonArray& events,
+                                          const QString& prevBatch)
+{
+    return { { "timeline"_ls,
+               QJsonObject { { "events"_ls, events },
+                             { "prev_batch"_ls, prevBatch } } } };
+}
+
+void TestTimelineLimits::initTestCase()
+{
+    connection = Connection::makeMockConnection("@bob:localhost"_ls);
+    connection->setCacheState(false);
+}
+
+void TestTimelineLimits::evictMessages()
+{
+    TestRoom room(connection, QStringLiteral("!limits:localhost"),
+                  JoinState::Join);
+    room.setTimelineLimits(8);
+    QSignalSpy evictedSpy(&room, &Room::evictedMessages);
+
+    room.updateData({ room.id(), JoinState::Join,
+                      Fixtures::timelineJson(0, 8) });
+    QCOMPARE(room.timelineSize(), 8);
+    QCOMPARE(evictedSpy.count(), 0);
+
+    QJsonArray events;
+    for (int i = 8; i < 16; ++i)
+        events.append(Fixtures::messageEvent(i, 0));
+    room.updateData({ room.id(), JoinState::Join, batchJson(events, "p1"_ls) });
+    // The first batch goes away as a whole
+    QCOMPARE(evictedSpy.count(), 1);
+    QCOMPARE(room.timelineSize(), 8);
+    QCOMPARE(room.messageEvents().front()->id(),
+             QStringLiteral("$event8:localhost"));
+}
+
+void TestTimelineLimits::evictCurrentState()
+{
+    TestRoom room(connection, QStringLiteral("!limitsstate:localhost"),
+                  JoinState::Join);
+    room.setTimelineLimits(8);
+
+    // The first batch has the room name and a member of the room in it
+    QJsonArray events {
+        QJsonObject {
+            { "type"_ls, "m.room.name"_ls },
+            { "event_id"_ls, "$name:localhost"_ls },
+            { "sender"_ls, Fixtures::userId(1) },
+            { "state_key"_ls, ""_ls },
+            { "origin_server_ts"_ls, 1'600'000'000'000 },
+            { "content"_ls, QJsonObject { { "name"_ls, "Evicted name"_ls } } } },
+        Fixtures::memberEvent(0, 1)
+    };
+    for (int i = 0; i < 6; ++i)
+        events.append(Fixtures::messageEvent(i, 1));
+    room.updateData({ room.id(), JoinState::Join, batchJson(events, "p0"_ls) });
+    QCOMPARE(room.timelineSize(), 8);
+    QCOMPARE(room.name(), QStringLiteral("Evicted name"));
+
+    QJsonArray nextEvents;
+    for (int i = 6; i < 14; ++i)
+        nextEvents.append(Fixtures::messageEvent(i, 1));
+    room.updateData(
+        { room.id(), JoinState::Join, batchJson(nextEvents, "p1"_ls) });
+    QCOMPARE(room.timelineSize(), 8);
+    QCOMPARE(room.messageEvents().front()->id(),
+             QStringLiteral("$event6:localhost"));
+
+    // The state events are no more in the timeline but still in the state
+    QCOMPARE(room.name(), QStringLiteral("Evicted name"));
+    const auto* nameEvt = room.currentState().get<RoomNameEvent>();
+    QVERIFY(nameEvt);
+    QCOMPARE(nameEvt->id(), QStringLiteral("$name:localhost"));
+    const auto* memberEvt =
+        room.currentState().get<RoomMemberEvent>(Fixtures::userId(1));
+    QVERIFY(memberEvt);
+    QCOMPARE(memberEvt->membership(), Membership::Join);
+    QCOMPARE(room.memberName(Fixtures::userId(1)), QStringLiteral("User 1"));
+    QCOMPARE(room.displayName(), QStringLiteral("Evicted name"));
+}
+
+void TestTimelineLimits::evictPacked()
+{
+    TestRoom room(connection, QStringLiteral("!limitspacked:localhost"),
+                  JoinState::Join);
+    room.setTimelineLimits(8);
+    room.setCompactTimelineWindow(2);
+
+    QJsonArray events { Fixtures::memberEvent(0, 1) };
+    for (int i = 0; i < 7; ++i)
+        events.append(Fixtures::messageEvent(i, 1));
+    room.updateData({ room.id(), JoinState::Join, batchJson(events, "p0"_ls) });
+    QCOMPARE(room.timelineSize(), 8);
+
+    // Evict the first batch, mostly packed by now, as a whole
+    QJsonArray nextEvents;
+    for (int i = 7; i < 15; ++i)
+        nextEvents.append(Fixtures::messageEvent(i, 1));
+    room.updateData(
+        { room.id(), JoinState::Join, batchJson(nextEvents, "p1"_ls) });
+    QCOMPARE(room.timelineSize(), 8);
+    QCOMPARE(room.messageEvents().front()->id(),
+             QStringLiteral("$event7:localhost"));
+    // Packed events are dropped from the index along with the rest
+    QVERIFY(room.findInTimeline(QStringLiteral("$event6:localhost"))
+            == room.historyEdge());
+    // The member event that was never packed has gone to the state
+    QCOMPARE(room.memberName(Fixtures::userId(1)), QStringLiteral("User 1"));
+}
+
+void TestTimelineLimits::cleanupTestCase()
+{
+    delete connection;
+}
+
+QTEST_GUILESS_MAIN(TestTimelineLimits)
+#include "timelinelimitstest.moc"
@@ -0,0 +1,128 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fixtures.h"
+
+#include <syncdata.h>
+
+#include <QtCore/QCborValue>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QThreadPool>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class CacheBenchmark : public QObject {
+    Q_OBJECT
+
+private:
+    QTemporaryDir cacheDir;
+
+    static QByteArray serialise(const QJsonObject& json, bool binary);
+    QString writeCache(const QString& subdir, int rooms, bool binary);
+
+private Q_SLOTS:
+    void initTestCase();
+    void serialiseRoom_data();
+    void serialiseRoom();
+    void deserialiseRoom_data();
+    void deserialiseRoom();
+    void loadCache_data();
+    void loadCache();
+};
+
+QByteArray CacheBenchmark::serialise(const QJsonObject& json, bool binary)
+{
+    return binary ? QCborValue::fromJsonValue(json).toCbor()
+                  : QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+//! Write a cache with the same layout as Connection::saveState() does
+QString CacheBenchmark::writeCache(const QString& subdir, int rooms,
+                                   bool binary)
+{
+    QDir dir { cacheDir.path() };
+    if (!dir.mkpath(subdir) || !dir.cd(subdir))
+        return {};
+    QJsonObject joinedRooms;
+    for (int i = 0; i < rooms; ++i) {
+        const auto roomId = Fixtures::roomId(i);
+        QFile roomFile { dir.filePath(SyncData::fileNameForRoom(roomId)) };
+        if (!roomFile.open(QFile::WriteOnly))
+            return {};
+        roomFile.write(serialise(Fixtures::roomJson(50, 100, i * 150), binary));
+        joinedRooms.insert(roomId, QJsonValue::Null);
+    }
+    const QJsonObject rootJson {
+        { "next_batch"_ls, "s1_benchmark"_ls },
+        { "rooms"_ls, QJsonObject { { "join"_ls, joinedRooms } } },
+        { "cache_version"_ls,
+          QJsonObject { { "major"_ls, SyncData::cacheVersion().first },
+                        { "minor"_ls, SyncData::cacheVersion().second } } }
+    };
+    QFile stateFile { dir.filePath("state.json"_ls) };
+    if (!stateFile.open(QFile::WriteOnly))
+        return {};
+    stateFile.write(serialise(rootJson, binary));
+    return stateFile.fileName();
+}
+
+void CacheBenchmark::initTestCase() { QVERIFY(cacheDir.isValid()); }
+
+void CacheBenchmark::serialiseRoom_data()
+{
+    QTest::addColumn<bool>("binary");
+    QTest::newRow("JSON") << false;
+    QTest::newRow("CBOR") << true;
+}
+
+void CacheBenchmark::serialiseRoom()
+{
+    QFETCH(bool, binary);
+    const auto roomJson = Fixtures::roomJson(2000, 500);
+    QBENCHMARK {
+        QVERIFY(!serialise(roomJson, binary).isEmpty());
+    }
+}
+
+void CacheBenchmark::deserialiseRoom_data() { serialiseRoom_data(); }
+
+void CacheBenchmark::deserialiseRoom()
+{
+    QFETCH(bool, binary);
+    const auto data = serialise(Fixtures::roomJson(2000, 500), binary);
+    QBENCHMARK {
+        const auto json =
+            binary ? QCborValue::fromCbor(data).toJsonValue().toObject()
+                   : QJsonDocument::fromJson(data).object();
+        QVERIFY(!json.isEmpty());
+    }
+}
+
+void CacheBenchmark::loadCache_data()
+{
+    QTest::addColumn<QString>("stateFileName");
+    QTest::addColumn<bool>("parallel");
+    const auto jsonCache = writeCache("json"_ls, 200, false);
+    const auto cborCache = writeCache("cbor"_ls, 200, true);
+    QVERIFY(!jsonCache.isEmpty() && !cborCache.isEmpty());
+    QTest::newRow("JSON") << jsonCache << false;
+    QTest::newRow("CBOR") << cborCache << false;
+    QTest::newRow("JSON, parallel") << jsonCache << true;
+    QTest::newRow("CBOR, parallel") << cborCache << true;
+}
+
+void CacheBenchmark::loadCache()
+{
+    QFETCH(QString, stateFileName);
+    QFETCH(bool, parallel);
+    QBENCHMARK {
+        SyncData data(stateFileName, false,
+                      parallel ? QThreadPool::globalInstance() : nullptr);
+        QCOMPARE(int(data.takeRoomData().size()), 200);
+    }
+}
+
+QTEST_GUILESS_MAIN(CacheBenchmark)
+#include "cachebenchmark.moc"
@@ -0,0 +1,217 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <database.h>
+
+#include <QtCore/QStandardPaths>
+#include <QtSql/QSqlDatabase>
+#include <QtTest/QtTest>
+
+#include <array>
+
+using namespace Quotient;
+
+//! \brief Throughput of the E2EE database with 100k sessions in it
+//!
+//! Every benchmark has a row with the settings the library used before
+//! the database was tuned (no statement cache, rollback journal with full
+//! synchronisation, no indexes added in schema version 6) and a row with
+//! the current ones.
+class DatabaseBenchmark : public QObject {
+    Q_OBJECT
+
+private:
+    static constexpr int SessionsCount = 100'000;
+    static constexpr int RoomsCount = 100;
+    static constexpr int LookupsCount = 1000;
+
+    Database* db = nullptr;
+
+    //! Execute a query on the database thread and wait for it
+    void execute(const QString& queryText)
+    {
+        db->runSync([this, &queryText] { db->execute(queryText); });
+    }
+    void setIndexesEnabled(bool enabled);
+    void populate();
+
+private Q_SLOTS:
+    void initTestCase();
+    void lookupMegolmSession_data();
+    void lookupMegolmSession();
+    void lookupSentSessions_data();
+    void lookupSentSessions();
+    void writeTransactions_data();
+    void writeTransactions();
+    void cleanupTestCase();
+};
+
+// See Database::migrateTo6()
+void DatabaseBenchmark::setIndexesEnabled(bool enabled)
+{
+    static const std::array<std::pair<QLatin1String, QLatin1String>, 4> Indexes {
+        { { "tracked_devices_curve_key_idx"_ls, "tracked_devices(curveKey)"_ls },
+          { "sent_megolm_sessions_idx"_ls,
+            "sent_megolm_sessions(roomId, sessionId)"_ls },
+          { "olm_sessions_sender_key_idx"_ls, "olm_sessions(senderKey)"_ls },
+          { "inbound_session_idx"_ls,
+            "inbound_megolm_sessions(roomId, sessionId)"_ls } }
+    };
+    for (const auto& [name, columns] : Indexes)
+        execute(
+            enabled
+                ? QStringLiteral("CREATE INDEX IF NOT EXISTS %1 ON %2;")
+                      .arg(name, columns)
+                : QStringLiteral("DROP INDEX IF EXISTS %1;").arg(name));
+}
+
+void DatabaseBenchmark::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    db = new Database("@bench:localhost"_ls, "BENCHMARK"_ls,
+                      PicklingKey::generate(), this);
+    QCOMPARE(db->version(), 6);
+    db->clear();
+    execute("DELETE FROM sent_megolm_sessions;"_ls);
+    db->runSync([this] { populate(); });
+}
+
+// Runs on the database thread
+void DatabaseBenchmark::populate()
+{
+    // Pickles are never unpickled below, any data of the right size does
+    const QString pickle(300, u'p');
+    db->transaction();
+    auto& megolmQuery = db->prepareQuery(
+        "INSERT INTO inbound_megolm_sessions(roomId, sessionId, pickle) "
+        "VALUES(:roomId, :sessionId, :pickle);"_ls);
+    auto& olmQuery = db->prepareQuery(
+        "INSERT INTO olm_sessions(senderKey, sessionId, pickle) "
+        "VALUES(:senderKey, :sessionId, :pickle);"_ls);
+    auto& sentQuery = db->prepareQuery(
+        "INSERT INTO sent_megolm_sessions(roomId, userId, deviceId, "
+        "sessionId, i) VALUES(:roomId, :userId, :deviceId, :sessionId, 0);"_ls);
+    for (int i = 0; i < SessionsCount; ++i) {
+        const auto roomId = QStringLiteral("!room%1:localhost").arg(i % RoomsCount);
+        const auto sessionId = QStringLiteral("session%1").arg(i);
+        megolmQuery.bindValue(":roomId"_ls, roomId);
+        megolmQuery.bindValue(":sessionId"_ls, sessionId);
+        megolmQuery.bindValue(":pickle"_ls, pickle);
+        db->execute(megolmQuery);
+        olmQuery.bindValue(":senderKey"_ls,
+                           QStringLiteral("senderKey%1").arg(i % 1000));
+        // Olm and sent session ids are bound as QByteArray in Database
+        olmQuery.bindValue(":sessionId"_ls,
+                           QStringLiteral("olmSession%1").arg(i).toLatin1());
+        olmQuery.bindValue(":pickle"_ls, pickle);
+        db->execute(olmQuery);
+        sentQuery.bindValue(":roomId"_ls, roomId);
+        sentQuery.bindValue(":userId"_ls,
+                            QStringLiteral("@user%1:localhost").arg(i % 500));
+        sentQuery.bindValue(":deviceId"_ls, QStringLiteral("DEVICE%1").arg(i));
+        sentQuery.bindValue(":sessionId"_ls,
+                            QStringLiteral("session%1").arg(i / 10).toLatin1());
+        db->execute(sentQuery);
+    }
+    db->commit();
+}
+
+void DatabaseBenchmark::lookupMegolmSession_data()
+{
+    QTest::addColumn<bool>("tuned");
+    QTest::newRow("before") << false;
+    QTest::newRow("after") << true;
+}
+
+void DatabaseBenchmark::lookupMegolmSession()
+{
+    QFETCH(bool, tuned);
+    setIndexesEnabled(tuned);
+    const auto queryText =
+        "SELECT pickle FROM inbound_megolm_sessions "
+        "WHERE roomId=:roomId AND sessionId=:sessionId;"_ls;
+    const auto lookup = [this](QSqlQuery& query, int n) {
+        query.bindValue(":roomId"_ls,
+                        QStringLiteral("!room%1:localhost").arg(n % RoomsCount));
+        query.bindValue(":sessionId"_ls, QStringLiteral("session%1").arg(n));
+        db->execute(query);
+        return query.next();
+    };
+    QBENCHMARK {
+        // Queries can only run on the database thread
+        const auto found = db->runSync([&] {
+            int result = 0;
+            for (int i = 0; i < LookupsCount; ++i) {
+                const auto n = i * (SessionsCount / LookupsCount);
+                if (tuned)
+                    result += lookup(db->prepareQuery(queryText), n);
+                else {
+                    QSqlQuery query(db->database());
+                    query.prepare(queryText);
+                    result += lookup(query, n);
+                }
+            }
+            return result;
+        });
+        QCOMPARE(found, LookupsCount);
+    }
+    setIndexesEnabled(true);
+}
+
+void DatabaseBenchmark::lookupSentSessions_data() { lookupMegolmSession_data(); }
+
+void DatabaseBenchmark::lookupSentSessions()
+{
+    QFETCH(bool, tuned);
+    setIndexesEnabled(tuned);
+    QBENCHMARK {
+        for (int i = 0; i < LookupsCount / 10; ++i) {
+            const auto n = i * (SessionsCount / LookupsCount);
+            const auto devices = db->devicesWithoutKey(
+                QStringLiteral("!room%1:localhost").arg(n % RoomsCount),
+                { { "@user0:localhost"_ls, "NEWDEVICE"_ls } },
+                QStringLiteral("session%1").arg(n / 10).toLatin1());
+            QCOMPARE(int(devices.size()), 1);
+        }
+    }
+    setIndexesEnabled(true);
+}
+
+void DatabaseBenchmark::writeTransactions_data()
+{
+    QTest::addColumn<QString>("journalMode");
+    QTest::addColumn<QString>("synchronous");
+    QTest::newRow("before") << QStringLiteral("DELETE")
+                            << QStringLiteral("FULL");
+    QTest::newRow("after") << QStringLiteral("WAL") << QStringLiteral("NORMAL");
+}
+
+void DatabaseBenchmark::writeTransactions()
+{
+    QFETCH(QString, journalMode);
+    QFETCH(QString, synchronous);
+    execute("PRAGMA journal_mode=%1;"_ls.arg(journalMode));
+    execute("PRAGMA synchronous=%1;"_ls.arg(synchronous));
+    // Each call is a separate transaction, as it is when olm messages
+    // are received one by one
+    QBENCHMARK {
+        for (int i = 0; i < 100; ++i)
+            db->setOlmSessionLastReceived(
+                QStringLiteral("olmSession%1").arg(i).toLatin1(),
+                QDateTime::currentDateTime());
+        // Writes are asynchronous; wait until they are done
+        db->runSync([] {});
+    }
+    execute("PRAGMA journal_mode=WAL;"_ls);
+    execute("PRAGMA synchronous=NORMAL;"_ls);
+}
+
+void DatabaseBenchmark::cleanupTestCase()
+{
+    db->clear();
+    execute("DELETE FROM sent_megolm_sessions;"_ls);
+}
+
+QTEST_GUILESS_MAIN(DatabaseBenchmark)
+#include "databasebenchmark.moc"
@@ -0,0 +1,138 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fixtures.h"
+
+#include <connection.h>
+#include <eventstats.h>
+#include <room.h>
+#include <syncdata.h>
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+using Fixtures::TestRoom;
+
+class SyncBenchmark : public QObject {
+    Q_OBJECT
+
+private:
+    Connection* connection = nullptr;
+
+    static void addSyncShapes();
+
+private Q_SLOTS:
+    void initTestCase();
+    void parseJson_data();
+    void parseJson();
+    void parseChunks_data();
+    void parseChunks();
+    void updateData_data();
+    void updateData();
+    void eventStats();
+    void roomToJson();
+    void cleanupTestCase();
+};
+
+void SyncBenchmark::addSyncShapes()
+{
+    QTest::addColumn<QJsonObject>("syncJson");
+    QTest::newRow("500 small rooms") << Fixtures::syncJson(500, 5, 10);
+    QTest::newRow("5 rooms with long timelines")
+        << Fixtures::syncJson(5, 20, 2000);
+    QTest::newRow("10 rooms with many members")
+        << Fixtures::syncJson(10, 2000, 20);
+}
+
+void SyncBenchmark::initTestCase()
+{
+    connection = Connection::makeMockConnection("@bench:localhost"_ls);
+    connection->setCacheState(false);
+}
+
+void SyncBenchmark::parseJson_data() { addSyncShapes(); }
+
+void SyncBenchmark::parseJson()
+{
+    QFETCH(QJsonObject, syncJson);
+    const auto roomsCount = int(
+        syncJson.value("rooms"_ls).toObject().value("join"_ls).toObject().size());
+    QBENCHMARK {
+        SyncData data;
+        data.parseJson(syncJson);
+        QCOMPARE(int(data.takeRoomData().size()), roomsCount);
+    }
+}
+
+void SyncBenchmark::parseChunks_data() { addSyncShapes(); }
+
+void SyncBenchmark::parseChunks()
+{
+    QFETCH(QJsonObject, syncJson);
+    const auto roomsCount = int(
+        syncJson.value("rooms"_ls).toObject().value("join"_ls).toObject().size());
+    const auto bytes = QJsonDocument(syncJson).toJson(QJsonDocument::Compact);
+    // Roughly what a network reply delivers at a time
+    constexpr auto ChunkSize = 16 * 1024;
+    QBENCHMARK {
+        SyncData data;
+        for (int pos = 0; pos < bytes.size(); pos += ChunkSize)
+            QVERIFY(data.parseChunk(bytes.mid(pos, ChunkSize)));
+        QVERIFY(data.finishStreaming());
+        QCOMPARE(int(data.takeRoomData().size()), roomsCount);
+    }
+}
+
+void SyncBenchmark::updateData_data()
+{
+    QTest::addColumn<int>("members");
+    QTest::addColumn<int>("messages");
+    QTest::newRow("100 messages") << 10 << 100;
+    QTest::newRow("5000 messages") << 10 << 5000;
+    QTest::newRow("5000 members") << 5000 << 10;
+}
+
+void SyncBenchmark::updateData()
+{
+    QFETCH(int, members);
+    QFETCH(int, messages);
+    const auto roomJson = Fixtures::roomJson(members, messages);
+    QBENCHMARK {
+        TestRoom room(connection, Fixtures::roomId(0), JoinState::Join);
+        room.updateData({ room.id(), JoinState::Join, roomJson });
+        QCOMPARE(room.timelineSize(), messages);
+    }
+}
+
+void SyncBenchmark::eventStats()
+{
+    TestRoom room(connection, Fixtures::roomId(0), JoinState::Join);
+    room.updateData(
+        { room.id(), JoinState::Join, Fixtures::roomJson(10, 10000) });
+    QBENCHMARK {
+        const auto stats = EventStats::fromRange(
+            &room, EventStats::marker_t(room.syncEdge()), room.historyEdge());
+        QVERIFY(stats.notableCount > 0);
+    }
+}
+
+void SyncBenchmark::roomToJson()
+{
+    TestRoom room(connection, Fixtures::roomId(0), JoinState::Join);
+    room.updateData(
+        { room.id(), JoinState::Join, Fixtures::roomJson(2000, 100) });
+    QBENCHMARK {
+        const auto json = room.toJson();
+        QVERIFY(!json.isEmpty());
+    }
+}
+
+void SyncBenchmark::cleanupTestCase()
+{
+    delete connection;
+}
+
+QTEST_GUILESS_MAIN(SyncBenchmark)
+#include "syncbenchmark.moc"
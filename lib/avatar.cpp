@@ -22,8 +22,8 @@ public:
     explicit Private(QUrl url = {}) : _url(std::move(url)) {}
     ~Private()
     {
-        if (isJobPending(_thumbnailRequest))
-            _thumbnailRequest->abandon();
+        // The thumbnail request may be shared with other avatars
+        QObject::disconnect(_thumbnailConnection);
         if (isJobPending(_uploadRequest))
             _uploadRequest->abandon();
     }
@@ -43,6 +43,7 @@ public:
     mutable QSize _requestedSize;
     mutable enum { Unknown, Cache, Network, Banned } _imageSource = Unknown;
     mutable QPointer<MediaThumbnailJob> _thumbnailRequest = nullptr;
+    mutable QMetaObject::Connection _thumbnailConnection;
     mutable QPointer<BaseJob> _uploadRequest = nullptr;
     mutable std::vector<get_callback_t> callbacks;
 };
@@ -106,22 +107,24 @@ QImage Avatar::Private::get(Connection* connection, QSize size,
         && checkUrl(_url)) {
         qCDebug(MAIN) << "Getting avatar from" << _url.toString();
         _requestedSize = size;
-        if (isJobPending(_thumbnailRequest))
-            _thumbnailRequest->abandon();
+        QObject::disconnect(_thumbnailConnection);
         if (callback)
             callbacks.emplace_back(std::move(callback));
-        _thumbnailRequest = connection->getThumbnail(_url, size);
-        QObject::connect(_thumbnailRequest, &MediaThumbnailJob::success,
-                         _thumbnailRequest, [this] {
-                             _imageSource = Network;
-                             _originalImage = _thumbnailRequest->scaledThumbnail(
-                                 _requestedSize);
-                             _originalImage.save(localFile());
-                             _scaledImages.clear();
-                             for (const auto& n : callbacks)
-                                 n();
-                             callbacks.clear();
-                         });
+        // Avatars of the same user in different rooms are requested at once
+        _thumbnailRequest = connection->callApiShared<MediaThumbnailJob>(
+            BackgroundRequest, _url, size);
+        _thumbnailConnection = QObject::connect(
+            _thumbnailRequest, &MediaThumbnailJob::success, _thumbnailRequest,
+            [this] {
+                _imageSource = Network;
+                _originalImage =
+                    _thumbnailRequest->scaledThumbnail(_requestedSize);
+                _originalImage.save(localFile());
+                _scaledImages.clear();
+                for (const auto& n : callbacks)
+                    n();
+                callbacks.clear();
+            });
     }
 
     for (const auto& [scaledSize, scaledImage] : _scaledImages)
@@ -175,7 +178,7 @@ bool Avatar::updateUrl(const QUrl& newUrl)
 
     d->_url = newUrl;
     d->_imageSource = Private::Unknown;
-    if (isJobPending(d->_thumbnailRequest))
-        d->_thumbnailRequest->abandon();
+    QObject::disconnect(d->_thumbnailConnection);
+    d->_thumbnailRequest = nullptr;
     return true;
 }
@@ -8,6 +8,8 @@
 
 #include "accountregistry.h"
 #include "connectiondata.h"
+#include "metrics.h"
+#include "pushruleengine.h"
 #include "qt_connection_util.h"
 #include "room.h"
 #include "settings.h"
@@ -31,6 +33,7 @@
 #include "jobs/downloadfilejob.h"
 #include "jobs/mediathumbnailjob.h"
 #include "jobs/syncjob.h"
+#include <list>
 #include <variant>
 
 #ifdef Quotient_E2EE_ENABLED
@@ -59,6 +62,7 @@
 #include <QtCore/QRegularExpression>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
+#include <QtCore/QThreadPool>
 #include <QtNetwork/QDnsLookup>
 
 using namespace Quotient;
@@ -126,8 +130,34 @@ public:
 
     QHash<QString, KeyVerificationSession*> verificationSessions;
     QSet<std::pair<QString, QString>> triedDevices;
+
+    // Inbound megolm sessions keyed by room id and session id, the most
+    // recently used first
+    using MegolmSessionKey = std::pair<QString, QString>;
+    std::list<std::pair<MegolmSessionKey, QOlmInboundGroupSession>>
+        megolmSessions;
+    QHash<MegolmSessionKey, decltype(megolmSessions)::iterator>
+        megolmSessionsIndex;
+    //! Sessions recently looked up and not found in the database
+    QSet<MegolmSessionKey> missingMegolmSessions;
+    int megolmSessionCacheSize = 1000;
+
+    QOlmInboundGroupSession* cacheMegolmSession(
+        MegolmSessionKey key, QOlmInboundGroupSession&& session);
+    void trimMegolmSessions();
+
+    //! Ids of events that couldn't be decrypted, by room id and session id
+    QHash<MegolmSessionKey, QSet<QString>> undecryptedEvents;
+    //! Megolm sessions that received keys since the last retry, by room id
+    QHash<QString, QSet<QString>> sessionsToRetry;
+    void retryDecryption();
 #endif
 
+    PushRuleEngine pushRuleEngine;
+
+    //! Pending jobs started with callApiShared(), by job type and request URL
+    QHash<QString, QPointer<BaseJob>> sharedJobs;
+
     GetCapabilitiesJob* capabilitiesJob = nullptr;
     GetCapabilitiesJob::Capabilities capabilities;
 
@@ -151,6 +181,12 @@ public:
                  SettingsGroup("libQMatrixClient").get<QString>("cache_type"))
         != "json";
     bool lazyLoading = false;
+    bool lazyCacheLoading = false;
+    bool syncPipelining = false;
+    bool parallelCacheLoading =
+        SettingsGroup("libQuotient").get("parallel_cache_loading", true);
+    //! The room state journal is always appended to until it reaches this size
+    qint64 minJournalSizeToCompact = 64 * 1024;
 
     /** \brief Check the homeserver and resolve it if needed, before connecting
      *
@@ -177,6 +213,7 @@ public:
 
     void consumeRoomData(SyncDataList&& roomDataList, bool fromCache);
     void consumeAccountData(Events&& accountDataEvents);
+    void updatePushRules(const Events& accountDataEvents);
     void consumePresenceData(Events&& presenceData);
     void consumeToDeviceEvents(Events&& toDeviceEvents);
     void consumeDevicesList(DevicesList&& devicesList);
@@ -305,15 +342,14 @@ public:
                          << encryptedEvent.senderKey()
                          << olmAccount->oneTimeKeys().keys;
 
-            auto query = database->prepareQuery("SELECT deviceId FROM tracked_devices WHERE curveKey=:curveKey;"_ls);
-            query.bindValue(":curveKey"_ls, encryptedEvent.senderKey());
-            database->execute(query);
-            if (!query.next()) {
+            const auto* device = findDeviceByCurveKey(
+                encryptedEvent.senderId(), encryptedEvent.senderKey());
+            if (!device) {
                 qCWarning(E2EE) << "Unknown device while trying to recover from broken olm session";
                 return {};
             }
             auto senderId = encryptedEvent.senderId();
-            auto deviceId = query.value("deviceId"_ls).toString();
+            auto deviceId = device->deviceId;
             QHash<QString, QHash<QString, QString>> hash{
                 { encryptedEvent.senderId(), { { deviceId, "signed_curve25519"_ls } } }
             };
@@ -340,17 +376,18 @@ public:
             return {};
         }
 
-        auto query = database->prepareQuery(QStringLiteral("SELECT edKey FROM tracked_devices WHERE curveKey=:curveKey;"));
-        query.bindValue(":curveKey", encryptedEvent.contentJson()["sender_key"].toString());
-        database->execute(query);
-        if (!query.next()) {
+        const auto* device = findDeviceByCurveKey(
+            encryptedEvent.senderId(),
+            encryptedEvent.contentJson()["sender_key"].toString());
+        if (!device) {
             qWarning(E2EE)
                 << "Received olm message from unknown device"
                 << encryptedEvent.contentJson()["sender_key"].toString();
             return {};
         }
         auto edKey = decryptedEvent->fullJson()["keys"]["ed25519"].toString();
-        if (edKey.isEmpty() || query.value(QStringLiteral("edKey")).toString() != edKey) {
+        if (edKey.isEmpty()
+            || device->keys.value("ed25519:"_ls + device->deviceId) != edKey) {
             qDebug(E2EE) << "Received olm message with invalid ed key";
             return {};
         }
@@ -377,6 +414,12 @@ public:
 #endif // Quotient_E2EE_ENABLED
     }
 #ifdef Quotient_E2EE_ENABLED
+    //! \brief Find a tracked device by its Curve25519 key
+    //!
+    //! This only looks at the device keys in memory, so that decrypting
+    //! to-device messages doesn't have to wait for the database.
+    const DeviceKeys* findDeviceByCurveKey(const QString& userId,
+                                           const QString& curveKey) const;
     bool isKnownCurveKey(const QString& userId, const QString& curveKey) const;
 
     void loadOutdatedUserDevices();
@@ -789,7 +832,9 @@ void Connection::sync(int timeout)
     filter.room.state.lazyLoadMembers.emplace(d->lazyLoading);
     auto job = d->syncJob =
         callApi<SyncJob>(BackgroundRequest, d->data->lastEvent(), filter,
-                         timeout);
+                         timeout, QString(),
+                         d->syncPipelining ? QThreadPool::globalInstance()
+                                           : nullptr);
     connect(job, &SyncJob::success, this, [this, job] {
         onSyncSuccess(job->takeData());
         d->syncJob = nullptr;
@@ -856,6 +901,10 @@ QJsonObject toJson(const DirectChatsMap& directChats)
 void Connection::onSyncSuccess(SyncData&& data, bool fromCache)
 {
 #ifdef Quotient_E2EE_ENABLED
+    // Sessions and replay protection records saved while processing the sync
+    // response, including room updates queued below, go in one transaction
+    if (d->database)
+        d->database->transaction();
     d->oneTimeKeysCount = data.deviceOneTimeKeysCount();
     if (d->oneTimeKeysCount[SignedCurve25519Key] < 0.4 * d->olmAccount->maxNumberOfOneTimeKeys()
         && !d->isUploadingKeys) {
@@ -879,15 +928,22 @@ void Connection::onSyncSuccess(SyncData&& data, bool fromCache)
 #endif // Quotient_E2EE_ENABLED
     d->consumeToDeviceEvents(data.takeToDeviceEvents());
     d->data->setLastEvent(data.nextBatch());
+    // Push rules are needed to evaluate events arriving in the same batch
+    auto accountData = data.takeAccountData();
+    d->updatePushRules(accountData);
     d->consumeRoomData(data.takeRoomData(), fromCache);
-    d->consumeAccountData(data.takeAccountData());
+    d->consumeAccountData(std::move(accountData));
     d->consumePresenceData(data.takePresenceData());
 #ifdef Quotient_E2EE_ENABLED
     if(d->encryptionUpdateRequired) {
         d->loadOutdatedUserDevices();
         d->encryptionUpdateRequired = false;
     }
+    if (d->database)
+        d->database->commitLater();
 #endif
+    if (!fromCache)
+        Metrics::publish();
 }
 
 void Connection::Private::consumeRoomData(SyncDataList&& roomDataList,
@@ -921,6 +977,24 @@ void Connection::Private::consumeRoomData(SyncDataList&& roomDataList,
     }
 }
 
+void Connection::Private::updatePushRules(const Events& accountDataEvents)
+{
+    static const auto PushRulesType = QStringLiteral("m.push_rules");
+    for (const auto& event : accountDataEvents)
+        if (event->matrixType() == PushRulesType) {
+            if (const auto& currentRules = q->accountData(PushRulesType);
+                currentRules
+                && currentRules->contentJson() == event->contentJson())
+                continue;
+            QElapsedTimer et;
+            et.start();
+            pushRuleEngine = PushRuleEngine(fromJson<PushRuleset>(
+                event->contentJson().value("global"_ls)));
+            qCDebug(PROFILER) << "Compiled push rules for" << data->userId()
+                              << "in" << et;
+        }
+}
+
 void Connection::Private::consumeAccountData(Events&& accountDataEvents)
 {
     // After running this loop, the account data events not saved in
@@ -1678,6 +1752,14 @@ void Connection::Private::removeRoom(const QString& roomId)
             emit r->beforeDestruction(r);
             r->deleteLater();
         }
+#ifdef Quotient_E2EE_ENABLED
+    for (auto it = undecryptedEvents.begin(); it != undecryptedEvents.end();)
+        if (it.key().first == roomId)
+            it = undecryptedEvents.erase(it);
+        else
+            ++it;
+    sessionsToRetry.remove(roomId);
+#endif
 }
 
 void Connection::addToDirectChats(const Room* room, User* user)
@@ -1730,6 +1812,11 @@ bool Connection::isIgnored(const User* user) const
     return ignoredUsers().contains(user->id());
 }
 
+const PushRuleEngine& Connection::pushRuleEngine() const
+{
+    return d->pushRuleEngine;
+}
+
 IgnoredUsersList Connection::ignoredUsers() const
 {
     const auto* event = accountData<IgnoredUsersEvent>();
@@ -1888,15 +1975,70 @@ void Connection::saveRoomState(Room* r) const
     if (!d->cacheState)
         return;
 
-    QFile outRoomFile { stateCacheDir().filePath(
-        SyncData::fileNameForRoom(r->id())) };
+    // Don't overwrite the full cached state with what's only in the summary
+    r->loadCachedState();
+
+    QElapsedTimer et;
+    et.start();
+
+    const auto cacheDir = stateCacheDir();
+    QFile outRoomFile { cacheDir.filePath(SyncData::fileNameForRoom(r->id())) };
+    QFile journalFile { cacheDir.filePath(
+        SyncData::journalFileNameForRoom(r->id())) };
+    // A journal left over from a run with a different cache type cannot be
+    // appended to: SyncData reads all records in the format of the first one
+    const auto journalFormatMatches = [this, &journalFile] {
+        if (journalFile.size() == 0 || !journalFile.open(QFile::ReadOnly))
+            return true;
+        const auto isJson = journalFile.peek(1).startsWith('{');
+        journalFile.close();
+        return isJson != d->cacheToBinary;
+    };
+    // Append changes to the journal unless it's grown big enough, compared to
+    // the snapshot, to make rewriting the snapshot worth it. Keeping the ratio
+    // constant makes the amortised save cost proportional to the size of
+    // changes rather than to the size of the room.
+    if (!r->needsFullStateSave() && outRoomFile.exists()
+        && journalFile.size()
+               < std::max(outRoomFile.size() / 2, d->minJournalSizeToCompact)
+        && journalFormatMatches()) {
+        if (journalFile.open(QFile::Append)) {
+            const auto changesJson = r->stateChangesToJson();
+            const auto data =
+                d->cacheToBinary
+                    ? QCborValue::fromJsonValue(changesJson).toCbor()
+                    : QJsonDocument(changesJson).toJson(QJsonDocument::Compact)
+                          + '\n';
+            if (journalFile.write(data) == data.size()) {
+                r->markStateSaved(false);
+                Metrics::cacheSaveTime.observe(et);
+                if (et.nsecsElapsed() >= ProfilerMinNsecs)
+                    qCDebug(PROFILER) << "Room state changes for" << r->id()
+                                      << "saved in" << et;
+                return;
+            }
+            // Drop the torn record, if any, and save the whole state
+            qCWarning(MAIN) << "Error appending to" << journalFile.fileName()
+                            << ":" << journalFile.errorString();
+            journalFile.close();
+        }
+    }
+
     if (outRoomFile.open(QFile::WriteOnly)) {
         const auto data =
             d->cacheToBinary
                 ? QCborValue::fromJsonValue(r->toJson()).toCbor()
                 : QJsonDocument(r->toJson()).toJson(QJsonDocument::Compact);
         outRoomFile.write(data.data(), data.size());
+        if (journalFile.exists() && !journalFile.remove())
+            qCWarning(MAIN) << "Could not remove" << journalFile.fileName()
+                            << "- the cached room state is inconsistent";
+        r->markStateSaved(true);
+        Metrics::cacheSaveTime.observe(et);
         qCDebug(MAIN) << "Room state cache saved to" << outRoomFile.fileName();
+        if (et.nsecsElapsed() >= ProfilerMinNsecs)
+            qCDebug(PROFILER) << "Room state for" << r->id() << "saved in"
+                              << et;
     } else {
         qCWarning(MAIN) << "Error opening" << outRoomFile.fileName() << ":"
                         << outRoomFile.errorString();
@@ -1933,7 +2075,7 @@ void Connection::saveState() const
             if (r->joinState() == JoinState::Leave)
                 continue;
             (r->joinState() == JoinState::Invite ? inviteRoomsJson : roomsJson)
-                .insert(r->id(), QJsonValue::Null);
+                .insert(r->id(), r->summaryRecordToJson());
         }
 
         QJsonObject roomObj;
@@ -1970,6 +2112,7 @@ void Connection::saveState() const
     qCDebug(PROFILER) << "Cache for" << userId() << "generated in" << et;
 
     outFile.write(data.data(), data.size());
+    Metrics::cacheSaveTime.observe(et);
     qCDebug(MAIN) << "State cache saved to" << outFile.fileName();
 }
 
@@ -1981,7 +2124,9 @@ void Connection::loadState()
     QElapsedTimer et;
     et.start();
 
-    SyncData sync { d->topLevelStatePath() };
+    SyncData sync { d->topLevelStatePath(), d->lazyCacheLoading,
+                    d->parallelCacheLoading ? QThreadPool::globalInstance()
+                                            : nullptr };
     if (sync.nextBatch().isEmpty()) // No token means no cache by definition
         return;
 
@@ -2018,6 +2163,20 @@ void Connection::setCacheState(bool newValue)
     }
 }
 
+bool Connection::lazyCacheLoading() const { return d->lazyCacheLoading; }
+
+void Connection::setLazyCacheLoading(bool newValue)
+{
+    d->lazyCacheLoading = newValue;
+}
+
+bool Connection::syncPipelining() const { return d->syncPipelining; }
+
+void Connection::setSyncPipelining(bool newValue)
+{
+    d->syncPipelining = newValue;
+}
+
 bool Connection::lazyLoading() const { return d->lazyLoading; }
 
 void Connection::setLazyLoading(bool newValue)
@@ -2038,6 +2197,23 @@ BaseJob* Connection::run(BaseJob* job, RunningPolicy runningPolicy)
     return job;
 }
 
+BaseJob* Connection::findSharedJob(const QString& key) const
+{
+    const auto job = d->sharedJobs.value(key);
+    return isJobPending(job) ? job.data() : nullptr;
+}
+
+void Connection::addSharedJob(const QString& key, BaseJob* job)
+{
+    d->sharedJobs.insert(key, job);
+    connect(job, &BaseJob::finished, this, [this, key, job] {
+        // The key may already refer to a newer job if this one was abandoned
+        if (const auto it = d->sharedJobs.find(key);
+            it != d->sharedJobs.end() && (it->isNull() || *it == job))
+            d->sharedJobs.erase(it);
+    });
+}
+
 void Connection::getTurnServers()
 {
     auto job = callApi<GetTurnServerJob>();
@@ -2188,79 +2364,81 @@ void Connection::Private::loadOutdatedUserDevices()
 
 void Connection::Private::saveDevicesList()
 {
-    q->database()->transaction();
-    auto query = q->database()->prepareQuery(
-        QStringLiteral("DELETE FROM tracked_users"));
-    q->database()->execute(query);
-    query.prepare(QStringLiteral(
-        "INSERT INTO tracked_users(matrixId) VALUES(:matrixId);"));
-    for (const auto& user : trackedUsers) {
-        query.bindValue(":matrixId", user);
-        q->database()->execute(query);
-    }
-
-    query.prepare(QStringLiteral("DELETE FROM outdated_users"));
-    q->database()->execute(query);
-    query.prepare(QStringLiteral(
-        "INSERT INTO outdated_users(matrixId) VALUES(:matrixId);"));
-    for (const auto& user : outdatedUsers) {
-        query.bindValue(":matrixId", user);
-        q->database()->execute(query);
-    }
-
-    query.prepare(QStringLiteral(
-        "INSERT INTO tracked_devices"
-        "(matrixId, deviceId, curveKeyId, curveKey, edKeyId, edKey, verified) "
-        "SELECT :matrixId, :deviceId, :curveKeyId, :curveKey, :edKeyId, :edKey, :verified WHERE NOT EXISTS(SELECT 1 FROM tracked_devices WHERE matrixId=:matrixId AND deviceId=:deviceId);"
-        ));
-    for (const auto& [user, devices] : asKeyValueRange(deviceKeys)) {
-        for (const auto& device : devices) {
-            auto keys = device.keys.keys();
-            auto curveKeyId = keys[0].startsWith("curve"_ls) ? keys[0] : keys[1];
-            auto edKeyId = keys[0].startsWith("ed"_ls) ? keys[0] : keys[1];
-
-            query.bindValue(":matrixId", user);
-            query.bindValue(":deviceId", device.deviceId);
-            query.bindValue(":curveKeyId", curveKeyId);
-            query.bindValue(":curveKey", device.keys[curveKeyId]);
-            query.bindValue(":edKeyId", edKeyId);
-            query.bindValue(":edKey", device.keys[edKeyId]);
-            // If the device gets saved here, it can't be verified
-            query.bindValue(":verified", false);
-
-            q->database()->execute(query);
+    auto* const db = q->database();
+    // Write a snapshot of the lists; the copies are cheap as Qt containers
+    // are implicitly shared
+    db->runAsync([db, trackedUsers = trackedUsers,
+                  outdatedUsers = outdatedUsers, deviceKeys = deviceKeys] {
+        db->transaction();
+        db->execute(QStringLiteral("DELETE FROM tracked_users"));
+        auto& trackedUsersQuery = db->prepareQuery(QStringLiteral(
+            "INSERT INTO tracked_users(matrixId) VALUES(:matrixId);"));
+        for (const auto& user : trackedUsers) {
+            trackedUsersQuery.bindValue(":matrixId", user);
+            db->execute(trackedUsersQuery);
         }
-    }
-    q->database()->commit();
+
+        db->execute(QStringLiteral("DELETE FROM outdated_users"));
+        auto& outdatedUsersQuery = db->prepareQuery(QStringLiteral(
+            "INSERT INTO outdated_users(matrixId) VALUES(:matrixId);"));
+        for (const auto& user : outdatedUsers) {
+            outdatedUsersQuery.bindValue(":matrixId", user);
+            db->execute(outdatedUsersQuery);
+        }
+
+        auto& query = db->prepareQuery(QStringLiteral(
+            "INSERT INTO tracked_devices"
+            "(matrixId, deviceId, curveKeyId, curveKey, edKeyId, edKey, verified) "
+            "SELECT :matrixId, :deviceId, :curveKeyId, :curveKey, :edKeyId, :edKey, :verified WHERE NOT EXISTS(SELECT 1 FROM tracked_devices WHERE matrixId=:matrixId AND deviceId=:deviceId);"
+            ));
+        for (const auto& [user, devices] : asKeyValueRange(deviceKeys)) {
+            for (const auto& device : devices) {
+                auto keys = device.keys.keys();
+                auto curveKeyId = keys[0].startsWith("curve"_ls) ? keys[0] : keys[1];
+                auto edKeyId = keys[0].startsWith("ed"_ls) ? keys[0] : keys[1];
+
+                query.bindValue(":matrixId", user);
+                query.bindValue(":deviceId", device.deviceId);
+                query.bindValue(":curveKeyId", curveKeyId);
+                query.bindValue(":curveKey", device.keys[curveKeyId]);
+                query.bindValue(":edKeyId", edKeyId);
+                query.bindValue(":edKey", device.keys[edKeyId]);
+                // If the device gets saved here, it can't be verified
+                query.bindValue(":verified", false);
+
+                db->execute(query);
+            }
+        }
+        db->commit();
+    });
 }
 
 void Connection::Private::loadDevicesList()
 {
-    auto query = q->database()->prepareQuery(QStringLiteral("SELECT * FROM tracked_users;"));
-    q->database()->execute(query);
-    while(query.next()) {
-        trackedUsers += query.value(0).toString();
-    }
-
-    query = q->database()->prepareQuery(QStringLiteral("SELECT * FROM outdated_users;"));
-    q->database()->execute(query);
-    while(query.next()) {
-        outdatedUsers += query.value(0).toString();
-    }
+    auto* const db = q->database();
+    db->runSync([this, db] {
+        auto query = db->execute(QStringLiteral("SELECT * FROM tracked_users;"));
+        while(query.next()) {
+            trackedUsers += query.value(0).toString();
+        }
 
-    query = q->database()->prepareQuery(QStringLiteral("SELECT * FROM tracked_devices;"));
-    q->database()->execute(query);
-    while(query.next()) {
-        deviceKeys[query.value("matrixId").toString()][query.value("deviceId").toString()] = DeviceKeys {
-            query.value("matrixId").toString(),
-            query.value("deviceId").toString(),
-            { "m.olm.v1.curve25519-aes-sha2", "m.megolm.v1.aes-sha2"},
-            {{query.value("curveKeyId").toString(), query.value("curveKey").toString()},
-             {query.value("edKeyId").toString(), query.value("edKey").toString()}},
-             {} // Signatures are not saved/loaded as they are not needed after initial validation
-        };
-    }
+        query = db->execute(QStringLiteral("SELECT * FROM outdated_users;"));
+        while(query.next()) {
+            outdatedUsers += query.value(0).toString();
+        }
 
+        query = db->execute(QStringLiteral("SELECT * FROM tracked_devices;"));
+        while(query.next()) {
+            deviceKeys[query.value("matrixId").toString()][query.value("deviceId").toString()] = DeviceKeys {
+                query.value("matrixId").toString(),
+                query.value("deviceId").toString(),
+                { "m.olm.v1.curve25519-aes-sha2", "m.megolm.v1.aes-sha2"},
+                {{query.value("curveKeyId").toString(), query.value("curveKey").toString()},
+                 {query.value("edKeyId").toString(), query.value("edKey").toString()}},
+                 {} // Signatures are not saved/loaded as they are not needed after initial validation
+            };
+        }
+    });
 }
 
 void Connection::encryptionUpdate(const Room* room, const QList<User*>& invited)
@@ -2307,6 +2485,119 @@ void Connection::saveMegolmSession(const Room* room,
     database()->saveMegolmSession(room->id(), session);
 }
 
+QOlmInboundGroupSession* Connection::megolmSession(const QString& roomId,
+                                                   const QString& sessionId)
+{
+    Private::MegolmSessionKey key { roomId, sessionId };
+    if (const auto it = d->megolmSessionsIndex.constFind(key);
+        it != d->megolmSessionsIndex.cend()) {
+        // Move the session to the front; list iterators remain valid
+        d->megolmSessions.splice(d->megolmSessions.begin(), d->megolmSessions,
+                                 *it);
+        return &d->megolmSessions.front().second;
+    }
+    // Events from a session with no keys yet would otherwise hit
+    // the database on every decryption attempt
+    if (d->missingMegolmSessions.contains(key))
+        return nullptr;
+
+    auto session = database()->loadMegolmSession(roomId, sessionId.toLatin1());
+    if (!session) {
+        if (d->missingMegolmSessions.size() >= d->megolmSessionCacheSize)
+            d->missingMegolmSessions.clear();
+        d->missingMegolmSessions.insert(std::move(key));
+        return nullptr;
+    }
+    return d->cacheMegolmSession(std::move(key), std::move(*session));
+}
+
+void Connection::addMegolmSession(const Room* room,
+                                  QOlmInboundGroupSession&& session)
+{
+    saveMegolmSession(room, session);
+    d->cacheMegolmSession({ room->id(), QString::fromLatin1(session.sessionId()) },
+                          std::move(session));
+}
+
+int Connection::megolmSessionCacheSize() const
+{
+    return d->megolmSessionCacheSize;
+}
+
+void Connection::setMegolmSessionCacheSize(int size)
+{
+    d->megolmSessionCacheSize = std::max(size, 1);
+    d->trimMegolmSessions();
+}
+
+QOlmInboundGroupSession* Connection::Private::cacheMegolmSession(
+    MegolmSessionKey key, QOlmInboundGroupSession&& session)
+{
+    missingMegolmSessions.remove(key);
+    if (const auto it = megolmSessionsIndex.constFind(key);
+        it != megolmSessionsIndex.cend()) {
+        // Replace in place, so that pointers to the session stay valid
+        megolmSessions.splice(megolmSessions.begin(), megolmSessions, *it);
+        megolmSessions.front().second = std::move(session);
+        return &megolmSessions.front().second;
+    }
+    megolmSessions.emplace_front(key, std::move(session));
+    megolmSessionsIndex.insert(std::move(key), megolmSessions.begin());
+    trimMegolmSessions();
+    return &megolmSessions.front().second;
+}
+
+void Connection::Private::trimMegolmSessions()
+{
+    // Evicted sessions need not be saved: decryption doesn't change them
+    while (megolmSessions.size() > size_t(megolmSessionCacheSize)) {
+        megolmSessionsIndex.remove(megolmSessions.back().first);
+        megolmSessions.pop_back();
+    }
+}
+
+void Connection::addUndecryptedEvent(const QString& roomId,
+                                     const QString& sessionId,
+                                     const QString& eventId)
+{
+    d->undecryptedEvents[{ roomId, sessionId }] += eventId;
+}
+
+void Connection::removeUndecryptedEvent(const QString& roomId,
+                                        const QString& sessionId,
+                                        const QString& eventId)
+{
+    if (auto it = d->undecryptedEvents.find({ roomId, sessionId });
+        it != d->undecryptedEvents.end()) {
+        it->remove(eventId);
+        if (it->isEmpty())
+            d->undecryptedEvents.erase(it);
+    }
+}
+
+void Connection::retryDecryption(const QString& roomId, const QString& sessionId)
+{
+    if (!d->undecryptedEvents.contains({ roomId, sessionId }))
+        return;
+    if (d->sessionsToRetry.isEmpty())
+        QMetaObject::invokeMethod(
+            this, [this] { d->retryDecryption(); }, Qt::QueuedConnection);
+    d->sessionsToRetry[roomId] += sessionId;
+}
+
+void Connection::Private::retryDecryption()
+{
+    const auto sessions = std::exchange(sessionsToRetry, {});
+    for (auto it = sessions.cbegin(); it != sessions.cend(); ++it) {
+        // Events that fail to decrypt again are added back by the room
+        QSet<QString> eventIds;
+        for (const auto& sessionId : it.value())
+            eventIds += undecryptedEvents.take({ it.key(), sessionId });
+        if (auto* r = q->room(it.key()); r && !eventIds.isEmpty())
+            r->retryDecryption(eventIds);
+    }
+}
+
 QStringList Connection::devicesForUser(const QString& userId) const
 {
     return d->deviceKeys.value(userId).keys();
@@ -2324,16 +2615,22 @@ QString Connection::edKeyForUserDevice(const QString& userId,
     return d->deviceKeys[userId][deviceId].keys["ed25519:" % deviceId];
 }
 
+const DeviceKeys* Connection::Private::findDeviceByCurveKey(
+    const QString& userId, const QString& curveKey) const
+{
+    const auto devicesIt = deviceKeys.constFind(userId);
+    if (devicesIt == deviceKeys.cend())
+        return nullptr;
+    for (const auto& device : *devicesIt)
+        if (device.keys.value("curve25519:"_ls + device.deviceId) == curveKey)
+            return &device;
+    return nullptr;
+}
+
 bool Connection::Private::isKnownCurveKey(const QString& userId,
                                           const QString& curveKey) const
 {
-    auto query = database->prepareQuery(
-        QStringLiteral("SELECT * FROM tracked_devices WHERE matrixId=:matrixId "
-                       "AND curveKey=:curveKey"));
-    query.bindValue(":matrixId", userId);
-    query.bindValue(":curveKey", curveKey);
-    database->execute(query);
-    return query.next();
+    return findDeviceByCurveKey(userId, curveKey) != nullptr;
 }
 
 bool Connection::hasOlmSession(const QString& user,
@@ -2535,24 +2832,27 @@ void Connection::sendToDevice(const QString& targetUserId,
 
 bool Connection::isVerifiedSession(const QByteArray& megolmSessionId) const
 {
-    auto query = database()->prepareQuery("SELECT olmSessionId FROM inbound_megolm_sessions WHERE sessionId=:sessionId;"_ls);
-    query.bindValue(":sessionId", megolmSessionId);
-    database()->execute(query);
-    if (!query.next()) {
-        return false;
-    }
-    auto olmSessionId = query.value("olmSessionId").toString();
-    query.prepare("SELECT senderKey FROM olm_sessions WHERE sessionId=:sessionId;"_ls);
-    query.bindValue(":sessionId", olmSessionId.toLatin1());
-    database()->execute(query);
-    if (!query.next()) {
-        return false;
-    }
-    auto curveKey = query.value("senderKey"_ls).toString();
-    query.prepare("SELECT verified FROM tracked_devices WHERE curveKey=:curveKey;"_ls);
-    query.bindValue(":curveKey", curveKey);
-    database()->execute(query);
-    return query.next() && query.value("verified").toBool();
+    auto* const db = database();
+    return db->runSync([db, &megolmSessionId] {
+        auto& sessionQuery = db->prepareQuery("SELECT olmSessionId FROM inbound_megolm_sessions WHERE sessionId=:sessionId;"_ls);
+        sessionQuery.bindValue(":sessionId", megolmSessionId);
+        db->execute(sessionQuery);
+        if (!sessionQuery.next()) {
+            return false;
+        }
+        auto olmSessionId = sessionQuery.value("olmSessionId").toString();
+        auto& senderQuery = db->prepareQuery("SELECT senderKey FROM olm_sessions WHERE sessionId=:sessionId;"_ls);
+        senderQuery.bindValue(":sessionId", olmSessionId.toLatin1());
+        db->execute(senderQuery);
+        if (!senderQuery.next()) {
+            return false;
+        }
+        auto curveKey = senderQuery.value("senderKey"_ls).toString();
+        auto& query = db->prepareQuery("SELECT verified FROM tracked_devices WHERE curveKey=:curveKey;"_ls);
+        query.bindValue(":curveKey", curveKey);
+        db->execute(query);
+        return query.next() && query.value("verified").toBool();
+    });
 }
 #endif
 
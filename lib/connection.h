@@ -20,6 +20,7 @@
 #include <QtCore/QUrl>
 
 #include <functional>
+#include <typeinfo>
 
 #ifdef Quotient_E2EE_ENABLED
 #include "e2ee/e2ee_common.h"
@@ -51,6 +52,7 @@ class SendToDeviceJob;
 class SendMessageJob;
 class LeaveRoomJob;
 class Database;
+class PushRuleEngine;
 struct EncryptedFileMetadata;
 
 class QOlmAccount;
@@ -113,6 +115,20 @@ using DirectChatsMap = QMultiHash<const User*, QString>;
 using DirectChatUsersMap = QMultiHash<QString, User*>;
 using IgnoredUsersList = IgnoredUsersEvent::value_type;
 
+//! \brief The connection of a single account to a homeserver
+//!
+//! Thread affinity: a Connection, as well as all Room and User objects
+//! belonging to it, lives in the thread it has been created in (the owner
+//! thread); all its methods, and methods of its rooms and users, must only be
+//! called from that thread, and all its signals are emitted there. The only
+//! work the library does outside of the owner thread is:
+//! - parsing of /sync responses and creation of event objects from them,
+//!   when syncPipelining() is on (see SyncJob);
+//! - reading and decoding room files when loading the state cache
+//!   (see SyncData).
+//! Neither of these touches Connection or Room objects; the parsed data are
+//! handed over to the owner thread, where deduplication, decryption and
+//! merging into rooms happen.
 class QUOTIENT_API Connection : public QObject {
     Q_OBJECT
 
@@ -262,6 +278,13 @@ public:
     /** Get the whole list of ignored users */
     Q_INVOKABLE Quotient::IgnoredUsersList ignoredUsers() const;
 
+    //! \brief Get the push rules of the account compiled for evaluation
+    //!
+    //! The rules are updated from `m.push_rules` account data as it arrives
+    //! from the server; Room::checkForNotifications() uses them to evaluate
+    //! events on the client side.
+    const PushRuleEngine& pushRuleEngine() const;
+
     /** Add the user to the ignore list
      * The change signal is emitted synchronously, without waiting
      * to complete synchronisation with the server.
@@ -324,6 +347,42 @@ public:
         const Room* room) const;
     void saveMegolmSession(const Room* room,
                            const QOlmInboundGroupSession& session) const;
+
+    //! \brief Find an inbound megolm session of a room
+    //!
+    //! Sessions are unpickled from the database on first use and kept in
+    //! a cache of the most recently used sessions, common for all rooms of
+    //! the connection. The returned pointer stays valid until the session is
+    //! evicted from that cache, i.e. until megolmSessionCacheSize() other
+    //! sessions have been used since (by this function or addMegolmSession())
+    //! or the cache size is reduced. Therefore, up to megolmSessionCacheSize()
+    //! pointers returned most recently are valid at the same time.
+    //! \return the session, or nullptr if there's no such session
+    QOlmInboundGroupSession* megolmSession(const QString& roomId,
+                                           const QString& sessionId);
+    //! Save a new inbound megolm session and add it to the cache
+    void addMegolmSession(const Room* room, QOlmInboundGroupSession&& session);
+    //! The maximum number of unpickled megolm sessions kept in memory
+    int megolmSessionCacheSize() const;
+    void setMegolmSessionCacheSize(int size);
+
+    //! \brief Remember an event that could not be decrypted
+    //!
+    //! Events are kept in an index common for all rooms of the connection,
+    //! keyed by the room and the megolm session, until a key for
+    //! the session arrives; see retryDecryption().
+    void addUndecryptedEvent(const QString& roomId, const QString& sessionId,
+                             const QString& eventId);
+    //! Forget an undecrypted event, e.g. when it leaves the timeline
+    void removeUndecryptedEvent(const QString& roomId, const QString& sessionId,
+                                const QString& eventId);
+    //! \brief Decrypt events waiting for a megolm session once it has a key
+    //!
+    //! The retry is queued; events waiting for all sessions that received
+    //! keys in the meantime (normally, in the same sync response) are
+    //! decrypted in a single batch per room, followed by a burst of
+    //! Room::replacedEvent() signals.
+    void retryDecryption(const QString& roomId, const QString& sessionId);
     Omittable<QOlmOutboundGroupSession> loadCurrentOutboundMegolmSession(
         const QString& roomId) const;
     void saveCurrentOutboundMegolmSession(
@@ -401,6 +460,13 @@ public:
     Q_INVOKABLE void saveState() const;
 
     /// This method saves the current state of a single room.
+    /** Normally, only the state changes since the last save are appended to
+     * the room's journal file; once the journal grows comparable to the full
+     * snapshot of the room state, the snapshot is rewritten and the journal
+     * is dropped. The same happens when the journal has been written with
+     * a different cache type (JSON vs. CBOR) than the current one.
+     * \sa SyncData::journalFileNameForRoom
+     */
     void saveRoomState(Room* r) const;
 
     /// Get the default directory path to save the room state to
@@ -429,6 +495,26 @@ public:
     bool lazyLoading() const;
     void setLazyLoading(bool newValue);
 
+    /** Whether loadState() should only load summaries of rooms
+     * If this is on, loadState() only reads the top-level cache file, setting
+     * up rooms from summary records stored in it; the full state of each room
+     * is loaded from its own file upon the first actual use of the room.
+     * This has to be set before calling loadState(); off by default.
+     * \sa Room::isCachedStateLoaded, Room::loadCachedState
+     */
+    bool lazyCacheLoading() const;
+    void setLazyCacheLoading(bool newValue);
+
+    /** Whether /sync responses should be parsed off the owner thread
+     * If this is on, each /sync response is parsed, and event objects are
+     * created from it, on a thread from the global QThreadPool as the response
+     * arrives, leaving only the final merge of the data into rooms to
+     * the thread of the connection. Takes effect from the next sync;
+     * off by default.
+     */
+    bool syncPipelining() const;
+    void setSyncPipelining(bool newValue);
+
     /*! Start a pre-created job object on this connection */
     Q_INVOKABLE BaseJob* run(BaseJob* job,
                          RunningPolicy runningPolicy = ForegroundRequest);
@@ -464,6 +550,28 @@ public:
                              std::forward<JobArgTs>(jobArgs)...);
     }
 
+    //! \brief Start a job or join an identical one already running
+    //!
+    //! Unlike callApi(), this doesn't start a new job if a job of the same
+    //! type with the same request URL (made by JobT::makeRequestUrl() from
+    //! \p jobArgs) is still pending; that job is returned instead, so that
+    //! concurrent callers receive the same result from a single request.
+    //! Only use it for jobs that don't change anything on the server. Since
+    //! the job can be shared, callers should not abandon it; disconnect from
+    //! its signals instead.
+    template <typename JobT, typename... JobArgTs>
+    JobT* callApiShared(RunningPolicy runningPolicy, JobArgTs&&... jobArgs)
+    {
+        const auto key = QString::fromLatin1(typeid(JobT).name()) + u' '
+                         + getUrlForApi<JobT>(jobArgs...).toString();
+        if (auto* job = findSharedJob(key))
+            return static_cast<JobT*>(job);
+        auto* job = callApi<JobT>(runningPolicy,
+                                  std::forward<JobArgTs>(jobArgs)...);
+        addSharedJob(key, job);
+        return job;
+    }
+
     /*! Get a request URL for a job with specified type and arguments
      *
      * This calls JobT::makeRequestUrl() prepending the connection's homeserver
@@ -911,6 +1019,9 @@ private:
     class Private;
     ImplPtr<Private> d;
 
+    BaseJob* findSharedJob(const QString& key) const;
+    void addSharedJob(const QString& key, BaseJob* job);
+
     static room_factory_t _roomFactory;
     static user_factory_t _userFactory;
 };
@@ -5,6 +5,7 @@
 #include "connectiondata.h"
 
 #include "logging.h"
+#include "metrics.h"
 #include "networkaccessmanager.h"
 #include "jobs/basejob.h"
 
@@ -55,6 +56,7 @@ ConnectionData::ConnectionData(QUrl baseUrl)
             while (!q.empty()) {
                 const auto job = q.front();
                 q.pop();
+                Metrics::jobQueueDepth.add(-1);
                 if (!job || job->error() == BaseJob::Abandoned)
                     continue;
                 if (job->error() != BaseJob::Pending) {
@@ -76,6 +78,8 @@ ConnectionData::~ConnectionData()
 {
     d->rateLimiter.disconnect();
     d->rateLimiter.stop();
+    for (const auto& q : d->jobs)
+        Metrics::jobQueueDepth.add(-qint64(q.size()));
 }
 
 void ConnectionData::submit(BaseJob* job)
@@ -86,6 +90,7 @@ void ConnectionData::submit(BaseJob* job)
         return;
     }
     d->jobs[size_t(job->isBackground())].emplace(job);
+    Metrics::jobQueueDepth.add(1);
     qCDebug(MAIN) << job << "queued," << d->jobs.front().size() << "+"
                   << d->jobs.back().size() << "total jobs in" << d->id()
                   << "queues";
@@ -5,6 +5,7 @@
 
 #include "connection.h"
 #include "logging.h"
+#include "settings.h"
 
 #include "e2ee/qolmaccount.h"
 #include "e2ee/qolminboundsession.h"
@@ -25,40 +26,98 @@ Database::Database(const QString& userId, const QString& deviceId,
     , m_userId(userId)
     , m_deviceId(deviceId)
     , m_picklingKey(std::move(picklingKey))
+    , m_thread(new QThread(this))
+    , m_worker(new QObject)
 {
-    auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"),
-                                        "Quotient_" + m_userId);
     auto dbDir = m_userId;
     dbDir.replace(':', '_');
     const QString databasePath{ QStandardPaths::writableLocation(
                                     QStandardPaths::AppDataLocation)
                                 % '/' % dbDir };
     QDir(databasePath).mkpath(".");
-    db.setDatabaseName(databasePath + "/quotient_%1.db3"_ls.arg(m_deviceId));
+    // A negative cache_size is in KiB; mmap_size is in bytes, 0 disables mmap
+    const SettingsGroup settings(QStringLiteral("libQuotient/database"));
+
+    m_thread->setObjectName("Quotient database " + m_userId);
+    m_worker->moveToThread(m_thread);
+    connect(m_thread, &QThread::finished, m_worker, &QObject::deleteLater);
+    m_thread->start();
+    runAsync([this,
+              fileName = databasePath + "/quotient_%1.db3"_ls.arg(m_deviceId),
+              cacheSize = settings.get("cache_size", -8192),
+              mmapSize = settings.get("mmap_size", qint64(0))] {
+        open(fileName, cacheSize, mmapSize);
+    });
+}
+
+Database::~Database()
+{
+    runSync([this] { close(); });
+    m_thread->quit();
+    m_thread->wait();
+}
+
+void Database::runAsync(std::function<void()> job)
+{
+    if (isDatabaseThread())
+        job();
+    else
+        QMetaObject::invokeMethod(m_worker, std::move(job),
+                                  Qt::QueuedConnection);
+}
+
+void Database::open(const QString& fileName, int cacheSize, qint64 mmapSize)
+{
+    auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"),
+                                        "Quotient_" + m_userId);
+    db.setDatabaseName(fileName);
     db.open(); // Further accessed via database()
 
+    // In WAL mode readers don't block on writers, and with synchronous=NORMAL
+    // a commit doesn't wait for the disk; only checkpoints do. The database
+    // stays consistent on a crash, only the latest transactions may be lost.
+    execute(QStringLiteral("PRAGMA journal_mode=WAL;"));
+    execute(QStringLiteral("PRAGMA synchronous=NORMAL;"));
+    execute(QStringLiteral("PRAGMA cache_size=%1;").arg(cacheSize));
+    execute(QStringLiteral("PRAGMA mmap_size=%1;").arg(mmapSize));
+
     switch(version()) {
     case 0: migrateTo1(); [[fallthrough]];
     case 1: migrateTo2(); [[fallthrough]];
     case 2: migrateTo3(); [[fallthrough]];
     case 3: migrateTo4(); [[fallthrough]];
-    case 4: migrateTo5();
+    case 4: migrateTo5(); [[fallthrough]];
+    case 5: migrateTo6();
     }
 }
 
-int Database::version()
+void Database::close()
 {
-    auto query = execute(QStringLiteral("PRAGMA user_version;"));
-    if (query.next()) {
-        bool ok = false;
-        int value = query.value(0).toInt(&ok);
-        qCDebug(DATABASE) << "Database version" << value;
-        if (ok)
-            return value;
-    } else {
-        qCritical() << "Failed to check database version";
+    if (m_transactionDepth > 0) {
+        qCWarning(DATABASE) << "Committing an unfinished transaction";
+        m_transactionDepth = 0;
+        database().commit();
     }
-    return -1;
+    m_statements.clear();
+    database().close();
+    QSqlDatabase::removeDatabase("Quotient_" + m_userId);
+}
+
+int Database::version()
+{
+    return runSync([this] {
+        auto query = execute(QStringLiteral("PRAGMA user_version;"));
+        if (query.next()) {
+            bool ok = false;
+            int value = query.value(0).toInt(&ok);
+            qCDebug(DATABASE) << "Database version" << value;
+            if (ok)
+                return value;
+        } else {
+            qCritical() << "Failed to check database version";
+        }
+        return -1;
+    });
 }
 
 QSqlQuery Database::execute(const QString &queryString)
@@ -84,12 +143,24 @@ QSqlQuery Database::execute(QSqlQuery &query)
 
 void Database::transaction()
 {
-    database().transaction();
+    runAsync([this] {
+        if (m_transactionDepth++ == 0)
+            database().transaction();
+    });
 }
 
 void Database::commit()
 {
-    database().commit();
+    runAsync([this] {
+        Q_ASSERT(m_transactionDepth > 0);
+        if (--m_transactionDepth == 0)
+            database().commit();
+    });
+}
+
+void Database::commitLater()
+{
+    QMetaObject::invokeMethod(this, &Database::commit, Qt::QueuedConnection);
 }
 
 void Database::migrateTo1()
@@ -162,24 +233,47 @@ void Database::migrateTo5()
     commit();
 }
 
-void Database::storeOlmAccount(const QOlmAccount& olmAccount)
+void Database::migrateTo6()
 {
-    auto deleteQuery = prepareQuery(QStringLiteral("DELETE FROM accounts;"));
-    auto query = prepareQuery(QStringLiteral("INSERT INTO accounts(pickle) VALUES(:pickle);"));
-    query.bindValue(":pickle", olmAccount.pickle(m_picklingKey));
+    qCDebug(DATABASE) << "Migrating database to version 6";
     transaction();
-    execute(deleteQuery);
-    execute(query);
+
+    execute(QStringLiteral("CREATE INDEX tracked_devices_user_idx ON tracked_devices(matrixId, deviceId);"));
+    execute(QStringLiteral("CREATE INDEX tracked_devices_curve_key_idx ON tracked_devices(curveKey);"));
+    execute(QStringLiteral("CREATE INDEX sent_megolm_sessions_idx ON sent_megolm_sessions(roomId, sessionId);"));
+    execute(QStringLiteral("CREATE INDEX olm_sessions_sender_key_idx ON olm_sessions(senderKey);"));
+    // inbound_room_idx from version 2 was dropped along with the table
+    // when migrating to version 3
+    execute(QStringLiteral("CREATE INDEX inbound_session_idx ON inbound_megolm_sessions(roomId, sessionId);"));
+    execute(QStringLiteral("PRAGMA user_version = 6;"));
     commit();
 }
 
+void Database::storeOlmAccount(const QOlmAccount& olmAccount)
+{
+    runAsync([this, pickle = olmAccount.pickle(m_picklingKey)] {
+        auto& deleteQuery = prepareQuery(QStringLiteral("DELETE FROM accounts;"));
+        auto& query = prepareQuery(QStringLiteral("INSERT INTO accounts(pickle) VALUES(:pickle);"));
+        query.bindValue(":pickle", pickle);
+        transaction();
+        execute(deleteQuery);
+        execute(query);
+        commit();
+    });
+}
+
 Omittable<OlmErrorCode> Database::setupOlmAccount(QOlmAccount& olmAccount)
 {
-    auto query = prepareQuery(QStringLiteral("SELECT pickle FROM accounts;"));
-    execute(query);
-    if (query.next())
-        return olmAccount.unpickle(
-            query.value(QStringLiteral("pickle")).toByteArray(), m_picklingKey);
+    // QOlmAccount lives in the caller's thread, only the pickle is read here
+    auto pickle = runSync([this]() -> Omittable<QByteArray> {
+        auto& query = prepareQuery(QStringLiteral("SELECT pickle FROM accounts;"));
+        execute(query);
+        if (query.next())
+            return query.value(QStringLiteral("pickle")).toByteArray();
+        return none;
+    });
+    if (pickle)
+        return olmAccount.unpickle(std::move(*pickle), m_picklingKey);
 
     olmAccount.setupNewAccount();
     return {};
@@ -187,213 +281,284 @@ Omittable<OlmErrorCode> Database::setupOlmAccount(QOlmAccount& olmAccount)
 
 void Database::clear()
 {
-    auto query = prepareQuery(QStringLiteral("DELETE FROM accounts;"));
-    auto sessionsQuery = prepareQuery(QStringLiteral("DELETE FROM olm_sessions;"));
-    auto megolmSessionsQuery = prepareQuery(QStringLiteral("DELETE FROM inbound_megolm_sessions;"));
-    auto groupSessionIndexRecordQuery = prepareQuery(QStringLiteral("DELETE FROM group_session_record_index;"));
-
-    transaction();
-    execute(query);
-    execute(sessionsQuery);
-    execute(megolmSessionsQuery);
-    execute(groupSessionIndexRecordQuery);
-    commit();
+    runAsync([this] {
+        auto& query = prepareQuery(QStringLiteral("DELETE FROM accounts;"));
+        auto& sessionsQuery = prepareQuery(QStringLiteral("DELETE FROM olm_sessions;"));
+        auto& megolmSessionsQuery = prepareQuery(QStringLiteral("DELETE FROM inbound_megolm_sessions;"));
+        auto& groupSessionIndexRecordQuery = prepareQuery(QStringLiteral("DELETE FROM group_session_record_index;"));
 
+        transaction();
+        execute(query);
+        execute(sessionsQuery);
+        execute(megolmSessionsQuery);
+        execute(groupSessionIndexRecordQuery);
+        commit();
+    });
+    m_indexRecordsCache.clear();
 }
 
 void Database::saveOlmSession(const QString& senderKey,
                               const QOlmSession& session,
                               const QDateTime& timestamp)
 {
-    auto query = prepareQuery(QStringLiteral("INSERT INTO olm_sessions(senderKey, sessionId, pickle, lastReceived) VALUES(:senderKey, :sessionId, :pickle, :lastReceived);"));
-    query.bindValue(":senderKey", senderKey);
-    query.bindValue(":sessionId", session.sessionId());
-    query.bindValue(":pickle", session.pickle(m_picklingKey));
-    query.bindValue(":lastReceived", timestamp);
-    transaction();
-    execute(query);
-    commit();
+    runAsync([this, senderKey, sessionId = session.sessionId(),
+              pickle = session.pickle(m_picklingKey), timestamp] {
+        auto& query = prepareQuery(QStringLiteral("INSERT INTO olm_sessions(senderKey, sessionId, pickle, lastReceived) VALUES(:senderKey, :sessionId, :pickle, :lastReceived);"));
+        query.bindValue(":senderKey", senderKey);
+        query.bindValue(":sessionId", sessionId);
+        query.bindValue(":pickle", pickle);
+        query.bindValue(":lastReceived", timestamp);
+        transaction();
+        execute(query);
+        commit();
+    });
 }
 
 UnorderedMap<QString, std::vector<QOlmSession>> Database::loadOlmSessions()
 {
-    auto query = prepareQuery(QStringLiteral(
-        "SELECT * FROM olm_sessions ORDER BY lastReceived DESC;"));
-    transaction();
-    execute(query);
-    commit();
-    UnorderedMap<QString, std::vector<QOlmSession>> sessions;
-    while (query.next()) {
-        if (auto&& expectedSession =
-                QOlmSession::unpickle(query.value("pickle").toByteArray(),
-                                      m_picklingKey)) {
-            sessions[query.value("senderKey").toString()].emplace_back(
-                std::move(*expectedSession));
-        } else
-            qCWarning(E2EE)
-                << "Failed to unpickle olm session:" << expectedSession.error();
-    }
-    return sessions;
+    return runSync([this] {
+        auto& query = prepareQuery(QStringLiteral(
+            "SELECT * FROM olm_sessions ORDER BY lastReceived DESC;"));
+        execute(query);
+        UnorderedMap<QString, std::vector<QOlmSession>> sessions;
+        while (query.next()) {
+            if (auto&& expectedSession =
+                    QOlmSession::unpickle(query.value("pickle").toByteArray(),
+                                          m_picklingKey)) {
+                sessions[query.value("senderKey").toString()].emplace_back(
+                    std::move(*expectedSession));
+            } else
+                qCWarning(E2EE) << "Failed to unpickle olm session:"
+                                << expectedSession.error();
+        }
+        return sessions;
+    });
 }
 
 UnorderedMap<QString, QOlmInboundGroupSession> Database::loadMegolmSessions(
     const QString& roomId)
 {
-    auto query = prepareQuery(QStringLiteral("SELECT * FROM inbound_megolm_sessions WHERE roomId=:roomId;"));
-    query.bindValue(":roomId", roomId);
-    transaction();
-    execute(query);
-    commit();
-    UnorderedMap<QString, QOlmInboundGroupSession> sessions;
-    while (query.next()) {
-        if (auto&& expectedSession = QOlmInboundGroupSession::unpickle(
-                query.value("pickle").toByteArray(), m_picklingKey)) {
-            const auto sessionId = query.value("sessionId").toString();
-            if (const auto it = sessions.find(sessionId); it != sessions.end()) {
-                qCritical(DATABASE) << "More than one inbound group session "
-                                       "with the same session id"
-                                    << sessionId << "in the database";
-                Q_ASSERT(false);
-                // For Release builds, take the last session found
-                qCritical(DATABASE)
-                    << "The database is intact but only one session will be "
-                       "used so some messages will be undecryptable";
-                sessions.erase(it);
-            }
-            expectedSession->setOlmSessionId(
-                query.value("olmSessionId").toString());
-            expectedSession->setSenderId(query.value("senderId").toString());
-            sessions.try_emplace(query.value("sessionId").toString(),
-                                 std::move(*expectedSession));
-        } else
+    return runSync([this, &roomId] {
+        auto& query = prepareQuery(QStringLiteral("SELECT * FROM inbound_megolm_sessions WHERE roomId=:roomId;"));
+        query.bindValue(":roomId", roomId);
+        execute(query);
+        UnorderedMap<QString, QOlmInboundGroupSession> sessions;
+        while (query.next()) {
+            if (auto&& expectedSession = QOlmInboundGroupSession::unpickle(
+                    query.value("pickle").toByteArray(), m_picklingKey)) {
+                const auto sessionId = query.value("sessionId").toString();
+                if (const auto it = sessions.find(sessionId);
+                    it != sessions.end()) {
+                    qCritical(DATABASE) << "More than one inbound group session "
+                                           "with the same session id"
+                                        << sessionId << "in the database";
+                    Q_ASSERT(false);
+                    // For Release builds, take the last session found
+                    qCritical(DATABASE)
+                        << "The database is intact but only one session will "
+                           "be used so some messages will be undecryptable";
+                    sessions.erase(it);
+                }
+                expectedSession->setOlmSessionId(
+                    query.value("olmSessionId").toString());
+                expectedSession->setSenderId(query.value("senderId").toString());
+                sessions.try_emplace(query.value("sessionId").toString(),
+                                     std::move(*expectedSession));
+            } else
+                qCWarning(E2EE) << "Failed to unpickle megolm session:"
+                                << expectedSession.error();
+        }
+        return sessions;
+    });
+}
+
+Omittable<QOlmInboundGroupSession> Database::loadMegolmSession(
+    const QString& roomId, const QByteArray& sessionId)
+{
+    return runSync([this, &roomId,
+                    &sessionId]() -> Omittable<QOlmInboundGroupSession> {
+        auto& query = prepareQuery(QStringLiteral("SELECT pickle, olmSessionId, senderId FROM inbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
+        query.bindValue(":roomId", roomId);
+        query.bindValue(":sessionId", sessionId);
+        execute(query);
+        if (!query.next())
+            return none;
+        auto&& expectedSession = QOlmInboundGroupSession::unpickle(
+            query.value("pickle").toByteArray(), m_picklingKey);
+        if (!expectedSession) {
             qCWarning(E2EE) << "Failed to unpickle megolm session:"
                             << expectedSession.error();
-    }
-    return sessions;
+            return none;
+        }
+        expectedSession->setOlmSessionId(query.value("olmSessionId").toString());
+        expectedSession->setSenderId(query.value("senderId").toString());
+        return std::move(*expectedSession);
+    });
 }
 
 void Database::saveMegolmSession(const QString& roomId,
                                  const QOlmInboundGroupSession& session)
 {
-    auto query = prepareQuery(
-        QStringLiteral("INSERT INTO inbound_megolm_sessions(roomId, sessionId, pickle, senderId, olmSessionId) VALUES(:roomId, :sessionId, :pickle, :senderId, :olmSessionId);"));
-    query.bindValue(":roomId", roomId);
-    query.bindValue(":sessionId", session.sessionId());
-    query.bindValue(":pickle", session.pickle(m_picklingKey));
-    query.bindValue(":senderId", session.senderId());
-    query.bindValue(":olmSessionId", session.olmSessionId());
-    transaction();
-    execute(query);
-    commit();
+    runAsync([this, roomId, sessionId = session.sessionId(),
+              pickle = session.pickle(m_picklingKey),
+              senderId = session.senderId(),
+              olmSessionId = session.olmSessionId()] {
+        auto& query = prepareQuery(
+            QStringLiteral("INSERT INTO inbound_megolm_sessions(roomId, sessionId, pickle, senderId, olmSessionId) VALUES(:roomId, :sessionId, :pickle, :senderId, :olmSessionId);"));
+        query.bindValue(":roomId", roomId);
+        query.bindValue(":sessionId", sessionId);
+        query.bindValue(":pickle", pickle);
+        query.bindValue(":senderId", senderId);
+        query.bindValue(":olmSessionId", olmSessionId);
+        transaction();
+        execute(query);
+        commit();
+    });
 }
 
 void Database::addGroupSessionIndexRecord(const QString& roomId, const QString& sessionId, uint32_t index, const QString& eventId, qint64 ts)
 {
-    auto query = prepareQuery("INSERT INTO group_session_record_index(roomId, sessionId, i, eventId, ts) VALUES(:roomId, :sessionId, :index, :eventId, :ts);");
-    query.bindValue(":roomId", roomId);
-    query.bindValue(":sessionId", sessionId);
-    query.bindValue(":index", index);
-    query.bindValue(":eventId", eventId);
-    query.bindValue(":ts", ts);
-    transaction();
-    execute(query);
-    commit();
+    groupSessionIndexRecords(roomId, sessionId).insert(index, { eventId, ts });
+    runAsync([this, roomId, sessionId, index, eventId, ts] {
+        auto& query = prepareQuery("INSERT INTO group_session_record_index(roomId, sessionId, i, eventId, ts) VALUES(:roomId, :sessionId, :index, :eventId, :ts);");
+        query.bindValue(":roomId", roomId);
+        query.bindValue(":sessionId", sessionId);
+        query.bindValue(":index", index);
+        query.bindValue(":eventId", eventId);
+        query.bindValue(":ts", ts);
+        transaction();
+        execute(query);
+        commit();
+    });
 }
 
 std::pair<QString, qint64> Database::groupSessionIndexRecord(const QString& roomId, const QString& sessionId, qint64 index)
 {
-    auto query = prepareQuery(QStringLiteral("SELECT * FROM group_session_record_index WHERE roomId=:roomId AND sessionId=:sessionId AND i=:index;"));
-    query.bindValue(":roomId", roomId);
-    query.bindValue(":sessionId", sessionId);
-    query.bindValue(":index", index);
-    transaction();
-    execute(query);
-    commit();
-    if (!query.next()) {
-        return {};
-    }
-    return {query.value("eventId").toString(), query.value("ts").toLongLong()};
+    return groupSessionIndexRecords(roomId, sessionId).value(index);
+}
+
+Database::IndexRecords& Database::groupSessionIndexRecords(
+    const QString& roomId, const QString& sessionId)
+{
+    const std::pair key { roomId, sessionId };
+    if (const auto it = m_indexRecordsCache.find(key);
+        it != m_indexRecordsCache.end())
+        return *it;
+
+    return m_indexRecordsCache[key] = runSync([this, &roomId, &sessionId] {
+        auto& query = prepareQuery(QStringLiteral("SELECT i, eventId, ts FROM group_session_record_index WHERE roomId=:roomId AND sessionId=:sessionId;"));
+        query.bindValue(":roomId", roomId);
+        query.bindValue(":sessionId", sessionId);
+        execute(query);
+        IndexRecords records;
+        while (query.next())
+            records.insert(query.value("i").toLongLong(),
+                           { query.value("eventId").toString(),
+                             query.value("ts").toLongLong() });
+        return records;
+    });
 }
 
 QSqlDatabase Database::database()
 {
+    Q_ASSERT(isDatabaseThread());
     return QSqlDatabase::database("Quotient_" + m_userId);
 }
 
-QSqlQuery Database::prepareQuery(const QString& queryString)
+QSqlQuery& Database::prepareQuery(const QString& queryString)
 {
-    QSqlQuery query(database());
-    query.prepare(queryString);
+    Q_ASSERT(isDatabaseThread());
+    auto [it, inserted] = m_statements.try_emplace(queryString, database());
+    auto& query = it->second;
+    if (inserted)
+        query.prepare(queryString);
+    else
+        query.finish(); // Drop the results left from the previous use
     return query;
 }
 
 void Database::clearRoomData(const QString& roomId)
 {
-    transaction();
-    for (const auto& queryText :
-         { QStringLiteral(
-               "DELETE FROM inbound_megolm_sessions WHERE roomId=:roomId;"),
-           QStringLiteral(
-               "DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId;"),
-           QStringLiteral("DELETE FROM group_session_record_index WHERE "
-                          "roomId=:roomId;") }) {
-        auto q = prepareQuery(queryText);
-        q.bindValue(QStringLiteral(":roomId"), roomId);
-        execute(q);
-    }
-    commit();
+    runAsync([this, roomId] {
+        transaction();
+        for (const auto& queryText :
+             { QStringLiteral(
+                   "DELETE FROM inbound_megolm_sessions WHERE roomId=:roomId;"),
+               QStringLiteral(
+                   "DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId;"),
+               QStringLiteral("DELETE FROM group_session_record_index WHERE "
+                              "roomId=:roomId;") }) {
+            auto& q = prepareQuery(queryText);
+            q.bindValue(QStringLiteral(":roomId"), roomId);
+            execute(q);
+        }
+        commit();
+    });
+    for (auto it = m_indexRecordsCache.begin(); it != m_indexRecordsCache.end();)
+        if (it.key().first == roomId)
+            it = m_indexRecordsCache.erase(it);
+        else
+            ++it;
 }
 
 void Database::setOlmSessionLastReceived(const QByteArray& sessionId, const QDateTime& timestamp)
 {
-    auto query = prepareQuery(QStringLiteral("UPDATE olm_sessions SET lastReceived=:lastReceived WHERE sessionId=:sessionId;"));
-    query.bindValue(":lastReceived", timestamp);
-    query.bindValue(":sessionId", sessionId);
-    transaction();
-    execute(query);
-    commit();
+    runAsync([this, sessionId, timestamp] {
+        auto& query = prepareQuery(QStringLiteral("UPDATE olm_sessions SET lastReceived=:lastReceived WHERE sessionId=:sessionId;"));
+        query.bindValue(":lastReceived", timestamp);
+        query.bindValue(":sessionId", sessionId);
+        transaction();
+        execute(query);
+        commit();
+    });
 }
 
 void Database::saveCurrentOutboundMegolmSession(const QString& roomId,
     const QOlmOutboundGroupSession& session)
 {
-    const auto pickle = session.pickle(m_picklingKey);
-    auto deleteQuery = prepareQuery(
-        QStringLiteral("DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
-    deleteQuery.bindValue(":roomId", roomId);
-    deleteQuery.bindValue(":sessionId", session.sessionId());
-
-    auto insertQuery = prepareQuery(
-        QStringLiteral("INSERT INTO outbound_megolm_sessions(roomId, sessionId, pickle, creationTime, messageCount) VALUES(:roomId, :sessionId, :pickle, :creationTime, :messageCount);"));
-    insertQuery.bindValue(":roomId", roomId);
-    insertQuery.bindValue(":sessionId", session.sessionId());
-    insertQuery.bindValue(":pickle", pickle);
-    insertQuery.bindValue(":creationTime", session.creationTime());
-    insertQuery.bindValue(":messageCount", session.messageCount());
-
-    transaction();
-    execute(deleteQuery);
-    execute(insertQuery);
-    commit();
+    runAsync([this, roomId, sessionId = session.sessionId(),
+              pickle = session.pickle(m_picklingKey),
+              creationTime = session.creationTime(),
+              messageCount = session.messageCount()] {
+        auto& deleteQuery = prepareQuery(
+            QStringLiteral("DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
+        deleteQuery.bindValue(":roomId", roomId);
+        deleteQuery.bindValue(":sessionId", sessionId);
+
+        auto& insertQuery = prepareQuery(
+            QStringLiteral("INSERT INTO outbound_megolm_sessions(roomId, sessionId, pickle, creationTime, messageCount) VALUES(:roomId, :sessionId, :pickle, :creationTime, :messageCount);"));
+        insertQuery.bindValue(":roomId", roomId);
+        insertQuery.bindValue(":sessionId", sessionId);
+        insertQuery.bindValue(":pickle", pickle);
+        insertQuery.bindValue(":creationTime", creationTime);
+        insertQuery.bindValue(":messageCount", messageCount);
+
+        transaction();
+        execute(deleteQuery);
+        execute(insertQuery);
+        commit();
+    });
 }
 
 Omittable<QOlmOutboundGroupSession> Database::loadCurrentOutboundMegolmSession(
     const QString& roomId)
 {
-    auto query = prepareQuery(
-        QStringLiteral("SELECT * FROM outbound_megolm_sessions WHERE roomId=:roomId ORDER BY creationTime DESC;"));
-    query.bindValue(":roomId", roomId);
-    execute(query);
-    if (query.next()) {
-        if (auto&& session = QOlmOutboundGroupSession::unpickle(
-                query.value("pickle").toByteArray(), m_picklingKey)) {
-            session->setCreationTime(
-                query.value("creationTime").toDateTime());
-            session->setMessageCount(query.value("messageCount").toInt());
-            return std::move(*session);
+    return runSync([this, &roomId]() -> Omittable<QOlmOutboundGroupSession> {
+        auto& query = prepareQuery(
+            QStringLiteral("SELECT * FROM outbound_megolm_sessions WHERE roomId=:roomId ORDER BY creationTime DESC;"));
+        query.bindValue(":roomId", roomId);
+        execute(query);
+        if (query.next()) {
+            if (auto&& session = QOlmOutboundGroupSession::unpickle(
+                    query.value("pickle").toByteArray(), m_picklingKey)) {
+                session->setCreationTime(
+                    query.value("creationTime").toDateTime());
+                session->setMessageCount(query.value("messageCount").toInt());
+                return std::move(*session);
+            }
         }
-    }
-    return none;
+        return none;
+    });
 }
 
 void Database::setDevicesReceivedKey(
@@ -401,63 +566,72 @@ void Database::setDevicesReceivedKey(
     const QVector<std::tuple<QString, QString, QString>>& devices,
     const QByteArray& sessionId, uint32_t index)
 {
-    transaction();
-    for (const auto& [user, device, curveKey] : devices) {
-        auto query = prepareQuery(QStringLiteral("INSERT INTO sent_megolm_sessions(roomId, userId, deviceId, identityKey, sessionId, i) VALUES(:roomId, :userId, :deviceId, :identityKey, :sessionId, :i);"));
-        query.bindValue(":roomId", roomId);
-        query.bindValue(":userId", user);
-        query.bindValue(":deviceId", device);
-        query.bindValue(":identityKey", curveKey);
-        query.bindValue(":sessionId", sessionId);
-        query.bindValue(":i", index);
-        execute(query);
-    }
-    commit();
+    runAsync([this, roomId, devices, sessionId, index] {
+        auto& query = prepareQuery(QStringLiteral("INSERT INTO sent_megolm_sessions(roomId, userId, deviceId, identityKey, sessionId, i) VALUES(:roomId, :userId, :deviceId, :identityKey, :sessionId, :i);"));
+        transaction();
+        for (const auto& [user, device, curveKey] : devices) {
+            query.bindValue(":roomId", roomId);
+            query.bindValue(":userId", user);
+            query.bindValue(":deviceId", device);
+            query.bindValue(":identityKey", curveKey);
+            query.bindValue(":sessionId", sessionId);
+            query.bindValue(":i", index);
+            execute(query);
+        }
+        commit();
+    });
 }
 
 QMultiHash<QString, QString> Database::devicesWithoutKey(
     const QString& roomId, QMultiHash<QString, QString> devices,
     const QByteArray& sessionId)
 {
-    auto query = prepareQuery(QStringLiteral("SELECT userId, deviceId FROM sent_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId"));
-    query.bindValue(":roomId", roomId);
-    query.bindValue(":sessionId", sessionId);
-    transaction();
-    execute(query);
-    commit();
-    while (query.next()) {
-        devices.remove(query.value("userId").toString(),
-                       query.value("deviceId").toString());
-    }
-    return devices;
+    return runSync([this, &roomId, &devices, &sessionId] {
+        auto& query = prepareQuery(QStringLiteral("SELECT userId, deviceId FROM sent_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId"));
+        query.bindValue(":roomId", roomId);
+        query.bindValue(":sessionId", sessionId);
+        execute(query);
+        while (query.next()) {
+            devices.remove(query.value("userId").toString(),
+                           query.value("deviceId").toString());
+        }
+        return devices;
+    });
 }
 
 void Database::updateOlmSession(const QString& senderKey,
                                 const QOlmSession& session)
 {
-    auto query = prepareQuery(
-        QStringLiteral("UPDATE olm_sessions SET pickle=:pickle WHERE senderKey=:senderKey AND sessionId=:sessionId;"));
-    query.bindValue(":pickle", session.pickle(m_picklingKey));
-    query.bindValue(":senderKey", senderKey);
-    query.bindValue(":sessionId", session.sessionId());
-    transaction();
-    execute(query);
-    commit();
+    runAsync([this, senderKey, sessionId = session.sessionId(),
+              pickle = session.pickle(m_picklingKey)] {
+        auto& query = prepareQuery(
+            QStringLiteral("UPDATE olm_sessions SET pickle=:pickle WHERE senderKey=:senderKey AND sessionId=:sessionId;"));
+        query.bindValue(":pickle", pickle);
+        query.bindValue(":senderKey", senderKey);
+        query.bindValue(":sessionId", sessionId);
+        transaction();
+        execute(query);
+        commit();
+    });
 }
 
 void Database::setSessionVerified(const QString& edKeyId)
 {
-    auto query = prepareQuery(QStringLiteral("UPDATE tracked_devices SET verified=true WHERE edKeyId=:edKeyId;"));
-    query.bindValue(":edKeyId", edKeyId);
-    transaction();
-    execute(query);
-    commit();
+    runAsync([this, edKeyId] {
+        auto& query = prepareQuery(QStringLiteral("UPDATE tracked_devices SET verified=true WHERE edKeyId=:edKeyId;"));
+        query.bindValue(":edKeyId", edKeyId);
+        transaction();
+        execute(query);
+        commit();
+    });
 }
 
 bool Database::isSessionVerified(const QString& edKey)
 {
-    auto query = prepareQuery(QStringLiteral("SELECT verified FROM tracked_devices WHERE edKey=:edKey"));
-    query.bindValue(":edKey", edKey);
-    execute(query);
-    return query.next() && query.value("verified").toBool();
+    return runSync([this, &edKey] {
+        auto& query = prepareQuery(QStringLiteral("SELECT verified FROM tracked_devices WHERE edKey=:edKey"));
+        query.bindValue(":edKey", edKey);
+        execute(query);
+        return query.next() && query.value("verified").toBool();
+    });
 }
@@ -4,11 +4,16 @@
 #pragma once
 
 #include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QThread>
 #include <QtSql/QSqlQuery>
 #include <QtCore/QVector>
 
 #include <QtCore/QHash>
 
+#include <functional>
+#include <optional>
+
 #include "e2ee/e2ee_common.h"
 
 namespace Quotient {
@@ -18,20 +23,101 @@ class QOlmSession;
 class QOlmInboundGroupSession;
 class QOlmOutboundGroupSession;
 
+//! \brief The storage of E2EE sessions and device keys
+//!
+//! All SQL queries run on a thread owned by the Database object, using its
+//! own connection to SQLite. Methods that store data only post the writes to
+//! that thread and return immediately; methods that return data wait for
+//! the thread to complete the writes posted before and to run the query,
+//! unless the data is found in the in-memory caches. To run custom queries,
+//! use runAsync() or runSync(); prepareQuery(), execute() and database()
+//! may only be called from the database thread, i.e. inside those.
 class QUOTIENT_API Database : public QObject
 {
     Q_OBJECT
 public:
     Database(const QString& userId, const QString& deviceId,
              PicklingKey&& picklingKey, QObject* parent);
+    ~Database() override;
+
+    //! Check whether the calling thread is the database thread
+    bool isDatabaseThread() const
+    {
+        return QThread::currentThread() == m_thread;
+    }
+
+    //! \brief Run a function on the database thread without waiting for it
+    //!
+    //! Functions run in the order they are posted. If called on the database
+    //! thread, \p job is invoked right away.
+    void runAsync(std::function<void()> job);
+
+    //! \brief Run a function on the database thread and pass its result on
+    //!
+    //! \p handler is invoked with the result of \p job in the thread
+    //! of \p context, unless \p context is destroyed by then.
+    template <typename FnT, typename HandlerT>
+    void runAsync(FnT job, QObject* context, HandlerT handler)
+    {
+        runAsync([job = std::move(job), context = QPointer(context),
+                  handler = std::move(handler)]() mutable {
+            auto result = job();
+            if (context)
+                QMetaObject::invokeMethod(
+                    context, [handler = std::move(handler),
+                              result = std::move(result)]() mutable {
+                        handler(std::move(result));
+                    });
+        });
+    }
+
+    //! \brief Run a function on the database thread and wait for its result
+    //!
+    //! This blocks the calling thread until the writes posted before
+    //! and \p job itself complete; use it for reads that cannot be served
+    //! from memory.
+    template <typename FnT>
+    auto runSync(FnT job) -> std::invoke_result_t<FnT>
+    {
+        using ResultT = std::invoke_result_t<FnT>;
+        if (isDatabaseThread())
+            return job();
+        if constexpr (std::is_void_v<ResultT>)
+            QMetaObject::invokeMethod(m_worker, std::move(job),
+                                      Qt::BlockingQueuedConnection);
+        else {
+            std::optional<ResultT> result;
+            QMetaObject::invokeMethod(
+                m_worker, [&result, &job] { result.emplace(job()); },
+                Qt::BlockingQueuedConnection);
+            return std::move(*result);
+        }
+    }
 
     int version();
+    //! \brief Start a transaction
+    //!
+    //! Transactions nest: if a transaction is already open, this only
+    //! increases the nesting depth and the writes join the open transaction.
     void transaction();
+    //! Commit the transaction, unless it is nested in another one
     void commit();
+    //! \brief Commit the transaction after events posted so far are processed
+    //!
+    //! This allows to coalesce writes made by several event handlers, e.g.
+    //! all rooms processing the same sync response, into a single transaction
+    //! instead of committing (and syncing to disk) after each of them.
+    void commitLater();
     QSqlQuery execute(const QString &queryString);
     QSqlQuery execute(QSqlQuery &query);
     QSqlDatabase database();
-    QSqlQuery prepareQuery(const QString& quaryString);
+    //! \brief Get a prepared statement for the given SQL text
+    //!
+    //! Statements are prepared once and cached for the lifetime of
+    //! the Database object; the returned query is owned by the cache and is
+    //! reset on every call. Do not prepare() it again with a different text.
+    //! \note Only call from the database thread
+    QSqlQuery& prepareQuery(const QString& queryString);
 
     void storeOlmAccount(const QOlmAccount& olmAccount);
     Omittable<OlmErrorCode> setupOlmAccount(QOlmAccount &olmAccount);
@@ -41,6 +127,8 @@ public:
     UnorderedMap<QString, std::vector<QOlmSession>> loadOlmSessions();
     UnorderedMap<QString, QOlmInboundGroupSession> loadMegolmSessions(
         const QString& roomId);
+    Omittable<QOlmInboundGroupSession> loadMegolmSession(
+        const QString& roomId, const QByteArray& sessionId);
     void saveMegolmSession(const QString& roomId,
                            const QOlmInboundGroupSession& session);
     void addGroupSessionIndexRecord(const QString& roomId,
@@ -72,14 +160,37 @@ public:
     void setSessionVerified(const QString& edKeyId);
 
 private:
+    void open(const QString& fileName, int cacheSize, qint64 mmapSize);
+    void close();
     void migrateTo1();
     void migrateTo2();
     void migrateTo3();
     void migrateTo4();
     void migrateTo5();
+    void migrateTo6();
+
+    using IndexRecords = QHash<qint64, std::pair<QString, qint64>>;
+    IndexRecords& groupSessionIndexRecords(const QString& roomId,
+                                           const QString& sessionId);
 
     QString m_userId;
     QString m_deviceId;
     PicklingKey m_picklingKey;
+    QThread* m_thread;
+    //! The context object for functions running on the database thread
+    QObject* m_worker;
+    // The members below are only accessed from the database thread
+    int m_transactionDepth = 0;
+    //! Prepared statements keyed by their SQL text; the container should not
+    //! move its elements around as prepareQuery() hands out references
+    UnorderedMap<QString, QSqlQuery> m_statements;
+    // The members below are only accessed from the thread of the Database
+    // object
+
+    //! \brief A cache of group_session_record_index
+    //!
+    //! Records for a given room and session are loaded on the first lookup;
+    //! after that, checking an index for replays does not touch the database.
+    QHash<std::pair<QString, QString>, IndexRecords> m_indexRecordsCache;
 };
 } // namespace Quotient
@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "filecipherdevice.h"
+
+#include "logging.h"
+
+#include <QtCore/QCryptographicHash>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <limits>
+
+using namespace Quotient;
+
+class FileCipherDevice::Private {
+public:
+    Private(Direction direction, QIODevice* underlying,
+            const EncryptedFileMetadata& metadata)
+        : direction(direction)
+        , underlying(underlying)
+        , iv(QByteArray::fromBase64(metadata.iv.toLatin1()))
+        , expectedHash(QByteArray::fromBase64(
+              metadata.hashes.value("sha256"_ls).toLatin1()))
+    {
+        auto k = metadata.key.k;
+        key = QByteArray::fromBase64(
+            k.replace(u'_', u'/').replace(u'-', u'+').toLatin1());
+    }
+    ~Private() { EVP_CIPHER_CTX_free(ctx); }
+    Q_DISABLE_COPY(Private)
+
+    Direction direction;
+    QIODevice* underlying;
+    QByteArray key;
+    QByteArray iv;
+    QByteArray expectedHash;
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    QCryptographicHash hash { QCryptographicHash::Sha256 };
+    //! Output buffer for writing, reused between writeData() calls
+    QByteArray buffer;
+    bool hashChecked = false;
+
+    bool restart()
+    {
+        hash.reset();
+        hashChecked = false;
+        // The key is 32 bytes and the IV is 16 bytes for AES-256-CTR
+        if (key.size() != 32 || iv.size() != 16)
+            return false;
+        return EVP_CipherInit_ex(
+                   ctx, EVP_aes_256_ctr(), nullptr,
+                   reinterpret_cast<const unsigned char*>(key.constData()),
+                   reinterpret_cast<const unsigned char*>(iv.constData()),
+                   direction == Encrypt ? 1 : 0)
+               == 1;
+    }
+
+    //! \brief Transform \p size bytes from \p in to \p out
+    //!
+    //! CTR is a stream mode, producing exactly as many bytes as it's given
+    //! and allowing \p in and \p out to be the same buffer.
+    bool transform(const char* in, char* out, qint64 size)
+    {
+        if (direction == Decrypt)
+            hash.addData(in, int(size));
+        int length = 0;
+        if (EVP_CipherUpdate(ctx, reinterpret_cast<unsigned char*>(out),
+                             &length,
+                             reinterpret_cast<const unsigned char*>(in),
+                             int(size))
+            != 1)
+            return false;
+        Q_ASSERT(length == int(size));
+        if (direction == Encrypt)
+            hash.addData(out, length);
+        return true;
+    }
+};
+
+FileCipherDevice::FileCipherDevice(Direction direction, QIODevice* underlying,
+                                   const EncryptedFileMetadata& metadata,
+                                   QObject* parent)
+    : QIODevice(parent)
+    , d(makeImpl<Private>(direction, underlying, metadata))
+{
+    Q_ASSERT(underlying != nullptr);
+    connect(underlying, &QIODevice::readyRead, this, &QIODevice::readyRead);
+    connect(underlying, &QIODevice::bytesWritten, this,
+            &QIODevice::bytesWritten);
+}
+
+FileCipherDevice::~FileCipherDevice() = default;
+
+QByteArray FileCipherDevice::ciphertextHash() const { return d->hash.result(); }
+
+bool FileCipherDevice::hashMatches(const EncryptedFileMetadata& metadata) const
+{
+    return QByteArray::fromBase64(metadata.hashes.value("sha256"_ls).toLatin1())
+           == ciphertextHash();
+}
+
+bool FileCipherDevice::open(OpenMode mode)
+{
+    if ((mode & ReadWrite) == ReadWrite) {
+        setErrorString("Cannot read and write at the same time"_ls);
+        return false;
+    }
+    if (!d->underlying->isOpen() && !d->underlying->open(mode)) {
+        setErrorString(d->underlying->errorString());
+        return false;
+    }
+    if ((d->underlying->openMode() & mode & ReadWrite) != (mode & ReadWrite)) {
+        setErrorString("The underlying device is open in a wrong mode"_ls);
+        return false;
+    }
+    if (!d->restart()) {
+        qCWarning(E2EE) << "Invalid key or initialisation vector for a file";
+        setErrorString("Invalid key or initialisation vector"_ls);
+        return false;
+    }
+    // Data is transformed on the way, there's no point in buffering it twice
+    return QIODevice::open(mode | Unbuffered);
+}
+
+bool FileCipherDevice::isSequential() const
+{
+    return d->underlying->isSequential();
+}
+
+qint64 FileCipherDevice::size() const
+{
+    return isSequential() ? QIODevice::size() : d->underlying->size();
+}
+
+bool FileCipherDevice::seek(qint64 pos)
+{
+    if (pos != 0) {
+        qCWarning(E2EE) << "FileCipherDevice can only seek to the beginning";
+        return false;
+    }
+    if (!isSequential() && !d->underlying->seek(0))
+        return false;
+    return QIODevice::seek(0) && d->restart();
+}
+
+qint64 FileCipherDevice::bytesAvailable() const
+{
+    return QIODevice::bytesAvailable()
+           + (openMode() & ReadOnly ? d->underlying->bytesAvailable() : 0);
+}
+
+qint64 FileCipherDevice::readData(char* data, qint64 maxSize)
+{
+    const auto bytesRead = d->underlying->read(
+        data, std::min(maxSize, qint64(std::numeric_limits<int>::max())));
+    if (bytesRead > 0)
+        return d->transform(data, data, bytesRead) ? bytesRead : -1;
+
+    // Sequential devices return -1 at the end of data; random-access ones
+    // return 0 once there's nothing more to read
+    const auto atEnd = bytesRead < 0 || !isSequential();
+    if (atEnd && d->direction == Decrypt && !d->hashChecked) {
+        d->hashChecked = true;
+        if (d->expectedHash != ciphertextHash()) {
+            qCWarning(E2EE) << "Hash verification failed for file";
+            setErrorString("Hash verification failed"_ls);
+            return -1;
+        }
+    }
+    return bytesRead;
+}
+
+qint64 FileCipherDevice::writeData(const char* data, qint64 maxSize)
+{
+    maxSize = std::min(maxSize, qint64(std::numeric_limits<int>::max()));
+    d->buffer.resize(int(maxSize));
+    if (!d->transform(data, d->buffer.data(), maxSize))
+        return -1;
+    // The cipher has already moved forward by maxSize bytes; writing less
+    // to the underlying device would desynchronise them
+    if (d->underlying->write(d->buffer) != maxSize) {
+        setErrorString(d->underlying->errorString());
+        return -1;
+    }
+    return maxSize;
+}
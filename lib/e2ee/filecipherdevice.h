@@ -0,0 +1,63 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "events/filesourceinfo.h"
+
+#include <QtCore/QIODevice>
+
+namespace Quotient {
+
+//! \brief A QIODevice encrypting or decrypting a file on the fly
+//!
+//! The device wraps another (underlying) device and transforms the data
+//! passing through it with AES-256-CTR, as used for encrypted attachments.
+//! Opened for reading, it reads data from the underlying device and returns
+//! it encrypted or decrypted; opened for writing, it transforms the data
+//! written to it and writes the result to the underlying device. In both cases
+//! SHA-256 of the ciphertext is computed along the way, so a file of any size
+//! is processed with a constant amount of memory.
+//!
+//! AES-CTR doesn't change the data size, so size() is that of the underlying
+//! device. Seeking is only supported to the beginning of the data, which
+//! restarts the cipher and the hash.
+//!
+//! When a device decrypting a file is read to the end, the hash of
+//! the ciphertext is checked against the one in the file metadata; if they
+//! don't match, the read fails and errorString() says so.
+class QUOTIENT_API FileCipherDevice : public QIODevice {
+public:
+    enum Direction { Encrypt, Decrypt };
+
+    //! \brief Create a device for the file described by \p metadata
+    //!
+    //! The device does not take ownership of \p underlying; if the underlying
+    //! device is not open by the time the device itself is opened, it is
+    //! opened in the same mode.
+    FileCipherDevice(Direction direction, QIODevice* underlying,
+                     const EncryptedFileMetadata& metadata,
+                     QObject* parent = nullptr);
+    ~FileCipherDevice() override;
+
+    //! SHA-256 of the ciphertext that has passed through the device
+    QByteArray ciphertextHash() const;
+    //! Check the ciphertext hash against the one in \p metadata
+    bool hashMatches(const EncryptedFileMetadata& metadata) const;
+
+    bool open(OpenMode mode) override;
+    bool isSequential() const override;
+    qint64 size() const override;
+    bool seek(qint64 pos) override;
+    qint64 bytesAvailable() const override;
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char* data, qint64 maxSize) override;
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+
+} // namespace Quotient
@@ -3,11 +3,51 @@
 
 #include "eventitem.h"
 
+#include "events/encryptedevent.h"
+#include "events/reactionevent.h"
 #include "events/roomavatarevent.h"
 #include "events/roommessageevent.h"
 
+#include <QtCore/QCborArray>
+#include <QtCore/QCborMap>
+
 using namespace Quotient;
 
+bool EventItemBase::pack()
+{
+    if (!evt)
+        return true;
+    if (evt->isStateEvent() || evt->is<ReactionEvent>()
+        || evt->is<EncryptedEvent>())
+        return false;
+
+    // The blob is kept after unpacking, so that packing the same event again
+    // only needs to drop the event object
+    if (packedEvent.isEmpty()) {
+        QCborArray blob { QCborMap::fromJsonObject(evt->fullJson()) };
+#ifdef Quotient_E2EE_ENABLED
+        if (const auto* originalEvent = evt->originalEvent())
+            blob.append(QCborMap::fromJsonObject(originalEvent->fullJson()));
+#endif
+        packedEvent = qCompress(QCborValue(blob).toCbor(), 1);
+    }
+    packedEventId = evt->id();
+    evt.reset();
+    return true;
+}
+
+void EventItemBase::unpack() const
+{
+    Q_ASSERT(!packedEvent.isEmpty());
+    const auto blob = QCborValue::fromCbor(qUncompress(packedEvent)).toArray();
+    evt = loadEvent<RoomEvent>(blob.at(0).toMap().toJsonObject());
+#ifdef Quotient_E2EE_ENABLED
+    if (blob.size() > 1)
+        evt->setOriginalEvent(
+            loadEvent<RoomEvent>(blob.at(1).toMap().toJsonObject()));
+#endif
+}
+
 void PendingEventItem::setFileUploaded(const FileSourceInfo& uploadedFileData)
 {
     // TODO: eventually we might introduce hasFileContent to RoomEvent,
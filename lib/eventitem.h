@@ -44,19 +44,23 @@ public:
         Q_ASSERT(evt);
     }
 
-    const RoomEvent* event() const { return std::to_address(evt); }
+    const RoomEvent* event() const { return std::to_address(loadedEvent()); }
     const RoomEvent* get() const { return event(); }
     template <EventClass<RoomEvent> EventT>
     const EventT* viewAs() const
     {
-        return eventCast<const EventT>(evt);
+        return eventCast<const EventT>(loadedEvent());
     }
-    const RoomEventPtr& operator->() const { return evt; }
-    const RoomEvent& operator*() const { return *evt; }
+    const RoomEventPtr& operator->() const { return loadedEvent(); }
+    const RoomEvent& operator*() const { return *loadedEvent(); }
+    //! The event id; unlike `item->id()`, this doesn't unpack the event
+    QString eventId() const { return evt ? evt->id() : packedEventId; }
 
     // Used for event redaction
     RoomEventPtr replaceEvent(RoomEventPtr&& other)
     {
+        loadedEvent();
+        packedEvent.clear();
         return std::exchange(evt, std::move(other));
     }
 
@@ -70,12 +74,36 @@ protected:
     template <EventClass<RoomEvent> EventT>
     EventT* getAs()
     {
-        return eventCast<EventT>(evt);
+        return eventCast<EventT>(loadedEvent());
     }
 
+    //! \brief Serialise the event into a compressed CBOR blob and drop it
+    //!
+    //! The event object is recreated from the blob the next time it is
+    //! accessed. Pointers to the event obtained before the call become
+    //! dangling; for that reason state events (that the room state refers
+    //! to), reactions (that are referred to from the relations index) and
+    //! undecrypted events (that are replaced once the keys arrive) are never
+    //! packed. The event id is kept aside, see eventId().
+    //! \return whether the event is packed after the call
+    bool pack();
+    bool isPacked() const { return !evt; }
+    //! The size of the packed blob, or 0 if the event has never been packed
+    qsizetype packedSize() const { return packedEvent.size(); }
+
 private:
-    RoomEventPtr evt;
+    mutable RoomEventPtr evt;
+    mutable QByteArray packedEvent;
+    QString packedEventId;
     std::any data;
+
+    const RoomEventPtr& loadedEvent() const
+    {
+        if (Q_UNLIKELY(!evt))
+            unpack();
+        return evt;
+    }
+    void unpack() const;
 };
 
 class QUOTIENT_API TimelineItem : public EventItemBase {
@@ -90,6 +118,10 @@ public:
 
     index_t index() const { return idx; }
 
+    using EventItemBase::pack;
+    using EventItemBase::isPacked;
+    using EventItemBase::packedSize;
+
 private:
     index_t idx;
 };
@@ -97,13 +129,15 @@ private:
 template <>
 inline const StateEvent* EventItemBase::viewAs<StateEvent>() const
 {
-    return evt->isStateEvent() ? weakPtrCast<const StateEvent>(evt) : nullptr;
+    const auto& e = loadedEvent();
+    return e->isStateEvent() ? weakPtrCast<const StateEvent>(e) : nullptr;
 }
 
 template <>
 inline const CallEvent* EventItemBase::viewAs<CallEvent>() const
 {
-    return evt->is<CallEvent>() ? weakPtrCast<const CallEvent>(evt) : nullptr;
+    const auto& e = loadedEvent();
+    return e->is<CallEvent>() ? weakPtrCast<const CallEvent>(e) : nullptr;
 }
 
 class QUOTIENT_API PendingEventItem : public EventItemBase {
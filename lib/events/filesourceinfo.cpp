@@ -9,10 +9,9 @@
 
 #ifdef Quotient_E2EE_ENABLED
 #    include "e2ee/e2ee_common.h"
+#    include "e2ee/filecipherdevice.h"
 
-#    include <QtCore/QCryptographicHash>
-
-#    include <openssl/evp.h>
+#    include <QtCore/QBuffer>
 #endif
 
 using namespace Quotient;
@@ -21,33 +20,17 @@ QByteArray Quotient::decryptFile(const QByteArray& ciphertext,
                                  const EncryptedFileMetadata& metadata)
 {
 #ifdef Quotient_E2EE_ENABLED
-    if (QByteArray::fromBase64(metadata.hashes["sha256"_ls].toLatin1())
-        != QCryptographicHash::hash(ciphertext, QCryptographicHash::Sha256)) {
+    auto source = ciphertext;
+    QBuffer sourceBuffer(&source);
+    FileCipherDevice cipher(FileCipherDevice::Decrypt, &sourceBuffer, metadata);
+    if (!cipher.open(QIODevice::ReadOnly))
+        return {};
+    const auto plaintext = cipher.readAll();
+    if (!cipher.hashMatches(metadata)) {
         qCWarning(E2EE) << "Hash verification failed for file";
         return {};
     }
-
-    auto _key = metadata.key.k;
-    const auto keyBytes = QByteArray::fromBase64(
-        _key.replace(u'_', u'/').replace(u'-', u'+').toLatin1());
-    int length;
-    auto* ctx = EVP_CIPHER_CTX_new();
-    QByteArray plaintext(ciphertext.size() + EVP_MAX_BLOCK_LENGTH - 1, '\0');
-    EVP_DecryptInit_ex(
-        ctx, EVP_aes_256_ctr(), nullptr,
-        reinterpret_cast<const unsigned char*>(keyBytes.data()),
-        reinterpret_cast<const unsigned char*>(
-            QByteArray::fromBase64(metadata.iv.toLatin1()).data()));
-    EVP_DecryptUpdate(ctx, reinterpret_cast<unsigned char*>(plaintext.data()),
-                      &length,
-                      reinterpret_cast<const unsigned char*>(ciphertext.data()),
-                      ciphertext.size());
-    EVP_DecryptFinal_ex(ctx,
-                        reinterpret_cast<unsigned char*>(plaintext.data())
-                            + length,
-                        &length);
-    EVP_CIPHER_CTX_free(ctx);
-    return plaintext.left(ciphertext.size());
+    return plaintext;
 #else
     qWarning(MAIN) << "This build of libQuotient doesn't support E2EE, "
                       "cannot decrypt the file";
@@ -55,8 +38,7 @@ QByteArray Quotient::decryptFile(const QByteArray& ciphertext,
 #endif
 }
 
-std::pair<EncryptedFileMetadata, QByteArray> Quotient::encryptFile(
-    const QByteArray& plainText)
+EncryptedFileMetadata Quotient::newEncryptedFileMetadata()
 {
 #ifdef Quotient_E2EE_ENABLED
     auto k = getRandom<32>();
@@ -66,28 +48,27 @@ std::pair<EncryptedFileMetadata, QByteArray> Quotient::encryptFile(
     JWK key = {
         "oct"_ls, { "encrypt"_ls, "decrypt"_ls }, "A256CTR"_ls, kBase64, true
     };
-
-    int length = -1;
-    auto* ctx = EVP_CIPHER_CTX_new();
-    EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, k.data(), iv.data());
-    const auto blockSize = EVP_CIPHER_CTX_block_size(ctx);
-    QByteArray cipherText(plainText.size() + blockSize - 1, '\0');
-    EVP_EncryptUpdate(ctx, reinterpret_cast<unsigned char*>(cipherText.data()),
-                      &length,
-                      reinterpret_cast<const unsigned char*>(plainText.data()),
-                      plainText.size());
-    EVP_EncryptFinal_ex(ctx,
-                        reinterpret_cast<unsigned char*>(cipherText.data())
-                            + length,
-                        &length);
-    EVP_CIPHER_CTX_free(ctx);
-
-    auto hash = QCryptographicHash::hash(cipherText, QCryptographicHash::Sha256)
-                    .toBase64(QByteArray::OmitTrailingEquals);
     auto ivBase64 = iv.toBase64(QByteArray::OmitTrailingEquals);
-    EncryptedFileMetadata efm = {
-        {}, key, ivBase64, { { QStringLiteral("sha256"), hash } }, "v2"_ls
-    };
+    return { {}, key, ivBase64, {}, "v2"_ls };
+#else
+    return {};
+#endif
+}
+
+std::pair<EncryptedFileMetadata, QByteArray> Quotient::encryptFile(
+    const QByteArray& plainText)
+{
+#ifdef Quotient_E2EE_ENABLED
+    auto efm = newEncryptedFileMetadata();
+    auto source = plainText;
+    QBuffer sourceBuffer(&source);
+    FileCipherDevice cipher(FileCipherDevice::Encrypt, &sourceBuffer, efm);
+    if (!cipher.open(QIODevice::ReadOnly))
+        return {};
+    auto cipherText = cipher.readAll();
+    efm.hashes.insert(QStringLiteral("sha256"),
+                      QString::fromLatin1(cipher.ciphertextHash().toBase64(
+                          QByteArray::OmitTrailingEquals)));
     return { efm, cipherText };
 #else
     return {};
@@ -47,6 +47,11 @@ public:
     QString v;
 };
 
+//! \brief Generate a key and an initialisation vector for a new encrypted file
+//!
+//! The URL and the ciphertext hash are left empty, to be filled in once
+//! the file is encrypted (e.g., with FileCipherDevice) and uploaded.
+QUOTIENT_API EncryptedFileMetadata newEncryptedFileMetadata();
 QUOTIENT_API std::pair<EncryptedFileMetadata, QByteArray> encryptFile(
     const QByteArray& plainText);
 QUOTIENT_API QByteArray decryptFile(const QByteArray& ciphertext,
@@ -12,21 +12,12 @@ EventStats EventStats::fromRange(const Room* room, const Room::rev_iter_t& from,
     Q_ASSERT(to <= room->historyEdge());
     Q_ASSERT(from >= Room::rev_iter_t(room->syncEdge()));
     Q_ASSERT(from <= to);
-    QElapsedTimer et;
-    et.start();
-    const auto result =
-        accumulate(from, to, init,
-                   [room](EventStats acc, const TimelineItem& ti) {
-                       acc.notableCount += room->isEventNotable(ti);
-                       acc.highlightCount += room->notificationFor(ti).type
-                                             == Notification::Highlight;
-                       return acc;
-                   });
-    if (et.nsecsElapsed() > ProfilerMinNsecs / 10)
-        qCDebug(PROFILER).nospace()
-            << "Event statistics collection over index range [" << from->index()
-            << "," << (to - 1)->index() << "] took " << et;
-    return result;
+    if (from == to)
+        return init;
+    // Reverse iterators go from newer to older events
+    const auto s = room->statsInRange((to - 1)->index(), from->index() + 1);
+    return { init.notableCount + s.notableCount,
+             init.highlightCount + s.highlightCount, init.isEstimate };
 }
 
 EventStats EventStats::fromMarker(const Room* room,
@@ -58,11 +49,9 @@ bool EventStats::updateOnMarkerMove(const Room* room, const marker_t& oldMarker,
     Q_ASSERT(isValidFor(room, oldMarker));
     Q_ASSERT(oldMarker > newMarker);
 
-    // A bit of optimisation: only calculate the difference if the marker moved
-    // less than half the remaining timeline ahead; otherwise, recalculation
-    // over the remaining timeline will very likely be faster.
-    if (oldMarker != room->historyEdge()
-        && oldMarker - newMarker < newMarker - marker_t(room->syncEdge())) {
+    // Both ways take logarithmic time; subtracting the difference keeps
+    // the counters consistent with the ones collected before
+    if (oldMarker != room->historyEdge()) {
         const auto removedStats = fromRange(room, newMarker, oldMarker);
         Q_ASSERT(notableCount >= removedStats.notableCount
                  && highlightCount >= removedStats.highlightCount);
@@ -96,3 +85,81 @@ QDebug Quotient::operator<<(QDebug dbg, const EventStats& es)
         dbg << " (estimated)";
     return dbg;
 }
+
+void EventStatsIndex::Tree::set(size_t pos, Counters c)
+{
+    if (pos < values.size()) {
+        const Counters delta { c.notable - values[pos].notable,
+                               c.highlight - values[pos].highlight };
+        values[pos] = c;
+        for (auto i = pos + 1; i <= nodes.size(); i += i & (~i + 1)) {
+            nodes[i - 1].notable += delta.notable;
+            nodes[i - 1].highlight += delta.highlight;
+        }
+        return;
+    }
+    while (values.size() <= pos) {
+        // A node covers as many positions as the lowest set bit of its
+        // 1-based number; add up the nodes it covers besides its own position
+        const auto n = nodes.size();
+        auto node = values.size() == pos ? c : Counters();
+        values.push_back(node);
+        for (size_t k = 1; k < ((n + 1) & ~n); k <<= 1) {
+            node.notable += nodes[n - k].notable;
+            node.highlight += nodes[n - k].highlight;
+        }
+        nodes.push_back(node);
+    }
+}
+
+EventStatsIndex::Counters EventStatsIndex::Tree::prefix(size_t count) const
+{
+    Counters result;
+    for (auto i = std::min(count, nodes.size()); i > 0; i &= i - 1) {
+        result.notable += nodes[i - 1].notable;
+        result.highlight += nodes[i - 1].highlight;
+    }
+    return result;
+}
+
+void EventStatsIndex::Tree::truncate(size_t count)
+{
+    // Nodes only cover positions before their own, so the remaining ones
+    // stay valid
+    if (count < values.size()) {
+        values.resize(count);
+        nodes.resize(count);
+    }
+}
+
+void EventStatsIndex::set(index_t index, bool notable, bool highlight)
+{
+    const Counters c { notable, highlight };
+    if (index >= 0)
+        newer.set(size_t(index), c);
+    else
+        older.set(size_t(-index - 1), c);
+}
+
+EventStats EventStatsIndex::sum(index_t from, index_t to) const
+{
+    EventStats result { 0, 0, false };
+    const auto add = [&result](const Tree& t, size_t begin, size_t end) {
+        const auto b = t.prefix(begin);
+        const auto e = t.prefix(end);
+        result.notableCount += e.notable - b.notable;
+        result.highlightCount += e.highlight - b.highlight;
+    };
+    if (to > 0 && from < to)
+        add(newer, size_t(std::max(from, 0)), size_t(to));
+    // Negative indices [from, min(to, 0)) are at positions [-min(to, 0), -from)
+    if (from < 0 && from < to)
+        add(older, size_t(-std::min(to, 0)), size_t(-from));
+    return result;
+}
+
+void EventStatsIndex::dropBefore(index_t index)
+{
+    // Negative indices below index are at positions from -index onwards
+    older.truncate(size_t(-std::min(index, 0)));
+}
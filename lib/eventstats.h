@@ -111,4 +111,54 @@ public:
 
 QUOTIENT_API QDebug operator<<(QDebug dbg, const EventStats& es);
 
+//! \brief Prefix sums of notable and highlighted events over a timeline
+//!
+//! Room maintains this index so that EventStats::fromRange() takes
+//! logarithmic time instead of walking (and unpacking) the timeline. Counters
+//! of each event are put in Fenwick trees as the event enters the timeline:
+//! one tree for non-negative timeline indices, growing with new events, and
+//! another one for negative indices, growing with historical events.
+//!
+//! When the timeline front is evicted, the tree for negative indices is
+//! trimmed along with it (see dropBefore()). The tree for non-negative
+//! indices cannot drop its front though; it keeps 16 bytes for each event
+//! with a non-negative index that has ever been in the timeline.
+class QUOTIENT_API EventStatsIndex {
+public:
+    using index_t = TimelineItem::index_t;
+
+    //! Set the counters of the event at \p index
+    void set(index_t index, bool notable, bool highlight);
+    //! Sum the counters of events with indices in [\p from, \p to)
+    EventStats sum(index_t from, index_t to) const;
+    //! \brief Forget the counters of events with indices below \p index
+    //!
+    //! Only events with negative indices are actually dropped; sums over
+    //! the dropped range are unspecified afterwards.
+    void dropBefore(index_t index);
+
+private:
+    struct Counters {
+        int notable = 0;
+        int highlight = 0;
+    };
+
+    class Tree {
+    public:
+        void set(size_t pos, Counters c);
+        //! Sum the counters of the first \p count positions
+        Counters prefix(size_t count) const;
+        //! Drop all positions from \p count onwards
+        void truncate(size_t count);
+
+    private:
+        std::vector<Counters> nodes;
+        std::vector<Counters> values;
+    };
+
+    Tree newer;
+    //! Events with negative indices, at positions (-index - 1)
+    Tree older;
+};
+
 }
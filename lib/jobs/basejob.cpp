@@ -119,6 +119,8 @@ public:
 
     QByteArrayList expectedKeys;
 
+    bool readsBodyItself = false;
+
     // When the QNetworkAccessManager is destroyed it destroys all pending replies.
     // Using QPointer allows us to know when that happend.
     QPointer<QNetworkReply> reply;
@@ -265,6 +267,13 @@ void BaseJob::setExpectedKeys(const QByteArrayList& keys)
     d->expectedKeys = keys;
 }
 
+bool BaseJob::readsBodyItself() const { return d->readsBodyItself; }
+
+void BaseJob::setReadsBodyItself(bool readsBody)
+{
+    d->readsBodyItself = readsBody;
+}
+
 const QNetworkReply* BaseJob::reply() const { return d->reply.data(); }
 
 QNetworkReply* BaseJob::reply() { return d->reply.data(); }
@@ -405,7 +414,7 @@ void BaseJob::gotReply()
 {
     // Defer actually updating the status until it's finalised
     auto statusSoFar = checkReply(reply());
-    if (statusSoFar.good()
+    if (statusSoFar.good() && !d->readsBodyItself
         && d->expectedContentTypes == QByteArrayList { "application/json" }) //
     {
         d->rawResponse = reply()->readAll();
@@ -425,8 +434,9 @@ void BaseJob::gotReply()
         if (!status().good()) // Bad JSON in a "good" reply: bail out
             return;
     }
-    // If the endpoint expects anything else than just (API-related) JSON
-    // reply()->readAll() is not performed and the whole reply processing
+    // If the endpoint expects anything else than just (API-related) JSON,
+    // or the job has asked to read the body itself, reply()->readAll()
+    // is not performed and the whole reply processing
     // is left to derived job classes: they may read it piecemeal or customise
     // per content type in prepareResult(), or even have read it already
     // (see, e.g., DownloadFileJob).
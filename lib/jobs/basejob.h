@@ -353,6 +353,16 @@ protected:
     void addExpectedKey(const QByteArray &key);
     void setExpectedKeys(const QByteArrayList &keys);
 
+    //! \brief Whether the derived class consumes the reply body on its own
+    //!
+    //! By default, successful replies with a JSON body are read and parsed
+    //! by BaseJob before prepareResult() is called. Jobs that read the body
+    //! as it arrives (e.g. from onSentRequest()) should set this to true, so
+    //! that BaseJob leaves the body of a successful reply to them; error
+    //! bodies are still read and handled by BaseJob.
+    bool readsBodyItself() const;
+    void setReadsBodyItself(bool readsBody);
+
     const QNetworkReply* reply() const;
     QNetworkReply* reply();
 
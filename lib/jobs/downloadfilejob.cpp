@@ -8,9 +8,7 @@
 #include <QtNetwork/QNetworkReply>
 
 #ifdef Quotient_E2EE_ENABLED
-#    include "events/filesourceinfo.h"
-
-#    include <QtCore/QCryptographicHash>
+#    include "e2ee/filecipherdevice.h"
 #endif
 
 using namespace Quotient;
@@ -28,7 +26,18 @@ public:
 
 #ifdef Quotient_E2EE_ENABLED
     Omittable<EncryptedFileMetadata> encryptedFileMetadata;
+    //! Decrypts the downloaded data into tempFile as it arrives
+    QScopedPointer<FileCipherDevice> decryptor;
+#endif
+
+    QIODevice* sink() const
+    {
+#ifdef Quotient_E2EE_ENABLED
+        if (decryptor)
+            return decryptor.data();
 #endif
+        return tempFile.data();
+    }
 };
 
 QUrl DownloadFileJob::makeRequestUrl(QUrl baseUrl, const QUrl& mxcUri)
@@ -85,6 +94,20 @@ void DownloadFileJob::doPrepare()
 
 void DownloadFileJob::onSentRequest(QNetworkReply* reply)
 {
+#ifdef Quotient_E2EE_ENABLED
+    if (d->encryptedFileMetadata.has_value()) {
+        // The cipher starts over with every request, and so does the file
+        d->tempFile->seek(0);
+        d->decryptor.reset(new FileCipherDevice(FileCipherDevice::Decrypt,
+                                                d->tempFile.data(),
+                                                *d->encryptedFileMetadata));
+        if (!d->decryptor->open(QIODevice::WriteOnly)) {
+            qCWarning(JOBS) << "Couldn't set up decryption for"
+                            << d->tempFile->fileName();
+            setStatus(FileError, "Could not decrypt the downloaded file");
+        }
+    }
+#endif
     connect(reply, &QNetworkReply::metaDataChanged, this, [this, reply] {
         if (!status().good())
             return;
@@ -105,7 +128,7 @@ void DownloadFileJob::onSentRequest(QNetworkReply* reply)
             return;
         auto bytes = reply->read(reply->bytesAvailable());
         if (!bytes.isEmpty())
-            d->tempFile->write(bytes);
+            d->sink()->write(bytes);
         else
             qCWarning(JOBS) << "Unexpected empty chunk when downloading from"
                             << reply->url() << "to" << d->tempFile->fileName();
@@ -119,60 +142,32 @@ void DownloadFileJob::beforeAbandon()
     d->tempFile->remove();
 }
 
-void decryptFile(QFile& sourceFile, const EncryptedFileMetadata& metadata,
-                 QFile& targetFile)
-{
-    sourceFile.seek(0);
-    const auto encrypted = sourceFile.readAll(); // TODO: stream decryption
-    const auto decrypted = decryptFile(encrypted, metadata);
-    targetFile.write(decrypted);
-}
-
 BaseJob::Status DownloadFileJob::prepareResult()
 {
-    if (d->targetFile) {
 #ifdef Quotient_E2EE_ENABLED
-        if (d->encryptedFileMetadata.has_value()) {
-            decryptFile(*d->tempFile, *d->encryptedFileMetadata, *d->targetFile);
-            d->tempFile->remove();
-        } else {
+    // The data has been decrypted on the fly, only the hash is left to check
+    if (d->encryptedFileMetadata.has_value()
+        && !(d->decryptor
+             && d->decryptor->hashMatches(*d->encryptedFileMetadata))) {
+        qCWarning(E2EE) << "Hash verification failed for file"
+                        << d->tempFile->fileName();
+        beforeAbandon();
+        return { IncorrectResponse, "The downloaded file is corrupt" };
+    }
 #endif
-            d->targetFile->close();
-            if (!d->targetFile->remove()) {
-                qWarning(JOBS) << "Failed to remove the target file placeholder";
-                return { FileError, "Couldn't finalise the download" };
-            }
-            if (!d->tempFile->rename(d->targetFile->fileName())) {
-                qWarning(JOBS) << "Failed to rename" << d->tempFile->fileName()
-                                << "to" << d->targetFile->fileName();
-                return { FileError, "Couldn't finalise the download" };
-            }
-#ifdef Quotient_E2EE_ENABLED
+    if (d->targetFile) {
+        d->targetFile->close();
+        if (!d->targetFile->remove()) {
+            qWarning(JOBS) << "Failed to remove the target file placeholder";
+            return { FileError, "Couldn't finalise the download" };
         }
-#endif
-    } else {
-#ifdef Quotient_E2EE_ENABLED
-        if (d->encryptedFileMetadata.has_value()) {
-            QTemporaryFile tempTempFile; // Assuming it to be next to tempFile
-            decryptFile(*d->tempFile, *d->encryptedFileMetadata, tempTempFile);
-            d->tempFile->close();
-            if (!d->tempFile->remove()) {
-                qWarning(JOBS)
-                    << "Failed to remove the decrypted file placeholder";
-                return { FileError, "Couldn't finalise the download" };
-            }
-            if (!tempTempFile.rename(d->tempFile->fileName())) {
-                qWarning(JOBS) << "Failed to rename" << tempTempFile.fileName()
-                                << "to" << d->tempFile->fileName();
-                return { FileError, "Couldn't finalise the download" };
-            }
-        } else {
-#endif
-            d->tempFile->close();
-#ifdef Quotient_E2EE_ENABLED
+        if (!d->tempFile->rename(d->targetFile->fileName())) {
+            qWarning(JOBS) << "Failed to rename" << d->tempFile->fileName()
+                            << "to" << d->targetFile->fileName();
+            return { FileError, "Couldn't finalise the download" };
         }
-#endif
-    }
+    } else
+        d->tempFile->close();
     qDebug(JOBS) << "Saved a file as" << targetFileName();
     return Success;
 }
@@ -3,14 +3,79 @@
 
 #include "syncjob.h"
 
+#include "metrics.h"
+
+#include <QtCore/QMutex>
+#include <QtCore/QThreadPool>
+#include <QtCore/QWaitCondition>
+#include <QtNetwork/QNetworkReply>
+
+#include <deque>
+
 using namespace Quotient;
 
 static size_t jobId = 0;
 
+//! \brief Parsing of response chunks on a pool thread
+//!
+//! Chunks are parsed strictly in the order of arrival, by at most one pool
+//! thread at a time; the thread is only occupied while there are chunks in
+//! the queue. The object is shared between the job and the pool thread
+//! so that the job can be deleted while a chunk is being parsed.
+class SyncJob::Pipeline : public std::enable_shared_from_this<Pipeline> {
+public:
+    //! Only accessed by the pool thread until waitForDone() returns
+    SyncData data;
+
+    void enqueue(QByteArray&& chunk, QThreadPool* pool)
+    {
+        QMutexLocker _(&mutex);
+        chunks.push_back(std::move(chunk));
+        if (!draining) {
+            draining = true;
+            pool->start([self = shared_from_this()] { self->drain(); });
+        }
+    }
+    void waitForDone()
+    {
+        QMutexLocker _(&mutex);
+        while (draining)
+            drained.wait(&mutex);
+    }
+    void cancel()
+    {
+        QMutexLocker _(&mutex);
+        cancelled = true;
+        chunks.clear();
+    }
+
+private:
+    QMutex mutex;
+    QWaitCondition drained;
+    std::deque<QByteArray> chunks;
+    bool draining = false;
+    bool cancelled = false;
+
+    void drain()
+    {
+        QMutexLocker locker(&mutex);
+        while (!chunks.empty() && !cancelled) {
+            const auto chunk = std::move(chunks.front());
+            chunks.pop_front();
+            locker.unlock();
+            data.parseChunk(chunk);
+            locker.relock();
+        }
+        draining = false;
+        drained.wakeAll();
+    }
+};
+
 SyncJob::SyncJob(const QString& since, const QString& filter, int timeout,
-                 const QString& presence)
+                 const QString& presence, QThreadPool* parsingPool)
     : BaseJob(HttpVerb::Get, QStringLiteral("SyncJob-%1").arg(++jobId),
               "_matrix/client/r0/sync")
+    , parsingPool(parsingPool)
 {
     setLoggingCategory(SYNCJOB);
     QUrlQuery query;
@@ -20,20 +85,71 @@ SyncJob::SyncJob(const QString& since, const QString& filter, int timeout,
         query.addQueryItem(QStringLiteral("timeout"), QString::number(timeout));
     addParam<IfNotEmpty>(query, QStringLiteral("since"), since);
     setRequestQuery(query);
+    // The response is parsed incrementally, as it arrives (see onSentRequest()
+    // below), instead of letting BaseJob read and parse it in one go
+    setReadsBodyItself(true);
 
     setMaxRetries(std::numeric_limits<int>::max());
 }
 
 SyncJob::SyncJob(const QString& since, const Filter& filter, int timeout,
-                 const QString& presence)
+                 const QString& presence, QThreadPool* parsingPool)
     : SyncJob(since,
               QJsonDocument(toJson(filter)).toJson(QJsonDocument::Compact),
-              timeout, presence)
+              timeout, presence, parsingPool)
 {}
 
+SyncJob::~SyncJob()
+{
+    if (pipeline)
+        pipeline->cancel(); // The pool thread will drop it when done
+}
+
+inline bool isSuccessful(const QNetworkReply* reply)
+{
+    return reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()
+               / 100
+           == 2;
+}
+
+void SyncJob::onSentRequest(QNetworkReply* reply)
+{
+    // Drop whatever has been parsed before a retry
+    d = SyncData();
+    if (pipeline)
+        pipeline->cancel();
+    pipeline = parsingPool ? std::make_shared<Pipeline>() : nullptr;
+
+    connect(reply, &QIODevice::readyRead, this, [this, reply] {
+        // Error bodies are left intact for BaseJob to deal with
+        if (!status().good() || !isSuccessful(reply))
+            return;
+        auto chunk = reply->read(reply->bytesAvailable());
+        Metrics::syncBytesReceived.add(chunk.size());
+        if (pipeline)
+            pipeline->enqueue(std::move(chunk), parsingPool);
+        else
+            d.parseChunk(chunk);
+    });
+}
+
 BaseJob::Status SyncJob::prepareResult()
 {
-    d.parseJson(jsonData());
+    // Pick up whatever remains after the last readyRead()
+    auto rest = reply()->readAll();
+    Metrics::syncBytesReceived.add(rest.size());
+    if (pipeline) {
+        if (!rest.isEmpty())
+            pipeline->enqueue(std::move(rest), parsingPool);
+        // Normally only the last chunk or two remain to be parsed by now
+        pipeline->waitForDone();
+        d = std::move(pipeline->data);
+        pipeline.reset();
+    } else if (!rest.isEmpty())
+        d.parseChunk(rest);
+    if (!d.finishStreaming())
+        return { IncorrectResponse,
+                 QStringLiteral("Malformed or incomplete sync response") };
     if (Q_LIKELY(d.unresolvedRooms().isEmpty()))
         return Success;
 
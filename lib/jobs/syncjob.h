@@ -7,20 +7,36 @@
 #include "../syncdata.h"
 #include "basejob.h"
 
+class QThreadPool;
+
 namespace Quotient {
 class SyncJob : public BaseJob {
 public:
+    //! \brief Construct a sync job
+    //!
+    //! If \p parsingPool is not nullptr, the response is parsed, and events
+    //! in it are created, on a thread from that pool as the response arrives;
+    //! only the final completion of parsing happens on the thread of the job.
+    //! Otherwise, everything happens on the thread of the job.
     explicit SyncJob(const QString& since = {}, const QString& filter = {},
-                     int timeout = -1, const QString& presence = {});
+                     int timeout = -1, const QString& presence = {},
+                     QThreadPool* parsingPool = nullptr);
     explicit SyncJob(const QString& since, const Filter& filter,
-                     int timeout = -1, const QString& presence = {});
+                     int timeout = -1, const QString& presence = {},
+                     QThreadPool* parsingPool = nullptr);
+    ~SyncJob() override;
 
     SyncData takeData() { return std::move(d); }
 
 protected:
+    void onSentRequest(QNetworkReply* reply) override;
     Status prepareResult() override;
 
 private:
+    class Pipeline;
+
     SyncData d;
+    QThreadPool* parsingPool;
+    std::shared_ptr<Pipeline> pipeline;
 };
 } // namespace Quotient
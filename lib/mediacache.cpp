@@ -0,0 +1,271 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "mediacache.h"
+
+#include "logging.h"
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDir>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QMutex>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSettings>
+
+#include <list>
+
+using namespace Quotient;
+
+namespace {
+const auto MetadataSuffix = QStringLiteral(".json");
+
+QByteArray metadataToJson(const MediaCache::Entry& entry)
+{
+    return QJsonDocument(
+               QJsonObject {
+                   { "content_type"_ls, entry.contentType },
+                   { "etag"_ls, QString::fromLatin1(entry.etag) },
+                   { "last_modified"_ls,
+                     QString::fromLatin1(entry.lastModified) },
+                   { "validated"_ls,
+                     double(entry.validated.toMSecsSinceEpoch()) } })
+        .toJson(QJsonDocument::Compact);
+}
+} // namespace
+
+class MediaCache::Private {
+public:
+    Private()
+    {
+        // Using QSettings here because Quotient::SettingsGroup doesn't
+        // provide multithreading guarantees
+        const QSettings s;
+        maxSize = s.value("libQuotient/media_cache/max_size"_ls,
+                          qint64(512) * 1024 * 1024)
+                      .toLongLong();
+        revalidateAfter =
+            s.value("libQuotient/media_cache/revalidate_after"_ls,
+                    30 * 24 * 3600)
+                .toLongLong();
+    }
+
+    mutable QMutex mutex;
+    QString path = cacheLocation("media"_ls);
+    qint64 maxSize;
+    qint64 revalidateAfter;
+    qint64 totalSize = 0;
+    bool indexLoaded = false;
+
+    //! Cache keys with entry sizes, the most recently used first
+    std::list<std::pair<QString, qint64>> entries;
+    QHash<QString, decltype(entries)::iterator> index;
+
+    QString dataFileName(const QString& key) const { return path + key; }
+    QString metadataFileName(const QString& key) const
+    {
+        return path + key + MetadataSuffix;
+    }
+
+    void loadIndex();
+    void addToIndex(const QString& key, qint64 size);
+    void removeFromIndex(const QString& key);
+    void removeFiles(const QString& key) const;
+    void evict();
+};
+
+void MediaCache::Private::loadIndex()
+{
+    if (indexLoaded)
+        return;
+    indexLoaded = true;
+    // There's no record of access times; the files written the most recently
+    // are considered the most recently used
+    const auto fileInfos =
+        QDir(path).entryInfoList(QDir::Files, QDir::Time);
+    for (const auto& fi : fileInfos) {
+        if (fi.fileName().endsWith(MetadataSuffix))
+            continue;
+        const auto key = fi.fileName();
+        const QFileInfo metadataFi(metadataFileName(key));
+        if (!metadataFi.exists()) {
+            // Left over from an interrupted write
+            QFile::remove(fi.filePath());
+            continue;
+        }
+        const auto size = fi.size() + metadataFi.size();
+        entries.emplace_back(key, size);
+        index.insert(key, std::prev(entries.end()));
+        totalSize += size;
+    }
+    evict();
+}
+
+void MediaCache::Private::addToIndex(const QString& key, qint64 size)
+{
+    removeFromIndex(key);
+    entries.emplace_front(key, size);
+    index.insert(key, entries.begin());
+    totalSize += size;
+}
+
+void MediaCache::Private::removeFromIndex(const QString& key)
+{
+    if (const auto it = index.constFind(key); it != index.cend()) {
+        totalSize -= (*it)->second;
+        entries.erase(*it);
+        index.erase(it);
+    }
+}
+
+void MediaCache::Private::removeFiles(const QString& key) const
+{
+    // Files still open elsewhere (by MxcReply) may fail to be removed on some
+    // platforms; they will be found and evicted again on the next start
+    QFile::remove(metadataFileName(key));
+    QFile::remove(dataFileName(key));
+}
+
+void MediaCache::Private::evict()
+{
+    while (totalSize > maxSize && !entries.empty()) {
+        const auto key = entries.back().first;
+        removeFromIndex(key);
+        removeFiles(key);
+    }
+}
+
+MediaCache& MediaCache::instance()
+{
+    static MediaCache cache;
+    return cache;
+}
+
+MediaCache::MediaCache() : d(makeImpl<Private>()) {}
+
+QString MediaCache::makeKey(const QUrl& mxcUrl, QSize thumbnailSize,
+                            const QString& method)
+{
+    auto id = mxcUrl.authority() + mxcUrl.path();
+    if (thumbnailSize.isValid())
+        id += QStringLiteral("#%1x%2,%3")
+                  .arg(thumbnailSize.width())
+                  .arg(thumbnailSize.height())
+                  .arg(method);
+    return QString::fromLatin1(
+        QCryptographicHash::hash(id.toUtf8(), QCryptographicHash::Sha256)
+            .toHex());
+}
+
+MediaCache::Entry MediaCache::find(const QString& key)
+{
+    const QMutexLocker l(&d->mutex);
+    d->loadIndex();
+    const auto it = d->index.constFind(key);
+    if (it == d->index.cend())
+        return {};
+    QFile metadataFile(d->metadataFileName(key));
+    if (!metadataFile.open(QIODevice::ReadOnly)) {
+        qCWarning(NETWORK) << "Media cache entry" << key << "is gone";
+        d->removeFromIndex(key);
+        return {};
+    }
+    d->entries.splice(d->entries.begin(), d->entries, *it);
+    const auto json = QJsonDocument::fromJson(metadataFile.readAll()).object();
+    return { d->dataFileName(key), json.value("content_type"_ls).toString(),
+             json.value("etag"_ls).toString().toLatin1(),
+             json.value("last_modified"_ls).toString().toLatin1(),
+             QDateTime::fromMSecsSinceEpoch(
+                 qint64(json.value("validated"_ls).toDouble())) };
+}
+
+bool MediaCache::needsRevalidation(const Entry& entry) const
+{
+    const QMutexLocker l(&d->mutex);
+    return entry.validated.secsTo(QDateTime::currentDateTime())
+           >= d->revalidateAfter;
+}
+
+MediaCache::Entry MediaCache::insert(const QString& key, const QByteArray& data,
+                                     Entry metadata)
+{
+    metadata.fileName = d->dataFileName(key);
+    metadata.validated = QDateTime::currentDateTime();
+    const auto metadataJson = metadataToJson(metadata);
+
+    const QMutexLocker l(&d->mutex);
+    d->loadIndex();
+    if (data.size() + metadataJson.size() > d->maxSize)
+        return {};
+    // Metadata is written last: a data file without it is treated as
+    // an interrupted write
+    d->removeFromIndex(key);
+    QFile::remove(d->metadataFileName(key));
+    QSaveFile dataFile(metadata.fileName);
+    QSaveFile metadataFile(d->metadataFileName(key));
+    if (!dataFile.open(QIODevice::WriteOnly)
+        || dataFile.write(data) != data.size() || !dataFile.commit()
+        || !metadataFile.open(QIODevice::WriteOnly)
+        || metadataFile.write(metadataJson) != metadataJson.size()
+        || !metadataFile.commit()) {
+        qCWarning(NETWORK) << "Couldn't save media cache entry" << key;
+        d->removeFiles(key);
+        return {};
+    }
+    d->addToIndex(key, data.size() + metadataJson.size());
+    d->evict();
+    return metadata;
+}
+
+void MediaCache::markValidated(const QString& key)
+{
+    auto entry = find(key);
+    if (!entry.isValid())
+        return;
+    entry.validated = QDateTime::currentDateTime();
+    const QMutexLocker l(&d->mutex);
+    QSaveFile metadataFile(d->metadataFileName(key));
+    if (metadataFile.open(QIODevice::WriteOnly)) {
+        metadataFile.write(metadataToJson(entry));
+        metadataFile.commit();
+    }
+}
+
+void MediaCache::remove(const QString& key)
+{
+    const QMutexLocker l(&d->mutex);
+    d->removeFromIndex(key);
+    d->removeFiles(key);
+}
+
+void MediaCache::clear()
+{
+    const QMutexLocker l(&d->mutex);
+    d->loadIndex();
+    for (const auto& [key, size] : d->entries)
+        d->removeFiles(key);
+    d->entries.clear();
+    d->index.clear();
+    d->totalSize = 0;
+}
+
+qint64 MediaCache::maxSize() const
+{
+    const QMutexLocker l(&d->mutex);
+    return d->maxSize;
+}
+
+void MediaCache::setMaxSize(qint64 maxSize)
+{
+    const QMutexLocker l(&d->mutex);
+    d->maxSize = maxSize;
+    d->loadIndex();
+    d->evict();
+}
+
+qint64 MediaCache::size() const
+{
+    const QMutexLocker l(&d->mutex);
+    d->loadIndex();
+    return d->totalSize;
+}
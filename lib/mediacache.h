@@ -0,0 +1,79 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QSize>
+#include <QtCore/QUrl>
+
+namespace Quotient {
+
+//! \brief A persistent cache of media from Matrix content repositories
+//!
+//! Files and thumbnails fetched through `mxc://` URLs are stored on disk,
+//! each in a file named after a hash of the mxc URI and, for thumbnails,
+//! the requested size and scaling method. The total size of the cache is
+//! limited; when it's exceeded, the least recently used entries are evicted.
+//!
+//! Media in the content repository don't change, so entries are served
+//! without contacting the server until they are older than the revalidation
+//! period; after that, the server is asked whether the entry has changed,
+//! with a conditional request if the entry has validators.
+//!
+//! The cache is shared by NetworkAccessManager instances of all threads;
+//! all its methods are thread-safe. The default limits can be changed with
+//! `libQuotient/media_cache/max_size` (in bytes) and
+//! `libQuotient/media_cache/revalidate_after` (in seconds) settings.
+class QUOTIENT_API MediaCache {
+public:
+    struct Entry {
+        QString fileName;
+        QString contentType;
+        //! Validators for conditional requests, as received from the server
+        QByteArray etag;
+        QByteArray lastModified;
+        //! When the entry was last fetched or confirmed by the server
+        QDateTime validated;
+
+        bool isValid() const { return !fileName.isEmpty(); }
+    };
+
+    static MediaCache& instance();
+
+    //! Make a cache key for an mxc URI, with the thumbnail parameters if any
+    static QString makeKey(const QUrl& mxcUrl, QSize thumbnailSize = {},
+                           const QString& method = {});
+
+    //! \brief Find an entry and mark it as recently used
+    //! \return the entry, or an invalid entry if there's none for \p key
+    Entry find(const QString& key);
+    //! Check whether the entry needs to be confirmed by the server
+    bool needsRevalidation(const Entry& entry) const;
+    //! \brief Store media in the cache, replacing the existing entry if any
+    //!
+    //! \p metadata provides the content type and validators; the file name
+    //! and validation time are filled in by the cache.
+    //! \return the new entry, or an invalid entry if it couldn't be saved
+    Entry insert(const QString& key, const QByteArray& data,
+                 Entry metadata);
+    //! Record that the server confirmed the entry is still up to date
+    void markValidated(const QString& key);
+    void remove(const QString& key);
+    void clear();
+
+    qint64 maxSize() const;
+    void setMaxSize(qint64 maxSize);
+    //! The total size of cached files, in bytes
+    qint64 size() const;
+
+private:
+    MediaCache();
+
+    class Private;
+    ImplPtr<Private> d;
+};
+
+} // namespace Quotient
@@ -0,0 +1,151 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "memberindex.h"
+
+#include "user.h"
+
+#include <QtCore/QRandomGenerator>
+
+using namespace Quotient;
+
+namespace {
+
+template <typename NodeT>
+inline int sizeOf(const NodeT* n)
+{
+    return n ? n->size : 0;
+}
+
+template <typename NodeT>
+inline void updateSize(NodeT* n)
+{
+    n->size = sizeOf(n->left) + 1 + sizeOf(n->right);
+}
+
+//! Check whether \p n goes before the member \p u with the key \p key
+template <typename NodeT>
+inline bool goesBefore(const NodeT& n, const QCollatorSortKey& key, User* u)
+{
+    if (const auto c = n.key.compare(key); c != 0)
+        return c < 0;
+    return n.user->id() < u->id();
+}
+
+//! \brief Split \p t into the nodes going before \p pivot and the rest
+template <typename NodeT>
+std::pair<NodeT*, NodeT*> split(NodeT* t, const NodeT& pivot)
+{
+    if (!t)
+        return {};
+    if (goesBefore(*t, pivot.key, pivot.user)) {
+        const auto [l, r] = split(t->right, pivot);
+        t->right = l;
+        updateSize(t);
+        return { t, r };
+    }
+    const auto [l, r] = split(t->left, pivot);
+    t->left = r;
+    updateSize(t);
+    return { l, t };
+}
+
+//! Merge two trees, provided that all nodes of \p l go before those of \p r
+template <typename NodeT>
+NodeT* merge(NodeT* l, NodeT* r)
+{
+    if (!l)
+        return r;
+    if (!r)
+        return l;
+    if (l->priority > r->priority) {
+        l->right = merge(l->right, r);
+        updateSize(l);
+        return l;
+    }
+    r->left = merge(l, r->left);
+    updateSize(r);
+    return r;
+}
+
+template <typename NodeT>
+NodeT* dropFirst(NodeT* t)
+{
+    if (!t->left)
+        return t->right;
+    t->left = dropFirst(t->left);
+    updateSize(t);
+    return t;
+}
+
+} // namespace
+
+int MemberIndex::size() const { return sizeOf(root); }
+
+int MemberIndex::positionFor(const QCollatorSortKey& key, User* u) const
+{
+    int result = 0;
+    for (const auto* n = root; n;)
+        if (goesBefore(*n, key, u)) {
+            result += sizeOf(n->left) + 1;
+            n = n->right;
+        } else
+            n = n->left;
+    return result;
+}
+
+int MemberIndex::position(User* u) const
+{
+    const auto it = nodes.find(u);
+    return it != nodes.cend() ? positionFor(it->second.key, u) : -1;
+}
+
+User* MemberIndex::at(int position) const
+{
+    if (position < 0 || position >= size())
+        return nullptr;
+    for (const auto* n = root;;) {
+        const auto leftSize = sizeOf(n->left);
+        if (position == leftSize)
+            return n->user;
+        if (position < leftSize)
+            n = n->left;
+        else {
+            position -= leftSize + 1;
+            n = n->right;
+        }
+    }
+}
+
+int MemberIndex::insert(User* u, QCollatorSortKey key)
+{
+    const auto [it, inserted] = nodes.try_emplace(
+        u, Node { std::move(key), u, QRandomGenerator::global()->generate() });
+    if (!inserted)
+        return -1;
+    auto& node = it->second;
+    const auto [l, r] = split(root, node);
+    const auto pos = sizeOf(l);
+    root = merge(merge(l, &node), r);
+    return pos;
+}
+
+int MemberIndex::remove(User* u)
+{
+    const auto it = nodes.find(u);
+    if (it == nodes.end())
+        return -1;
+    // The node is the first one of the right part of the split
+    const auto [l, r] = split(root, it->second);
+    Q_ASSERT(r != nullptr);
+    const auto pos = sizeOf(l);
+    root = merge(l, dropFirst(r));
+    nodes.erase(it);
+    return pos;
+}
+
+void MemberIndex::clear()
+{
+    root = nullptr;
+    nodes.clear();
+}
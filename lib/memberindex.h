@@ -0,0 +1,65 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <QtCore/QCollatorSortKey>
+
+#include <unordered_map>
+
+namespace Quotient {
+
+class User;
+
+//! \brief Room members ordered by the collation keys of their names
+//!
+//! This is an order statistic tree (a treap with subtree sizes): inserting
+//! and removing a member, as well as finding the member at a given position
+//! and the position of a given member, all take O(log n) time. A rename
+//! is a removal followed by an insertion under the new key, so the rest of
+//! the members keep their relative order and no re-sorting ever happens.
+//! Members with equal keys are ordered by their user ids.
+class MemberIndex {
+public:
+    MemberIndex() = default;
+    MemberIndex(const MemberIndex&) = delete;
+    MemberIndex& operator=(const MemberIndex&) = delete;
+
+    int size() const;
+    bool contains(User* u) const { return nodes.count(u) > 0; }
+
+    //! \brief Get the position a member would have with the given key
+    //!
+    //! For a member that is already in the index under this key, this is
+    //! its current position.
+    int positionFor(const QCollatorSortKey& key, User* u) const;
+    //! Get the position of \p u, or -1 if it's not in the index
+    int position(User* u) const;
+    //! Get the member at \p position, or nullptr if it's out of range
+    User* at(int position) const;
+
+    //! \brief Add a member under the given sort key
+    //! \return the position the member has been inserted at, or -1 if it's
+    //!         already in the index
+    int insert(User* u, QCollatorSortKey key);
+    //! \brief Remove a member
+    //! \return the position the member has been removed from, or -1 if
+    //!         it wasn't in the index
+    int remove(User* u);
+    void clear();
+
+private:
+    struct Node {
+        QCollatorSortKey key;
+        User* user;
+        quint32 priority;
+        int size = 1;
+        Node* left = nullptr;
+        Node* right = nullptr;
+    };
+    //! Nodes don't move in an unordered map, so the tree links them directly
+    std::unordered_map<User*, Node> nodes;
+    Node* root = nullptr;
+};
+
+} // namespace Quotient
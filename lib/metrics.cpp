@@ -0,0 +1,171 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "metrics.h"
+
+#include <QtCore/QMutex>
+
+using namespace Quotient;
+
+namespace {
+struct Registry {
+    QMutex mutex;
+    QVector<const Metrics::Metric*> metrics;
+    Metrics::Exporter exporter;
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+QByteArray secondsString(qint64 nsecs)
+{
+    return QByteArray::number(double(nsecs) / 1e9, 'g', 9);
+}
+} // namespace
+
+Metrics::Metric::Metric(Type type, QLatin1String name, QLatin1String help)
+    : _type(type), _name(name), _help(help)
+{
+    auto& r = registry();
+    const QMutexLocker l(&r.mutex);
+    r.metrics.push_back(this);
+}
+
+Metrics::Metric::~Metric()
+{
+    auto& r = registry();
+    const QMutexLocker l(&r.mutex);
+    r.metrics.removeOne(this);
+}
+
+void Metrics::Histogram::observe(qint64 nsecs)
+{
+    size_t i = 0;
+    while (i < BucketBounds.size() && nsecs > BucketBounds[i])
+        ++i;
+    _buckets[i].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(nsecs, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::array<qint64, Metrics::Histogram::BucketBounds.size() + 1>
+Metrics::Histogram::bucketCounts() const
+{
+    std::array<qint64, BucketBounds.size() + 1> result;
+    for (size_t i = 0; i < result.size(); ++i)
+        result[i] = _buckets[i].load(std::memory_order_relaxed);
+    return result;
+}
+
+Metrics::Snapshot Metrics::snapshot()
+{
+    auto& r = registry();
+    const QMutexLocker l(&r.mutex);
+    Snapshot result;
+    result.reserve(r.metrics.size());
+    for (const auto* m : std::as_const(r.metrics)) {
+        MetricSnapshot ms { m->name(), m->help(), m->type() };
+        switch (m->type()) {
+        case CounterType:
+            ms.value = static_cast<const Counter*>(m)->value();
+            break;
+        case GaugeType:
+            ms.value = static_cast<const Gauge*>(m)->value();
+            break;
+        case HistogramType: {
+            const auto* h = static_cast<const Histogram*>(m);
+            ms.value = h->sum();
+            // Buckets are read one by one, without a lock; the cumulative
+            // count in the last bucket is therefore used as the total count
+            // to keep the snapshot consistent
+            qint64 cumulativeCount = 0;
+            for (const auto c : h->bucketCounts())
+                ms.cumulativeCounts.push_back(cumulativeCount += c);
+            ms.count = cumulativeCount;
+            break;
+        }
+        }
+        result.push_back(std::move(ms));
+    }
+    return result;
+}
+
+QByteArray Metrics::toPrometheusText(const Snapshot& snapshot)
+{
+    static constexpr std::array<const char*, 3> TypeNames { "counter", "gauge",
+                                                            "histogram" };
+    QByteArray text;
+    for (const auto& ms : snapshot) {
+        const auto name = ms.name.toLatin1();
+        text += "# HELP " + name + ' ' + ms.help.toUtf8() + '\n';
+        text += "# TYPE " + name + ' ' + TypeNames[ms.type] + '\n';
+        if (ms.type != HistogramType) {
+            text += name + ' ' + QByteArray::number(ms.value) + '\n';
+            continue;
+        }
+        for (int i = 0; i < ms.cumulativeCounts.size(); ++i)
+            text += name + "_bucket{le=\""
+                    + (i < int(Histogram::BucketBounds.size())
+                           ? secondsString(Histogram::BucketBounds[size_t(i)])
+                           : QByteArrayLiteral("+Inf"))
+                    + "\"} " + QByteArray::number(ms.cumulativeCounts[i]) + '\n';
+        text += name + "_sum " + secondsString(ms.value) + '\n';
+        text += name + "_count " + QByteArray::number(ms.count) + '\n';
+    }
+    return text;
+}
+
+void Metrics::setExporter(Exporter exporter)
+{
+    auto& r = registry();
+    const QMutexLocker l(&r.mutex);
+    r.exporter = std::move(exporter);
+}
+
+void Metrics::publish()
+{
+    Exporter exporter;
+    {
+        auto& r = registry();
+        const QMutexLocker l(&r.mutex);
+        exporter = r.exporter;
+    }
+    if (exporter)
+        exporter(snapshot());
+}
+
+Metrics::Histogram Metrics::syncParseTime {
+    QLatin1String("quotient_sync_parse_seconds"),
+    QLatin1String("Time spent parsing /sync responses")
+};
+Metrics::Counter Metrics::syncBytesReceived {
+    QLatin1String("quotient_sync_received_bytes_total"),
+    QLatin1String("Bytes received in /sync responses")
+};
+Metrics::Counter Metrics::eventsIngested {
+    QLatin1String("quotient_timeline_events_total"),
+    QLatin1String("Events added to room timelines")
+};
+Metrics::Histogram Metrics::decryptionTime {
+    QLatin1String("quotient_decryption_seconds"),
+    QLatin1String("Time spent decrypting a batch of incoming room events")
+};
+Metrics::Counter Metrics::eventsDecrypted {
+    QLatin1String("quotient_decrypted_events_total"),
+    QLatin1String("Incoming room events successfully decrypted")
+};
+Metrics::Gauge Metrics::jobQueueDepth {
+    QLatin1String("quotient_job_queue_depth"),
+    QLatin1String("Jobs waiting in the rate-limited queues to be sent")
+};
+Metrics::Histogram Metrics::cacheSaveTime {
+    QLatin1String("quotient_cache_save_seconds"),
+    QLatin1String("Time spent saving the state of a room or the connection")
+};
+Metrics::Histogram Metrics::cacheLoadTime {
+    QLatin1String("quotient_cache_load_seconds"),
+    QLatin1String("Time spent loading the state cache")
+};
@@ -0,0 +1,158 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "quotient_export.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include <array>
+#include <atomic>
+#include <functional>
+
+namespace Quotient {
+
+//! \brief Counters and latency histograms of the library internals
+//!
+//! Unlike timings logged to the `quotient.profiler` logging category, metrics
+//! are always collected and can be read at any time, either as a snapshot()
+//! or in the Prometheus text exposition format. Updating a metric is a single
+//! relaxed atomic operation, so it is safe and cheap to do from any thread.
+//!
+//! The library defines a few metrics of its own as static members of this
+//! class; clients can define more by creating (normally, static) Counter,
+//! Gauge or Histogram objects - they show up in snapshots as long as
+//! the objects exist.
+//!
+//! To export metrics periodically, install an exporter with setExporter();
+//! Connection calls publish() after processing every sync response, and
+//! clients can call it at any other time.
+class QUOTIENT_API Metrics {
+public:
+    enum Type { CounterType, GaugeType, HistogramType };
+
+    class QUOTIENT_API Metric {
+    public:
+        Metric(const Metric&) = delete;
+        Metric& operator=(const Metric&) = delete;
+
+        QLatin1String name() const { return _name; }
+        QLatin1String help() const { return _help; }
+        Type type() const { return _type; }
+
+    protected:
+        //! \brief Register the metric
+        //! \param name the metric name; should follow Prometheus naming rules
+        //!             and have a static storage duration
+        //! \param help a short description of the metric, also static
+        Metric(Type type, QLatin1String name, QLatin1String help);
+        ~Metric();
+
+    private:
+        Type _type;
+        QLatin1String _name;
+        QLatin1String _help;
+    };
+
+    //! A value that only grows, such as the number of received bytes
+    class QUOTIENT_API Counter : public Metric {
+    public:
+        Counter(QLatin1String name, QLatin1String help)
+            : Metric(CounterType, name, help)
+        {}
+
+        void add(qint64 n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+        qint64 value() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<qint64> _value { 0 };
+    };
+
+    //! A value that can go up and down, such as the length of a queue
+    class QUOTIENT_API Gauge : public Metric {
+    public:
+        Gauge(QLatin1String name, QLatin1String help)
+            : Metric(GaugeType, name, help)
+        {}
+
+        void add(qint64 n) { _value.fetch_add(n, std::memory_order_relaxed); }
+        void set(qint64 v) { _value.store(v, std::memory_order_relaxed); }
+        qint64 value() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<qint64> _value { 0 };
+    };
+
+    //! A distribution of durations over a fixed set of buckets
+    class QUOTIENT_API Histogram : public Metric {
+    public:
+        //! Upper bounds of the histogram buckets, in nanoseconds
+        static constexpr std::array<qint64, 12> BucketBounds {
+            100'000,    250'000,     500'000,     1'000'000,
+            2'500'000,  5'000'000,   10'000'000,  25'000'000,
+            50'000'000, 100'000'000, 250'000'000, 1'000'000'000
+        };
+
+        Histogram(QLatin1String name, QLatin1String help)
+            : Metric(HistogramType, name, help)
+        {}
+
+        void observe(qint64 nsecs);
+        void observe(const QElapsedTimer& et) { observe(et.nsecsElapsed()); }
+
+        //! The number of observations in each bucket (not cumulative),
+        //! the last element being the number of observations above
+        //! the last bound
+        std::array<qint64, BucketBounds.size() + 1> bucketCounts() const;
+        qint64 count() const { return _count.load(std::memory_order_relaxed); }
+        //! The sum of all observed durations, in nanoseconds
+        qint64 sum() const { return _sum.load(std::memory_order_relaxed); }
+
+    private:
+        std::array<std::atomic<qint64>, BucketBounds.size() + 1> _buckets {};
+        std::atomic<qint64> _count { 0 };
+        std::atomic<qint64> _sum { 0 };
+    };
+
+    struct MetricSnapshot {
+        QString name;
+        QString help;
+        Type type;
+        //! The counter or gauge value; the sum of observations in nanoseconds
+        //! for histograms
+        qint64 value = 0;
+        //! The number of observations (histograms only)
+        qint64 count = 0;
+        //! Cumulative bucket counts (histograms only), see Histogram::BucketBounds
+        QVector<qint64> cumulativeCounts {};
+    };
+    using Snapshot = QVector<MetricSnapshot>;
+    using Exporter = std::function<void(const Snapshot&)>;
+
+    //! Take the current values of all existing metrics
+    static Snapshot snapshot();
+    //! Render a snapshot in the Prometheus text exposition format
+    static QByteArray toPrometheusText(const Snapshot& snapshot = Metrics::snapshot());
+    //! \brief Set a function to pass metric snapshots to on publish()
+    //!
+    //! Pass an empty function to remove the exporter.
+    static void setExporter(Exporter exporter);
+    //! Pass a fresh snapshot to the exporter, if there's one
+    static void publish();
+
+    // Metrics collected by the library
+
+    static Histogram syncParseTime;
+    static Counter syncBytesReceived;
+    static Counter eventsIngested;
+    static Histogram decryptionTime;
+    static Counter eventsDecrypted;
+    static Gauge jobQueueDepth;
+    static Histogram cacheSaveTime;
+    static Histogram cacheLoadTime;
+};
+
+} // namespace Quotient
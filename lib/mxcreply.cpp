@@ -4,72 +4,192 @@
 #include "mxcreply.h"
 
 #include <QtCore/QBuffer>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QFile>
 #include "accountregistry.h"
+#include "mediacache.h"
 #include "room.h"
 
 #ifdef Quotient_E2EE_ENABLED
-#include "events/filesourceinfo.h"
+#include "e2ee/filecipherdevice.h"
 #endif
 
+#include <limits>
+
 using namespace Quotient;
 
 class MxcReply::Private
 {
 public:
-    explicit Private(QNetworkReply* r = nullptr)
-        : m_reply(r)
+    explicit Private(MxcReply* q, QNetworkReply* r = nullptr,
+                     QString cacheKey = {})
+        : q(q), m_reply(r), m_cacheKey(std::move(cacheKey))
     {}
+    MxcReply* q;
     QNetworkReply* m_reply;
     Omittable<EncryptedFileMetadata> m_encryptedFile;
     QIODevice* m_device = nullptr;
+    //! The media cache key; empty if the reply doesn't use the cache
+    QString m_cacheKey;
+
+    void findEncryptedFile(Room* room, const QString& eventId);
+    void onReplyFinished();
+    bool serveFromCache();
+    void serve(QIODevice* source);
+    void finish()
+    {
+        q->setOpenMode(ReadOnly);
+        emit q->finished();
+    }
 };
 
-MxcReply::MxcReply(QNetworkReply* reply)
-    : d(makeImpl<Private>(reply))
+void MxcReply::Private::findEncryptedFile(Room* room, const QString& eventId)
 {
-    d->m_device = d->m_reply;
-    reply->setParent(this);
-    connect(d->m_reply, &QNetworkReply::finished, this, [this]() {
-        setError(d->m_reply->error(), d->m_reply->errorString());
-        setOpenMode(ReadOnly);
-        Q_EMIT finished();
-    });
+#ifdef Quotient_E2EE_ENABLED
+    if (!room)
+        return;
+    auto eventIt = room->findInTimeline(eventId);
+    if(eventIt != room->historyEdge()) {
+        if (auto event = eventIt->viewAs<RoomMessageEvent>()) {
+            if (auto* efm = std::get_if<EncryptedFileMetadata>(
+                    &event->content()->fileInfo()->source))
+                m_encryptedFile = *efm;
+        }
+    }
+#else
+    Q_UNUSED(room)
+    Q_UNUSED(eventId)
+#endif
 }
 
-MxcReply::MxcReply(QNetworkReply* reply, Room* room, const QString &eventId)
-    : d(makeImpl<Private>(reply))
+void MxcReply::Private::onReplyFinished()
 {
-    reply->setParent(this);
-    connect(d->m_reply, &QNetworkReply::finished, this, [this]() {
-        setError(d->m_reply->error(), d->m_reply->errorString());
+    q->setError(m_reply->error(), m_reply->errorString());
+    if (!m_cacheKey.isEmpty()) {
+        auto& cache = MediaCache::instance();
+        if (m_reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()
+            == 304) {
+            // The conditional request confirmed the cached entry
+            cache.markValidated(m_cacheKey);
+            if (!serveFromCache())
+                q->setError(ContentNotFoundError,
+                            "The cached media is gone"_ls);
+            finish();
+            return;
+        }
+        if (m_reply->error() == NoError) {
+            const auto data = m_reply->readAll();
+            const MediaCache::Entry metadata {
+                {},
+                m_reply->header(QNetworkRequest::ContentTypeHeader).toString(),
+                m_reply->rawHeader("ETag"),
+                m_reply->rawHeader("Last-Modified"),
+                {}
+            };
+            if (!cache.insert(m_cacheKey, data, metadata).isValid()
+                || !serveFromCache()) {
+                // Serve the data from memory if the cache is not usable
+                auto* buffer = new QBuffer(q);
+                buffer->setData(data);
+                buffer->open(ReadOnly);
+                serve(buffer);
+            }
+            finish();
+            return;
+        }
+    }
+    serve(m_reply);
+    finish();
+}
 
-#ifdef Quotient_E2EE_ENABLED
-        if(!d->m_encryptedFile.has_value()) {
-            d->m_device = d->m_reply;
-        } else {
-            auto buffer = new QBuffer(this);
-            buffer->setData(
-                decryptFile(d->m_reply->readAll(), *d->m_encryptedFile));
+bool MxcReply::Private::serveFromCache()
+{
+    const auto entry = MediaCache::instance().find(m_cacheKey);
+    if (!entry.isValid())
+        return false;
+    auto* file = new QFile(entry.fileName, q);
+    if (!file->open(ReadOnly)) {
+        delete file;
+        return false;
+    }
+    if (!entry.contentType.isEmpty())
+        q->setHeader(QNetworkRequest::ContentTypeHeader, entry.contentType);
+    QIODevice* source = file;
+    // Serve the data right from the mapped file pages, without copying
+    // the file to memory; QByteArray can't refer to more than 2GB though
+    if (const auto size = file->size();
+        size > 0 && size <= std::numeric_limits<int>::max())
+        if (const auto* mapped = file->map(0, size)) {
+            auto* buffer = new QBuffer(q);
+            buffer->setData(QByteArray::fromRawData(
+                reinterpret_cast<const char*>(mapped), int(size)));
             buffer->open(ReadOnly);
-            d->m_device = buffer;
+            source = buffer;
         }
-#else
-        d->m_device = d->m_reply;
-#endif
-        setOpenMode(ReadOnly);
-        emit finished();
-    });
+    serve(source);
+    return true;
+}
 
+void MxcReply::Private::serve(QIODevice* source)
+{
 #ifdef Quotient_E2EE_ENABLED
-    auto eventIt = room->findInTimeline(eventId);
-    if(eventIt != room->historyEdge()) {
-        if (auto event = eventIt->viewAs<RoomMessageEvent>()) {
-            if (auto* efm = std::get_if<EncryptedFileMetadata>(
-                    &event->content()->fileInfo()->source))
-                d->m_encryptedFile = *efm;
+    if (m_encryptedFile.has_value() && q->error() == NoError) {
+        // The whole ciphertext is available by now; check its hash before
+        // giving out anything decrypted from it, as AES-CTR alone doesn't
+        // protect the plaintext from tampering
+        if (source->isSequential()) {
+            auto* buffer = new QBuffer(q);
+            buffer->setData(source->readAll());
+            buffer->open(ReadOnly);
+            source = buffer;
         }
+        QCryptographicHash hash { QCryptographicHash::Sha256 };
+        if (!hash.addData(source) || !source->seek(0)
+            || hash.result()
+                   != QByteArray::fromBase64(
+                       m_encryptedFile->hashes.value("sha256"_ls).toLatin1())) {
+            q->setError(QNetworkReply::UnknownContentError,
+                        "The hash of the encrypted file doesn't match"_ls);
+            return;
+        }
+        // Decrypt the data as it's read instead of copying all of it
+        auto* decryptor = new FileCipherDevice(FileCipherDevice::Decrypt,
+                                               source, *m_encryptedFile, q);
+        if (!decryptor->open(ReadOnly))
+            q->setError(QNetworkReply::UnknownContentError,
+                        decryptor->errorString());
+        source = decryptor;
     }
 #endif
+    m_device = source;
+}
+
+MxcReply::MxcReply(QNetworkReply* reply)
+    : MxcReply(reply, QString())
+{}
+
+MxcReply::MxcReply(QNetworkReply* reply, Room* room, const QString &eventId)
+    : MxcReply(reply, QString(), room, eventId)
+{}
+
+MxcReply::MxcReply(QNetworkReply* reply, const QString& cacheKey, Room* room,
+                   const QString& eventId)
+    : d(makeImpl<Private>(this, reply, cacheKey))
+{
+    d->findEncryptedFile(room, eventId);
+    if (!reply) {
+        Q_ASSERT(!cacheKey.isEmpty());
+        QMetaObject::invokeMethod(this, [this] {
+            if (!d->serveFromCache())
+                setError(ContentNotFoundError,
+                         "The cached media is gone"_ls);
+            d->finish();
+        }, Qt::QueuedConnection);
+        return;
+    }
+    reply->setParent(this);
+    connect(reply, &QNetworkReply::finished, this,
+            [this] { d->onReplyFinished(); });
 }
 
 MxcReply::MxcReply()
@@ -90,10 +210,11 @@ MxcReply::MxcReply()
 
 qint64 MxcReply::readData(char *data, qint64 maxSize)
 {
-    return d->m_device->read(data, maxSize);
+    return d && d->m_device ? d->m_device->read(data, maxSize) : -1;
 }
 
 void MxcReply::abort()
 {
-    d->m_reply->abort();
+    if (d && d->m_reply)
+        d->m_reply->abort();
 }
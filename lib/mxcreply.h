@@ -17,6 +17,15 @@ public:
     explicit MxcReply();
     explicit MxcReply(QNetworkReply *reply);
     MxcReply(QNetworkReply* reply, Room* room, const QString& eventId);
+    //! \brief Serve media through the media cache
+    //!
+    //! If \p reply is nullptr, the media is served from the cache entry
+    //! with \p cacheKey right away; otherwise the response to \p reply -
+    //! either a full or a conditional request - updates the cache entry
+    //! and the media is served from there.
+    //! \sa MediaCache
+    MxcReply(QNetworkReply* reply, const QString& cacheKey,
+             Room* room = nullptr, const QString& eventId = {});
 
 public Q_SLOTS:
     void abort() override;
@@ -6,6 +6,7 @@
 #include "connection.h"
 #include "room.h"
 #include "accountregistry.h"
+#include "mediacache.h"
 #include "mxcreply.h"
 
 #include <QtCore/QCoreApplication>
@@ -23,17 +24,69 @@ public:
 
     QNetworkReply* createImplRequest(Operation op,
                                      const QNetworkRequest& outerRequest,
-                                     Connection* connection)
+                                     Connection* connection,
+                                     const MediaCache::Entry& cachedEntry = {})
     {
         Q_ASSERT(outerRequest.url().scheme() == "mxc");
+        const auto& mxcUrl = outerRequest.url();
+        const QUrlQuery query(mxcUrl.query());
+        const auto thumbnailSize = requestedThumbnailSize(query);
         QNetworkRequest r(outerRequest);
-        r.setUrl(QUrl(QStringLiteral("%1/_matrix/media/r0/download/%2")
-                          .arg(connection->homeserver().toString(),
-                               outerRequest.url().authority()
-                                   + outerRequest.url().path())));
+        QUrl url(QStringLiteral("%1/_matrix/media/r0/%2/%3")
+                     .arg(connection->homeserver().toString(),
+                          thumbnailSize.isValid() ? "thumbnail"_ls
+                                                  : "download"_ls,
+                          mxcUrl.authority() + mxcUrl.path()));
+        if (thumbnailSize.isValid())
+            url.setQuery(QUrlQuery {
+                { QStringLiteral("width"),
+                  QString::number(thumbnailSize.width()) },
+                { QStringLiteral("height"),
+                  QString::number(thumbnailSize.height()) },
+                { QStringLiteral("method"), thumbnailMethod(query) } });
+        r.setUrl(url);
+        // Ask the server to only send the media if the cached one is outdated
+        if (!cachedEntry.etag.isEmpty())
+            r.setRawHeader("If-None-Match", cachedEntry.etag);
+        if (!cachedEntry.lastModified.isEmpty())
+            r.setRawHeader("If-Modified-Since", cachedEntry.lastModified);
         return q->createRequest(op, r);
     }
 
+    static QSize requestedThumbnailSize(const QUrlQuery& query)
+    {
+        return { query.queryItemValue(QStringLiteral("width")).toInt(),
+                 query.queryItemValue(QStringLiteral("height")).toInt() };
+    }
+    static QString thumbnailMethod(const QUrlQuery& query)
+    {
+        const auto method = query.queryItemValue(QStringLiteral("method"));
+        return method.isEmpty() ? QStringLiteral("scale") : method;
+    }
+
+    //! Create a reply to an mxc request, using the media cache for downloads
+    MxcReply* createMxcReply(Operation op, const QNetworkRequest& request,
+                             Connection* connection, Room* room = nullptr,
+                             const QString& eventId = {})
+    {
+        if (op != GetOperation)
+            return room ? new MxcReply(createImplRequest(op, request, connection),
+                                       room, eventId)
+                        : new MxcReply(createImplRequest(op, request, connection));
+        const QUrlQuery query(request.url().query());
+        const auto thumbnailSize = requestedThumbnailSize(query);
+        const auto cacheKey = MediaCache::makeKey(
+            request.url(), thumbnailSize,
+            thumbnailSize.isValid() ? thumbnailMethod(query) : QString());
+        auto& cache = MediaCache::instance();
+        const auto cachedEntry = cache.find(cacheKey);
+        if (cachedEntry.isValid() && !cache.needsRevalidation(cachedEntry))
+            return new MxcReply(nullptr, cacheKey, room, eventId);
+        return new MxcReply(createImplRequest(op, request, connection,
+                                              cachedEntry),
+                            cacheKey, room, eventId);
+    }
+
     NetworkAccessManager* q;
     QList<QSslError> ignoredSslErrors;
 };
@@ -108,12 +161,11 @@ QNetworkReply* NetworkAccessManager::createRequest(
                     qCWarning(NETWORK) << "Room" << roomId << "not found";
                     return new MxcReply();
                 }
-                return new MxcReply(
-                    d->createImplRequest(op, request, connection), room,
+                return d->createMxcReply(
+                    op, request, connection, room,
                     query.queryItemValue(QStringLiteral("event_id")));
             }
-            return new MxcReply(
-                d->createImplRequest(op, request, connection));
+            return d->createMxcReply(op, request, connection);
         }
     }
     auto reply = QNetworkAccessManager::createRequest(op, request, outgoingData);
@@ -0,0 +1,524 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "pushruleengine.h"
+
+#include "logging.h"
+#include "user.h"
+
+#include "events/roompowerlevelsevent.h"
+
+#include <QtCore/QVarLengthArray>
+
+#include <algorithm>
+#include <array>
+
+using namespace Quotient;
+
+namespace {
+
+inline bool isWordChar(QChar c) { return c.isLetterOrNumber() || c == u'_'; }
+
+inline bool isWordStart(QStringView text, qsizetype pos)
+{
+    return pos == 0 || !isWordChar(text[pos - 1]);
+}
+
+inline bool isWordEnd(QStringView text, qsizetype pos)
+{
+    return pos == text.size() || !isWordChar(text[pos]);
+}
+
+inline char16_t lower(QChar c) { return c.toLower().unicode(); }
+
+//! Find \p word in \p text, case-insensitively and at word boundaries
+bool containsWord(QStringView text, QStringView word)
+{
+    if (word.isEmpty())
+        return false;
+    for (auto pos = text.indexOf(word, 0, Qt::CaseInsensitive); pos != -1;
+         pos = text.indexOf(word, pos + 1, Qt::CaseInsensitive))
+        if (isWordStart(text, pos) && isWordEnd(text, pos + word.size()))
+            return true;
+    return false;
+}
+
+//! \brief A case-insensitive glob pattern compiled to an automaton
+//!
+//! The automaton has a state for each position in the pattern (state p means
+//! that the first p pattern characters have been matched); its states are
+//! tracked as a bit mask and updated for each character of the input at once
+//! (the Shift-And algorithm), so matching takes linear time whatever
+//! the wildcards are. Patterns without wildcards are matched directly.
+class Glob {
+public:
+    Glob() = default;
+    explicit Glob(const QString& pattern);
+
+    bool isLiteral() const { return literal; }
+    const QString& pattern() const { return _pattern; }
+
+    //! Match the whole of \p text
+    bool matches(QStringView text) const
+    {
+        return literal ? text.compare(_pattern, Qt::CaseInsensitive) == 0
+                       : run(text, false);
+    }
+    //! Match a part of \p text delimited by word boundaries
+    bool matchesWords(QStringView text) const
+    {
+        return literal ? containsWord(text, _pattern) : run(text, true);
+    }
+
+private:
+    using Mask = QVarLengthArray<quint64, 2>;
+
+    QString _pattern;
+    bool literal = true;
+    qsizetype words = 0;
+    Mask starMask;
+    //! States entered by any character (after a '?' in the pattern)
+    Mask anyMask;
+    //! States entered by each ASCII character, including anyMask
+    std::vector<quint64> asciiMasks;
+    //! States entered by other characters, including anyMask
+    QHash<uint, Mask> otherMasks;
+
+    const quint64* masksFor(char16_t c) const
+    {
+        if (c < 128)
+            return asciiMasks.data() + c * words;
+        const auto it = otherMasks.constFind(c);
+        return it != otherMasks.cend() ? it->constData() : anyMask.constData();
+    }
+    bool run(QStringView text, bool anywhere) const;
+};
+
+Glob::Glob(const QString& pattern)
+{
+    // Runs of '*' are equivalent to one, and the automaton relies on that
+    for (const auto c : pattern)
+        if (c != u'*' || !_pattern.endsWith(u'*'))
+            _pattern += c.toLower();
+    literal = !_pattern.contains(u'*') && !_pattern.contains(u'?');
+    if (literal)
+        return;
+
+    words = (_pattern.size() + 1 + 63) / 64;
+    starMask.resize(words);
+    std::fill(starMask.begin(), starMask.end(), 0);
+    anyMask = starMask;
+    const auto setBit = [](Mask& m, qsizetype bit) {
+        m[bit / 64] |= quint64(1) << (bit % 64);
+    };
+    for (qsizetype p = 0; p < _pattern.size(); ++p)
+        if (_pattern[p] == u'*')
+            setBit(starMask, p);
+        else if (_pattern[p] == u'?')
+            setBit(anyMask, p + 1);
+
+    asciiMasks.resize(size_t(128 * words));
+    for (char16_t c = 0; c < 128; ++c)
+        std::copy(anyMask.cbegin(), anyMask.cend(),
+                  asciiMasks.begin() + c * words);
+    for (qsizetype p = 0; p < _pattern.size(); ++p) {
+        const auto c = _pattern[p].unicode();
+        if (c == u'*' || c == u'?')
+            continue;
+        if (c < 128) {
+            asciiMasks[size_t(c * words + (p + 1) / 64)] |= quint64(1)
+                                                            << ((p + 1) % 64);
+        } else {
+            auto it = otherMasks.find(c);
+            if (it == otherMasks.end())
+                it = otherMasks.insert(c, anyMask);
+            setBit(*it, p + 1);
+        }
+    }
+}
+
+bool Glob::run(QStringView text, bool anywhere) const
+{
+    const auto finalWord = _pattern.size() / 64;
+    const auto finalBit = quint64(1) << (_pattern.size() % 64);
+    Mask state(words);
+    std::fill(state.begin(), state.end(), 0);
+    for (qsizetype k = 0;; ++k) {
+        if (k == 0 || (anywhere && isWordStart(text, k)))
+            state[0] |= 1;
+        // Let the automaton skip '*' (matching an empty string with it)
+        quint64 carry = 0;
+        for (qsizetype w = 0; w < words; ++w) {
+            const auto skipped = state[w] & starMask[w];
+            state[w] |= (skipped << 1) | carry;
+            carry = skipped >> 63;
+        }
+        if ((state[finalWord] & finalBit)
+            && (k == text.size() || (anywhere && isWordEnd(text, k))))
+            return true;
+        if (k == text.size())
+            return false;
+
+        const auto* charMask = masksFor(lower(text[k]));
+        carry = 0;
+        bool alive = false;
+        for (qsizetype w = 0; w < words; ++w) {
+            const auto shifted = (state[w] << 1) | carry;
+            carry = state[w] >> 63;
+            state[w] = (shifted & charMask[w]) | (state[w] & starMask[w]);
+            alive |= state[w] != 0;
+        }
+        if (!alive && !anywhere)
+            return false;
+    }
+}
+
+//! \brief Literal keywords of content rules merged into a trie
+//!
+//! Finding the first matching rule takes one pass over the text, trying
+//! each word start position, instead of one pass per rule.
+class KeywordTrie {
+public:
+    bool isEmpty() const { return edges.isEmpty(); }
+
+    void add(const QString& keyword, int ruleIndex)
+    {
+        int node = 0;
+        for (const auto c : keyword) {
+            const auto key = edgeKey(node, c.toLower().unicode());
+            auto it = edges.constFind(key);
+            if (it == edges.cend()) {
+                it = edges.insert(key, int(rules.size()));
+                rules.push_back(-1);
+            }
+            node = *it;
+        }
+        if (rules[size_t(node)] == -1)
+            rules[size_t(node)] = ruleIndex;
+    }
+
+    //! \brief Find the rule with the lowest index matching a word in \p text
+    //! \return the rule index, or -1 if no rule matches
+    int findFirst(QStringView text) const
+    {
+        int best = -1;
+        for (qsizetype i = 0; i < text.size(); ++i) {
+            if (!isWordStart(text, i))
+                continue;
+            int node = 0;
+            for (auto j = i; j < text.size(); ++j) {
+                const auto it = edges.constFind(edgeKey(node, lower(text[j])));
+                if (it == edges.cend())
+                    break;
+                node = *it;
+                if (const auto r = rules[size_t(node)];
+                    r != -1 && (best == -1 || r < best)
+                    && isWordEnd(text, j + 1))
+                    best = r;
+            }
+            if (best == 0)
+                break;
+        }
+        return best;
+    }
+
+private:
+    //! Child nodes by the parent node and the character
+    QHash<quint64, int> edges;
+    //! The lowest index of a rule whose keyword ends at each node, or -1
+    std::vector<int> rules { -1 };
+
+    static quint64 edgeKey(int node, char16_t c)
+    {
+        return (quint64(node) << 16) | c;
+    }
+};
+
+struct Condition {
+    enum Kind {
+        EventMatch,
+        ContainsDisplayName,
+        RoomMemberCount,
+        SenderNotificationPermission,
+        Unsupported
+    };
+    Kind kind = Unsupported;
+
+    // event_match
+    QStringList path;
+    Glob glob;
+    // room_member_count
+    enum Comparison { Eq, Lt, Gt, Le, Ge } comparison = Eq;
+    int memberCount = 0;
+    // sender_notification_permission
+    QString permissionKey;
+
+    explicit Condition(const PushCondition& c);
+};
+
+Condition::Condition(const PushCondition& c)
+{
+    if (c.kind == "event_match"_ls) {
+        if (c.key.isEmpty())
+            return;
+        kind = EventMatch;
+        path = c.key.split(u'.');
+        glob = Glob(c.pattern);
+    } else if (c.kind == "contains_display_name"_ls) {
+        kind = ContainsDisplayName;
+    } else if (c.kind == "room_member_count"_ls) {
+        static const std::array<std::pair<QLatin1String, Comparison>, 5>
+            Prefixes { { { "=="_ls, Eq },
+                         { "<="_ls, Le },
+                         { ">="_ls, Ge },
+                         { "<"_ls, Lt },
+                         { ">"_ls, Gt } } };
+        auto is = c.is;
+        for (const auto& [prefix, cmp] : Prefixes)
+            if (is.startsWith(prefix)) {
+                comparison = cmp;
+                is = is.mid(prefix.size());
+                break;
+            }
+        bool ok = false;
+        memberCount = is.toInt(&ok);
+        if (ok)
+            kind = RoomMemberCount;
+    } else if (c.kind == "sender_notification_permission"_ls) {
+        kind = SenderNotificationPermission;
+        permissionKey = c.key;
+    }
+    if (kind == Unsupported)
+        qCDebug(MAIN) << "Push rule condition" << c.kind << "is not supported";
+}
+
+Notification notificationFromActions(const QVector<QVariant>& actions)
+{
+    bool notify = false;
+    bool highlight = false;
+    for (const auto& a : actions) {
+        if (a.userType() == QMetaType::QString) {
+            const auto action = a.toString();
+            notify |= action == "notify"_ls || action == "coalesce"_ls;
+        } else if (const auto tweak = a.toMap();
+                   tweak.value("set_tweak"_ls).toString() == "highlight"_ls)
+            highlight = tweak.value("value"_ls, true).toBool();
+    }
+    if (!notify)
+        return { Notification::None };
+    return { highlight ? Notification::Highlight : Notification::Basic };
+}
+
+struct Rule {
+    std::vector<Condition> conditions;
+    Notification notification;
+};
+
+//! The event being evaluated, with its data looked up once
+class EventContext {
+public:
+    EventContext(const RoomEvent& event, const Room* room)
+        : event(event), room(room)
+    {}
+
+    const RoomEvent& event;
+    const Room* room;
+
+    const QString& body()
+    {
+        if (!_body)
+            _body = event.contentPart<QString>("body"_ls);
+        return *_body;
+    }
+    QString roomId() const { return room ? room->id() : event.roomId(); }
+    Omittable<QString> field(const QStringList& path);
+    bool matches(const Condition& c);
+    bool matches(const Rule& r)
+    {
+        return std::all_of(r.conditions.cbegin(), r.conditions.cend(),
+                           [this](const Condition& c) { return matches(c); });
+    }
+
+private:
+    Omittable<QString> _body;
+};
+
+Omittable<QString> EventContext::field(const QStringList& path)
+{
+    // Events from sync responses don't have room_id
+    if (path.size() == 1 && path.front() == "room_id"_ls)
+        return roomId();
+    if (path.size() == 2 && path.front() == "content"_ls
+        && path.back() == "body"_ls) {
+        if (!event.contentJson().value("body"_ls).isString())
+            return none;
+        return body();
+    }
+    QJsonValue value = event.fullJson();
+    for (const auto& part : path)
+        value = value.toObject().value(part);
+    if (!value.isString())
+        return none;
+    return value.toString();
+}
+
+bool EventContext::matches(const Condition& c)
+{
+    switch (c.kind) {
+    case Condition::EventMatch: {
+        const auto value = field(c.path);
+        if (!value)
+            return false;
+        // The message body is matched by words, other fields as a whole
+        return c.path.size() == 2 && c.path.back() == "body"_ls
+                       && c.path.front() == "content"_ls
+                   ? c.glob.matchesWords(*value)
+                   : c.glob.matches(*value);
+    }
+    case Condition::ContainsDisplayName: {
+        if (!room)
+            return false;
+        const auto displayName = room->memberName(room->localUser()->id());
+        return !displayName.isEmpty() && containsWord(body(), displayName);
+    }
+    case Condition::RoomMemberCount: {
+        if (!room)
+            return false;
+        const auto count = room->joinedCount();
+        switch (c.comparison) {
+        case Condition::Eq: return count == c.memberCount;
+        case Condition::Lt: return count < c.memberCount;
+        case Condition::Gt: return count > c.memberCount;
+        case Condition::Le: return count <= c.memberCount;
+        case Condition::Ge: return count >= c.memberCount;
+        }
+        return false;
+    }
+    case Condition::SenderNotificationPermission: {
+        if (!room)
+            return false;
+        // Only the "room" permission is defined as of this writing; 50 is
+        // the default level for it and for any other
+        const auto* powerLevels =
+            room->currentState().get<RoomPowerLevelsEvent>();
+        const auto requiredLevel = powerLevels && c.permissionKey == "room"_ls
+                                       ? powerLevels->roomNotification()
+                                       : 50;
+        const auto senderLevel =
+            powerLevels ? powerLevels->powerLevelForUser(event.senderId()) : 0;
+        return senderLevel >= requiredLevel;
+    }
+    case Condition::Unsupported:
+        break;
+    }
+    return false;
+}
+
+} // namespace
+
+class PushRuleEngine::Private {
+public:
+    std::vector<Rule> overrideRules;
+    //! Content rules with wildcards in the pattern
+    std::vector<std::pair<Glob, int>> contentGlobs;
+    //! Content rules without wildcards
+    KeywordTrie contentKeywords;
+    //! Notifications of all content rules, in the order of the rules
+    std::vector<Notification> contentNotifications;
+    QHash<QString, Notification> roomRules;
+    QHash<QString, Notification> senderRules;
+    std::vector<Rule> underrideRules;
+
+    static std::vector<Rule> compileRules(const QVector<PushRule>& rules)
+    {
+        std::vector<Rule> result;
+        for (const auto& r : rules)
+            if (r.enabled) {
+                Rule& rule = result.emplace_back();
+                rule.conditions.reserve(size_t(r.conditions.size()));
+                for (const auto& c : r.conditions)
+                    rule.conditions.emplace_back(c);
+                rule.notification = notificationFromActions(r.actions);
+            }
+        return result;
+    }
+
+    static QHash<QString, Notification>
+    compileIdRules(const QVector<PushRule>& rules)
+    {
+        QHash<QString, Notification> result;
+        for (const auto& r : rules)
+            if (r.enabled && !result.contains(r.ruleId))
+                result.insert(r.ruleId, notificationFromActions(r.actions));
+        return result;
+    }
+
+    const Notification* matchContent(EventContext& ctx) const
+    {
+        if (contentNotifications.empty() || ctx.body().isEmpty())
+            return nullptr;
+        auto best = contentKeywords.isEmpty()
+                         ? -1
+                         : contentKeywords.findFirst(ctx.body());
+        for (const auto& [glob, index] : contentGlobs) {
+            if (best != -1 && index >= best)
+                break;
+            if (glob.matchesWords(ctx.body()))
+                best = index;
+        }
+        return best == -1 ? nullptr : &contentNotifications[size_t(best)];
+    }
+};
+
+PushRuleEngine::PushRuleEngine() : d(makeImpl<Private>()) {}
+
+PushRuleEngine::PushRuleEngine(const PushRuleset& ruleset)
+    : PushRuleEngine()
+{
+    d->overrideRules = Private::compileRules(ruleset.override);
+    for (const auto& r : ruleset.content) {
+        if (!r.enabled || r.pattern.isEmpty())
+            continue;
+        const auto index = int(d->contentNotifications.size());
+        d->contentNotifications.push_back(notificationFromActions(r.actions));
+        if (Glob glob(r.pattern); glob.isLiteral())
+            d->contentKeywords.add(glob.pattern(), index);
+        else
+            d->contentGlobs.emplace_back(std::move(glob), index);
+    }
+    d->roomRules = Private::compileIdRules(ruleset.room);
+    d->senderRules = Private::compileIdRules(ruleset.sender);
+    d->underrideRules = Private::compileRules(ruleset.underride);
+}
+
+bool PushRuleEngine::isEmpty() const
+{
+    return d->overrideRules.empty() && d->contentNotifications.empty()
+           && d->roomRules.isEmpty() && d->senderRules.isEmpty()
+           && d->underrideRules.empty();
+}
+
+Notification PushRuleEngine::evaluate(const RoomEvent& event,
+                                      const Room* room) const
+{
+    if (room && event.senderId() == room->localUser()->id())
+        return {};
+
+    EventContext ctx(event, room);
+    for (const auto& r : d->overrideRules)
+        if (ctx.matches(r))
+            return r.notification;
+    if (const auto* n = d->matchContent(ctx))
+        return *n;
+    if (!d->roomRules.isEmpty())
+        if (const auto it = d->roomRules.constFind(ctx.roomId());
+            it != d->roomRules.cend())
+            return *it;
+    if (const auto it = d->senderRules.constFind(event.senderId());
+        it != d->senderRules.cend())
+        return *it;
+    for (const auto& r : d->underrideRules)
+        if (ctx.matches(r))
+            return r.notification;
+    return {};
+}
@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "room.h"
+
+#include "csapi/definitions/push_ruleset.h"
+
+namespace Quotient {
+
+//! \brief Client-side evaluation of push rules
+//!
+//! The homeserver can only evaluate push rules on events it can read, and
+//! reports the results as aggregated counters. This class compiles the global
+//! rule set from the account's `m.push_rules` data into a form that is cheap
+//! enough to evaluate on every event entering the timeline, decrypted ones
+//! included: glob patterns are lower-cased once and turned into bit-parallel
+//! automata, and literal keywords of content rules are merged into a single
+//! trie so that a message body is scanned once for all of them.
+//!
+//! Glob patterns support `*` and `?` wildcards. Conditions of unknown kinds
+//! never match, as the specification requires.
+class QUOTIENT_API PushRuleEngine {
+public:
+    PushRuleEngine();
+    explicit PushRuleEngine(const PushRuleset& ruleset);
+
+    //! Check whether there are no enabled rules
+    bool isEmpty() const;
+
+    //! \brief Find the notification an event should produce
+    //!
+    //! The rules are evaluated in the order of their kinds (override, content,
+    //! room, sender, underride); the notification is defined by the actions of
+    //! the first matching rule. The local user's own events never produce
+    //! notifications. Conditions that need the room state (member count,
+    //! sender permissions, the local user's display name) don't match if
+    //! \p room is nullptr.
+    Notification evaluate(const RoomEvent& event, const Room* room) const;
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+
+} // namespace Quotient
@@ -15,6 +15,9 @@
 #include "syncdata.h"
 #include "user.h"
 #include "eventstats.h"
+#include "memberindex.h"
+#include "metrics.h"
+#include "pushruleengine.h"
 #include "roomstateview.h"
 #include "qt_connection_util.h"
 
@@ -51,22 +54,24 @@
 #include "jobs/downloadfilejob.h"
 #include "jobs/mediathumbnailjob.h"
 
+#include <QtCore/QCollator>
 #include <QtCore/QDir>
 #include <QtCore/QHash>
 #include <QtCore/QPointer>
 #include <QtCore/QRegularExpression>
 #include <QtCore/QStringBuilder> // for efficient string concats (operator%)
-#include <QtCore/QTemporaryFile>
 
 #include <array>
 #include <cmath>
 #include <functional>
+#include <span>
 
 #ifdef Quotient_E2EE_ENABLED
 #include "e2ee/e2ee_common.h"
 #include "e2ee/qolmaccount.h"
 #include "e2ee/qolminboundsession.h"
 #include "e2ee/qolmutility.h"
+#include "e2ee/filecipherdevice.h"
 #include "database.h"
 #endif // Quotient_E2EE_ENABLED
 
@@ -79,6 +84,9 @@ using std::llround;
 
 enum EventsPlacement : int { Older = -1, Newer = 1 };
 
+//! The number of member events in a state batch to process them in bulk
+constexpr auto MembersBulkUpdateThreshold = 1000;
+
 class Room::Private {
 public:
     /// Map of user names to users
@@ -97,7 +105,8 @@ public:
     QString id;
     JoinState joinState;
     RoomSummary summary = { none, 0, none };
-    /// The state of the room at timeline position before-0
+    /// The state of the room at timeline position before-0, along with
+    /// events of the current state evicted from the timeline front
     UnorderedMap<StateEventKey, StateEventPtr> baseState;
     /// State event stubs - events without content, just type and state key
     static decltype(baseState) stubbedState;
@@ -118,15 +127,31 @@ public:
     QString displayname;
     Avatar avatar;
     QHash<QString, Notification> notifications;
+    EventStatsIndex statsIndex;
     qsizetype serverHighlightCount = 0;
     // Starting up with estimate event statistics as there's zero knowledge
     // about the timeline.
     EventStats partiallyReadStats {}, unreadStats {};
     members_map_t membersMap;
+    //! Joined members sorted by their disambiguated names
+    MemberIndex memberIndex;
+    QCollator memberCollator;
     QList<User*> usersTyping;
     QHash<QString, QSet<QString>> eventIdReadUsers;
     QList<User*> usersInvited;
     QList<User*> membersLeft;
+    //! \brief Indices of the member lists while members are updated in bulk
+    //!
+    //! Looking up or removing a user in a list takes linear time, which adds
+    //! up to quadratic time over the full member list of a big room. During
+    //! a bulk update these sets are authoritative: users are only appended
+    //! to the lists, and the lists are cleaned up in endMembersBulkUpdate().
+    //! \sa beginMembersBulkUpdate
+    struct MembersBulkUpdate {
+        QSet<User*> invited;
+        QSet<User*> left;
+    };
+    Omittable<MembersBulkUpdate> membersBulkUpdate;
     bool displayed = false;
     QString firstDisplayedEventId;
     QString lastDisplayedEventId;
@@ -145,8 +170,25 @@ public:
     Omittable<QString> prevBatch = QString();
     QPointer<GetRoomEventsJob> eventsHistoryJob;
     QPointer<GetMembersByRoomJob> allMembersJob;
-    //! Map from megolm sessionId to set of eventIds
-    UnorderedMap<QString, QSet<QString>> undecryptedEvents;
+    //! Keys of the current state events changed since the state was saved
+    QSet<StateEventKey> unsavedStateKeys;
+    //! Whether the next state save should write the full state
+    bool fullStateSaveNeeded = true;
+    //! Whether the room has only been loaded from a summary record so far
+    bool cachedStateToLoad = false;
+    //! The number of latest timeline events never packed; 0 means no packing
+    int compactTimelineWindow = 0;
+    //! \brief Pagination tokens at the boundaries of loaded batches
+    //!
+    //! Each token can be used to fetch the history preceding the timeline
+    //! event with the index in the key; the timeline front is only trimmed
+    //! to these boundaries so that the trimmed events can be fetched again.
+    QMap<TimelineItem::index_t, QString> batchTokens;
+    int maxTimelineEvents = 0;
+    qint64 maxTimelineBytes = 0;
+    //! Sizes of timeline events JSON, only maintained with maxTimelineBytes
+    std::deque<qsizetype> eventSizes;
+    qint64 timelineBytes = 0;
 
     struct FileTransferPrivateInfo {
         FileTransferPrivateInfo() = default;
@@ -199,14 +241,68 @@ public:
     // void inviteUser(User* u); // We might get it at some point in time.
     void insertMemberIntoMap(User* u);
     void removeMemberFromMap(User* u);
+    //! \brief Start processing a big batch of member events
+    //!
+    //! Until endMembersBulkUpdate() the member lists are updated without
+    //! emitting per-member signals or disambiguating namesakes one by one.
+    void beginMembersBulkUpdate();
+    void endMembersBulkUpdate();
+    //! Add \p u to usersInvited or membersLeft unless it's already there
+    void addToMemberList(QList<User*>& list, User* u)
+    {
+        if (auto* index = memberListIndex(list)) {
+            if (index->contains(u))
+                return;
+            index->insert(u);
+        } else if (list.contains(u))
+            return;
+        list.push_back(u);
+    }
+    //! Remove \p u from usersInvited or membersLeft
+    void removeFromMemberList(QList<User*>& list, User* u)
+    {
+        if (auto* index = memberListIndex(list)) {
+            index->remove(u); // The list is cleaned up at the end
+            return;
+        }
+        list.removeOne(u);
+        Q_ASSERT(!list.contains(u));
+    }
+    QCollatorSortKey memberSortKey(User* u) const;
+    //! \brief Add \p u to memberIndex, signalling the insertion
+    //!
+    //! This is skipped in bulk updates; the index is rebuilt when they end.
+    void addToMemberIndex(User* u);
+    void removeFromMemberIndex(User* u);
+    void rebuildMemberIndex();
+    QSet<User*>* memberListIndex(const QList<User*>& list)
+    {
+        if (!membersBulkUpdate)
+            return nullptr;
+        return &list == &usersInvited ? &membersBulkUpdate->invited
+                                      : &membersBulkUpdate->left;
+    }
 
     // This updates the room displayname field (which is the way a room
-    // should be shown in the room list); called whenever the list of
-    // members, the room name (m.room.name) or canonical alias change.
+    // should be shown in the room list) if it has been invalidated since
+    // the last update; called at the end of processing every batch of changes.
     void updateDisplayname();
     // This is used by updateDisplayname() but only calculates the new name
-    // without any updates.
-    QString calculateDisplayname() const;
+    // (and records what it has been calculated from) without any updates.
+    QString calculateDisplayname();
+    //! \brief Invalidate the display name if it depends on \p changes
+    //!
+    //! A name change always invalidates the display name, an aliases change
+    //! only does if the room has no name, and a members or summary change
+    //! if the display name is made of member names.
+    void invalidateDisplayname(Changes changes);
+    //! \brief Invalidate the display name if it depends on the member event
+    //!
+    //! Member names only matter if they are in the shortlist used by
+    //! the display name, or clash with the names in it; membership changes
+    //! affect the counts and the shortlist itself.
+    void invalidateDisplaynameForMember(const RoomMemberEvent* oldEvent,
+                                        const RoomMemberEvent& newEvent);
 
     rev_iter_t historyEdge() const { return timeline.crend(); }
     Timeline::const_iterator syncEdge() const { return timeline.cend(); }
@@ -241,6 +337,14 @@ public:
         if (!events.empty()) {
             QElapsedTimer et;
             et.start();
+            const auto bulkUpdate =
+                std::count_if(events.cbegin(), events.cend(),
+                              [](const auto& eptr) {
+                                  return is<RoomMemberEvent>(*eptr);
+                              })
+                >= MembersBulkUpdateThreshold;
+            if (bulkUpdate)
+                beginMembersBulkUpdate();
             for (auto&& eptr : std::move(events)) {
                 const auto& evt = *eptr;
                 Q_ASSERT(evt.isStateEvent());
@@ -250,6 +354,8 @@ public:
                         std::move(eptr);
                 }
             }
+            if (bulkUpdate)
+                endMembersBulkUpdate();
             if (events.size() > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
                 qCDebug(PROFILER)
                     << "Updated" << q->objectName() << "room state from"
@@ -272,8 +378,28 @@ public:
 
     Changes addNewMessageEvents(RoomEvents&& events);
     void addHistoricalMessageEvents(RoomEvents&& events);
+    void compactTimeline();
+    void evictTimeline();
+    void addEventSize(const RoomEvent& e, EventsPlacement placement)
+    {
+        const auto size =
+            QJsonDocument(e.fullJson()).toJson(QJsonDocument::Compact).size();
+        if (placement == Older)
+            eventSizes.push_front(size);
+        else
+            eventSizes.push_back(size);
+        timelineBytes += size;
+    }
 
     Changes updateStatsFromSyncData(const SyncRoomData &data, bool fromCache);
+    //! Update the statistics index after the event has entered the timeline
+    //! or has been replaced
+    void updateStatsIndex(const TimelineItem& ti)
+    {
+        statsIndex.set(ti.index(), q->isEventNotable(ti),
+                       notifications.value(ti->id()).type
+                           == Notification::Highlight);
+    }
     void postprocessChanges(Changes changes, bool saveState = true);
 
     /** Move events into the timeline
@@ -356,19 +482,38 @@ public:
 
     void setTags(TagsMap&& newTags);
 
-    QJsonObject toJson() const;
+    //! \brief Make a JSON object with the room data for the state cache
+    //! \param changedStateOnly if true, only current state events listed in
+    //!        unsavedStateKeys are included; those that are no more
+    //!        eligible for caching are represented by tombstones: objects with
+    //!        `type` and `state_key` but no `content`
+    QJsonObject toJson(bool changedStateOnly = false) const;
+    //! \brief Make a summary record of the room for the top-level state cache
+    //!
+    //! The record has the same format as the room cache but only contains
+    //! what's needed to show the room in a room list: a few state events
+    //! defining the room name and avatar, member events of the users that
+    //! the room display name may be built from, tags and unread counters.
+    QJsonObject summaryRecordToJson() const;
 
     bool isLocalUser(const User* u) const { return u == q->localUser(); }
 
 #ifdef Quotient_E2EE_ENABLED
-    UnorderedMap<QString, QOlmInboundGroupSession> groupSessions;
     Omittable<QOlmOutboundGroupSession> currentOutboundMegolmSession = none;
 
+    //! \brief Decrypt a batch of megolm-encrypted events
+    //!
+    //! \return decrypted events in the order of \p encryptedEvents, with
+    //!         nullptrs for events that could not be decrypted
+    std::vector<RoomEventPtr> decryptEvents(
+        const std::vector<const EncryptedEvent*>& encryptedEvents);
+    void retryDecryption(const QSet<QString>& eventIds);
+
     bool addInboundGroupSession(QString sessionId, QByteArray sessionKey,
                                 const QString& senderId,
                                 const QString& olmSessionId)
     {
-        if (groupSessions.contains(sessionId)) {
+        if (connection->megolmSession(id, sessionId)) {
             qCWarning(E2EE) << "Inbound Megolm session" << sessionId << "already exists";
             return false;
         }
@@ -383,8 +528,7 @@ public:
         megolmSession.setSenderId(senderId);
         megolmSession.setOlmSessionId(olmSessionId);
         qCWarning(E2EE) << "Adding inbound session" << sessionId;
-        connection->saveMegolmSession(q, megolmSession);
-        groupSessions.try_emplace(sessionId, std::move(megolmSession));
+        connection->addMegolmSession(q, std::move(megolmSession));
         return true;
     }
 
@@ -394,41 +538,63 @@ public:
                                        const QDateTime& timestamp,
                                        const QString& senderId)
     {
-        auto groupSessionIt = groupSessions.find(sessionId);
-        if (groupSessionIt == groupSessions.end()) {
+        auto* senderSession = connection->megolmSession(id, sessionId);
+        if (!senderSession) {
             // qCWarning(E2EE) << "Unable to decrypt event" << eventId
             //               << "The sender's device has not sent us the keys for "
             //                  "this message";
             // TODO: request the keys
             return {};
         }
-        auto& senderSession = groupSessionIt->second;
-        if (senderSession.senderId() != senderId) {
+        if (senderSession->senderId() != senderId) {
             qCWarning(E2EE) << "Sender from event does not match sender from session";
             return {};
         }
-        auto decryptResult = senderSession.decrypt(ciphertext);
+        auto decryptResult = senderSession->decrypt(ciphertext);
         if(!decryptResult) {
             qCWarning(E2EE) << "Unable to decrypt event" << eventId
             << "with matching megolm session:" << decryptResult.error();
             return {};
         }
         const auto& [content, index] = *decryptResult;
+        if (!checkMessageIndex(sessionId, index, eventId, timestamp))
+            return {};
+        return content;
+    }
+
+    //! \brief Check that a megolm message index is not reused by another event
+    //!
+    //! Records the index for the event if it hasn't been seen before.
+    //! \return false if the index has been used by a different event, which
+    //!         means a replay attack
+    bool checkMessageIndex(const QString& sessionId, uint32_t index,
+                           const QString& eventId, const QDateTime& timestamp)
+    {
         const auto& [recordEventId, ts] =
             q->connection()->database()->groupSessionIndexRecord(
-                q->id(), senderSession.sessionId(), index);
+                q->id(), sessionId, index);
         if (recordEventId.isEmpty()) {
             q->connection()->database()->addGroupSessionIndexRecord(
-                q->id(), senderSession.sessionId(), index, eventId,
+                q->id(), sessionId, index, eventId,
                 timestamp.toMSecsSinceEpoch());
-        } else {
-            if ((eventId != recordEventId)
-                || (ts != timestamp.toMSecsSinceEpoch())) {
-                qCWarning(E2EE) << "Detected a replay attack on event" << eventId;
-                return {};
-            }
+            return true;
         }
-        return content;
+        if ((eventId != recordEventId) || (ts != timestamp.toMSecsSinceEpoch())) {
+            qCWarning(E2EE) << "Detected a replay attack on event" << eventId;
+            return false;
+        }
+        return true;
+    }
+
+    RoomEventPtr makeDecryptedEvent(const EncryptedEvent& encryptedEvent,
+                                    const QString& plaintext) const
+    {
+        auto decryptedEvent = encryptedEvent.createDecrypted(plaintext);
+        if (decryptedEvent->roomId() == id)
+            return decryptedEvent;
+        qWarning(E2EE) << "Decrypted event" << encryptedEvent.id()
+                       << "not for this room; discarding";
+        return {};
     }
 
     bool shouldRotateMegolmSession() const
@@ -480,6 +646,13 @@ private:
     template <typename ContT>
     users_shortlist_t buildShortlist(const ContT& users) const;
     users_shortlist_t buildShortlist(const QStringList& userIds) const;
+
+    //! The step of the display name algorithm that produced the name
+    enum class DisplaynameSource { Name, CanonicalAlias, Aliases, Members };
+    //! What the current display name depends on; none if it's stale
+    Omittable<DisplaynameSource> displaynameSource;
+    //! Members whose names make the current display name
+    users_shortlist_t displaynameShortlist {};
 };
 
 decltype(Room::Private::baseState) Room::Private::stubbedState {};
@@ -501,7 +674,6 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
             connection->encryptionUpdate(this, d->usersInvited);
         }
     });
-    d->groupSessions = connection->loadRoomMegolmSessions(this);
     d->currentOutboundMegolmSession =
         connection->loadCurrentOutboundMegolmSession(id);
     if (d->currentOutboundMegolmSession && d->shouldRotateMegolmSession()) {
@@ -629,7 +801,11 @@ QString Room::displayNameForHtml() const
     return displayName().toHtmlEscaped();
 }
 
-void Room::refreshDisplayName() { d->updateDisplayname(); }
+void Room::refreshDisplayName()
+{
+    d->invalidateDisplayname(Change::Name); // Invalidates unconditionally
+    d->updateDisplayname();
+}
 
 QString Room::topic() const
 {
@@ -689,6 +865,10 @@ void Room::setJoinState(JoinState state)
     if (state == oldState)
         return;
     d->joinState = state;
+    // The display name made of member names depends on the join state
+    d->invalidateDisplayname(Change::Members);
+    // Invited rooms store their state under a different key in the cache
+    d->fullStateSaveNeeded = true;
     qCDebug(STATE) << "Room" << id() << "changed state: " << terse << oldState
                    << "->" << state;
     emit joinStateChanged(oldState, state);
@@ -996,7 +1176,7 @@ Notification Room::notificationFor(const TimelineItem &ti) const
 
 Notification Room::checkForNotifications(const TimelineItem &ti)
 {
-    return { Notification::None };
+    return connection()->pushRuleEngine().evaluate(*ti, this);
 }
 
 bool Room::hasUnreadMessages() const { return !d->partiallyReadStats.empty(); }
@@ -1010,6 +1190,12 @@ int Room::unreadCount() const { return countFromStats(partiallyReadStats()); }
 
 EventStats Room::partiallyReadStats() const { return d->partiallyReadStats; }
 
+EventStats Room::statsInRange(TimelineItem::index_t from,
+                              TimelineItem::index_t to) const
+{
+    return d->statsIndex.sum(from, to);
+}
+
 EventStats Room::unreadStats() const { return d->unreadStats; }
 
 Room::rev_iter_t Room::historyEdge() const { return d->historyEdge(); }
@@ -1119,6 +1305,8 @@ void Room::setDisplayed(bool displayed)
         return;
 
     d->displayed = displayed;
+    if (displayed)
+        loadCachedState();
     emit displayedChanged(displayed);
     if (displayed)
         d->getAllMembers();
@@ -1522,6 +1710,28 @@ QList<User*> Room::membersLeft() const { return d->membersLeft; }
 
 QList<User*> Room::users() const { return d->membersMap.values(); }
 
+QList<User*> Room::sortedMembers() const
+{
+    QList<User*> res;
+    const auto size = d->memberIndex.size();
+    res.reserve(size);
+    for (int i = 0; i < size; ++i)
+        res.push_back(d->memberIndex.at(i));
+    return res;
+}
+
+int Room::sortedMembersCount() const { return d->memberIndex.size(); }
+
+User* Room::sortedMemberAt(int position) const
+{
+    return d->memberIndex.at(position);
+}
+
+int Room::sortedMemberPosition(User* member) const
+{
+    return d->memberIndex.position(member);
+}
+
 QStringList Room::memberNames() const
 {
     return safeMemberNames();
@@ -1589,13 +1799,7 @@ RoomEventPtr Room::decryptMessage(const EncryptedEvent& encryptedEvent)
         // qCWarning(E2EE) << "Encrypted message is empty";
         return {};
     }
-    auto decryptedEvent = encryptedEvent.createDecrypted(decrypted);
-    if (decryptedEvent->roomId() == id()) {
-        return decryptedEvent;
-    }
-    qWarning(E2EE) << "Decrypted event" << encryptedEvent.id()
-                   << "not for this room; discarding";
-    return {};
+    return d->makeDecryptedEvent(encryptedEvent, decrypted);
 #endif // Quotient_E2EE_ENABLED
 }
 
@@ -1617,28 +1821,21 @@ void Room::handleRoomKeyEvent(const RoomKeyEvent& roomKeyEvent,
                                   roomKeyEvent.sessionKey(), senderId,
                                   olmSessionId)) {
         qCWarning(E2EE) << "added new inboundGroupSession:"
-                        << d->groupSessions.size();
-        auto undecryptedEvents = d->undecryptedEvents[roomKeyEvent.sessionId()];
-        for (const auto& eventId : undecryptedEvents) {
-            const auto pIdx = d->eventsIndex.constFind(eventId);
-            if (pIdx == d->eventsIndex.cend())
-                continue;
-            auto& ti = d->timeline[Timeline::size_type(*pIdx - minTimelineIndex())];
-            if (auto encryptedEvent = ti.viewAs<EncryptedEvent>()) {
-                if (auto decrypted = decryptMessage(*encryptedEvent)) {
-                    // The reference will survive the pointer being moved
-                    auto& decryptedEvent = *decrypted;
-                    auto oldEvent = ti.replaceEvent(std::move(decrypted));
-                    decryptedEvent.setOriginalEvent(std::move(oldEvent));
-                    emit replacedEvent(ti.event(), decryptedEvent.originalEvent());
-                    d->undecryptedEvents[roomKeyEvent.sessionId()] -= eventId;
-                }
-            }
-        }
+                        << roomKeyEvent.sessionId();
+        connection()->retryDecryption(id(), roomKeyEvent.sessionId());
     }
 #endif // Quotient_E2EE_ENABLED
 }
 
+void Room::retryDecryption(const QSet<QString>& eventIds)
+{
+#ifdef Quotient_E2EE_ENABLED
+    d->retryDecryption(eventIds);
+#else
+    Q_UNUSED(eventIds)
+#endif
+}
+
 int Room::joinedCount() const
 {
     return d->summary.joinedMemberCount.value_or(d->membersMap.size());
@@ -1661,6 +1858,7 @@ Room::Changes Room::Private::setSummary(RoomSummary&& newSummary)
         return Change::None;
     qCDebug(STATE).nospace().noquote()
         << "Updated room summary for " << q->objectName() << ": " << summary;
+    invalidateDisplayname(Change::Summary);
     return Change::Summary;
 }
 
@@ -1672,27 +1870,37 @@ void Room::Private::insertMemberIntoMap(User* u)
         qCWarning(MEMBERS) << "insertMemberIntoMap():" << u->id()
                            << "has no name (even empty)";
     const auto userName = maybeUserName.value_or(QString());
-    const auto namesakes = membersMap.values(userName);
+    const auto namesakesCount = membersMap.count(userName);
     qCDebug(MEMBERS) << "insertMemberIntoMap(), user" << u->id()
-                     << "with name" << userName << '-'
-                     << namesakes.size() << "namesake(s) found";
+                     << "with name" << userName << '-' << namesakesCount
+                     << "namesake(s) found";
 
     // Callers should make sure they are not adding an existing user once more
-    Q_ASSERT(!namesakes.contains(u));
-    if (namesakes.contains(u)) { // Release version whines but continues
+    Q_ASSERT(!membersMap.contains(userName, u));
+    if (namesakesCount > 0 && membersMap.contains(userName, u)) {
+        // Release version whines but continues
         qCCritical(MEMBERS) << "Trying to add a user" << u->id() << "to room"
                             << q->objectName() << "but that's already in it";
         return;
     }
 
     // If there is exactly one namesake of the added user, signal member
-    // renaming for that other one because the two should be disambiguated now
-    if (namesakes.size() == 1)
-        emit q->memberAboutToRename(namesakes.front(),
-                                    namesakes.front()->fullName(q));
+    // renaming for that other one because the two should be disambiguated now;
+    // bulk updates only signal the whole list change
+    auto* const namesake = namesakesCount == 1 && !membersBulkUpdate
+                               ? *membersMap.constFind(userName)
+                               : nullptr;
+    if (namesake)
+        emit q->memberAboutToRename(namesake, namesake->fullName(q));
     membersMap.insert(userName, u);
-    if (namesakes.size() == 1)
-        emit q->memberRenamed(namesakes.front());
+    if (namesake) {
+        // The namesake's sort key now includes its id
+        removeFromMemberIndex(namesake);
+        addToMemberIndex(namesake);
+    }
+    addToMemberIndex(u);
+    if (namesake)
+        emit q->memberRenamed(namesake);
 }
 
 void Room::Private::removeMemberFromMap(User* u)
@@ -1704,12 +1912,11 @@ void Room::Private::removeMemberFromMap(User* u)
     qCDebug(MEMBERS) << "removeMemberFromMap(), username" << userName
                      << "for user" << u->id();
     User* namesake = nullptr;
-    auto namesakes = membersMap.values(userName);
     // If there was one namesake besides the removed user, signal member
     // renaming for it because it doesn't need to be disambiguated any more.
-    if (namesakes.size() == 2) {
-        namesake =
-            namesakes.front() == u ? namesakes.back() : namesakes.front();
+    if (!membersBulkUpdate && membersMap.count(userName) == 2) {
+        auto it = membersMap.constFind(userName);
+        namesake = *it == u ? *++it : *it;
         Q_ASSERT_X(namesake != u, __FUNCTION__, "Room members list is broken");
         emit q->memberAboutToRename(namesake, userName);
     }
@@ -1733,8 +1940,87 @@ void Room::Private::removeMemberFromMap(User* u)
             membersMap.remove(it.key(), u);
         }
     }
-    if (namesake)
+    removeFromMemberIndex(u);
+    if (namesake) {
+        removeFromMemberIndex(namesake);
+        addToMemberIndex(namesake);
         emit q->memberRenamed(namesake);
+    }
+}
+
+QCollatorSortKey Room::Private::memberSortKey(User* u) const
+{
+    // Same as MemberSorter, ignore the leading '@' of ids shown as names
+    auto name = q->disambiguatedMemberName(u->id());
+    if (name.startsWith(u'@'))
+        name.remove(0, 1);
+    return memberCollator.sortKey(name);
+}
+
+void Room::Private::addToMemberIndex(User* u)
+{
+    if (membersBulkUpdate)
+        return;
+    auto key = memberSortKey(u);
+    const auto position = memberIndex.positionFor(key, u);
+    emit q->sortedMemberAboutToBeInserted(u, position);
+    memberIndex.insert(u, std::move(key));
+    emit q->sortedMemberInserted(u, position);
+}
+
+void Room::Private::removeFromMemberIndex(User* u)
+{
+    if (membersBulkUpdate)
+        return;
+    const auto position = memberIndex.position(u);
+    if (position == -1)
+        return;
+    emit q->sortedMemberAboutToBeRemoved(u, position);
+    memberIndex.remove(u);
+    emit q->sortedMemberRemoved(u, position);
+}
+
+void Room::Private::rebuildMemberIndex()
+{
+    QElapsedTimer et;
+    et.start();
+    memberIndex.clear();
+    for (auto* u : std::as_const(membersMap))
+        memberIndex.insert(u, memberSortKey(u));
+    if (et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "Rebuilt the member index of" << q->objectName()
+                          << "for" << memberIndex.size() << "member(s) in"
+                          << et;
+}
+
+void Room::Private::beginMembersBulkUpdate()
+{
+    Q_ASSERT(!membersBulkUpdate);
+    emit q->memberListAboutToReset();
+    membersBulkUpdate.emplace();
+    membersBulkUpdate->invited =
+        QSet<User*>(usersInvited.cbegin(), usersInvited.cend());
+    membersBulkUpdate->left =
+        QSet<User*>(membersLeft.cbegin(), membersLeft.cend());
+}
+
+void Room::Private::endMembersBulkUpdate()
+{
+    Q_ASSERT(membersBulkUpdate);
+    // Drop users removed during the update from the lists in one pass; users
+    // removed and then added again only keep their first entry
+    for (auto* list : { &usersInvited, &membersLeft }) {
+        auto& index = *memberListIndex(*list);
+        list->erase(std::remove_if(list->begin(), list->end(),
+                                   [&index](User* u) {
+                                       return !index.remove(u);
+                                   }),
+                    list->end());
+        Q_ASSERT(index.isEmpty());
+    }
+    membersBulkUpdate.reset();
+    rebuildMemberIndex();
+    emit q->memberListReset();
 }
 
 inline auto makeErrorStr(const Event& e, QByteArray msg)
@@ -1771,8 +2057,11 @@ Room::Private::moveEventsToTimeline(RoomEventsRange events,
                              ? timeline.emplace_front(std::move(e), --index)
                              : timeline.emplace_back(std::move(e), ++index);
         eventsIndex.insert(eId, index);
+        if (maxTimelineBytes > 0)
+            addEventSize(*ti, placement);
         if (auto n = q->checkForNotifications(ti); n.type != Notification::None)
             notifications.insert(eId, n);
+        updateStatsIndex(ti);
         Q_ASSERT(q->findInTimeline(eId)->event()->id() == eId);
     }
     const auto insertedSize = (index - baseIndex) * placement;
@@ -1921,6 +2210,11 @@ Room::Changes Room::Private::updateStatsFromSyncData(const SyncRoomData& data,
 
 void Room::updateData(SyncRoomData&& data, bool fromCache)
 {
+    if (data.summaryOnly)
+        d->cachedStateToLoad = true;
+    else if (!fromCache)
+        loadCachedState(); // New data should land on top of the cached state
+
     qCDebug(MAIN) << "--- Updating room" << id() << "/" << objectName();
     bool firstUpdate = d->baseState.empty();
 
@@ -1932,7 +2226,16 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     // The order of calculation is important - don't merge the lines!
     roomChanges |= d->updateStateFrom(std::move(data.state));
     roomChanges |= d->setSummary(std::move(data.summary));
+    const auto timelineSize = d->timeline.size();
     roomChanges |= d->addNewMessageEvents(std::move(data.timeline));
+    if (const auto insertedSize = d->timeline.size() - timelineSize;
+        insertedSize > 0) {
+        if (!data.timelinePrevBatch.isEmpty())
+            d->batchTokens.insert((syncEdge() - insertedSize)->index(),
+                                  data.timelinePrevBatch);
+        d->evictTimeline();
+        d->compactTimeline();
+    }
 
     for (auto&& ephemeralEvent : data.ephemeral)
         roomChanges |= processEphemeralEvent(std::move(ephemeralEvent));
@@ -1948,6 +2251,8 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     if (roomChanges & (Change::Name | Change::Aliases))
         emit namesChanged(this);
 
+    if (fromCache) // The cache already has all that's just been loaded
+        markStateSaved(true);
     d->postprocessChanges(roomChanges, !fromCache);
     if (firstUpdate)
         emit baseStateLoaded();
@@ -1956,15 +2261,14 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
 
 void Room::Private::postprocessChanges(Changes changes, bool saveState)
 {
-    if (!changes)
-        return;
-
     if (changes & Change::Members)
         emit q->memberListChanged();
 
-    if (changes
-        & (Change::Name | Change::Aliases | Change::Members | Change::Summary))
-        updateDisplayname();
+    // Recalculates the name only if the changes affected what it depends on
+    updateDisplayname();
+
+    if (!changes)
+        return;
 
     if (changes & Change::PartiallyReadStats) {
         QT_IGNORE_DEPRECATIONS(
@@ -2400,6 +2704,7 @@ void Room::hangupCall(const QString& callId)
 
 void Room::getPreviousContent(int limit, const QString& filter)
 {
+    loadCachedState();
     d->getPreviousContent(limit, filter);
 }
 
@@ -2422,7 +2727,12 @@ void Room::Private::getPreviousContent(int limit, const QString& filter)
             prevBatch.reset();
         }
 
+        const auto oldFrontIndex =
+            timeline.empty() ? 0 : timeline.front().index();
         addHistoricalMessageEvents(eventsHistoryJob->chunk());
+        if (prevBatch && !timeline.empty()
+            && timeline.front().index() < oldFrontIndex)
+            batchTokens.insert(timeline.front().index(), *prevBatch);
     });
     connect(eventsHistoryJob, &QObject::destroyed, q,
             &Room::eventsHistoryJobChanged);
@@ -2466,20 +2776,31 @@ void Room::uploadFile(const QString& id, const QUrl& localFilename,
     // This is required because toLocalFile doesn't work on android and toString doesn't work on the desktop
     auto fileName = localFilename.isLocalFile() ? localFilename.toLocalFile() : localFilename.toString();
     FileSourceInfo fileMetadata;
+    UploadContentJob* job = nullptr;
 #ifdef Quotient_E2EE_ENABLED
-    QTemporaryFile tempFile;
+    QPointer<FileCipherDevice> encryptor;
     if (usesEncryption()) {
-        tempFile.open();
-        QFile file(fileName);
-        file.open(QFile::ReadOnly);
-        QByteArray data;
-        std::tie(fileMetadata, data) = encryptFile(file.readAll());
-        tempFile.write(data);
-        tempFile.close();
-        fileName = QFileInfo(tempFile).absoluteFilePath();
-    }
+        // The file is encrypted while it's being uploaded; the ciphertext
+        // hash is known once the upload is over
+        fileMetadata = newEncryptedFileMetadata();
+        auto* sourceFile = new QFile(fileName);
+        encryptor = new FileCipherDevice(FileCipherDevice::Encrypt, sourceFile,
+                                         std::get<EncryptedFileMetadata>(
+                                             fileMetadata));
+        sourceFile->setParent(encryptor);
+        if (encryptor->open(QIODevice::ReadOnly))
+            job = connection()->uploadContent(
+                encryptor, QFileInfo(fileName).fileName(),
+                overrideContentType.isEmpty() ? "application/octet-stream"_ls
+                                              : overrideContentType);
+        else {
+            qCWarning(E2EE) << "Couldn't open" << fileName
+                            << "for encryption:" << encryptor->errorString();
+            delete encryptor;
+        }
+    } else
 #endif
-    auto job = connection()->uploadFile(fileName, overrideContentType);
+        job = connection()->uploadFile(fileName, overrideContentType);
     if (isJobPending(job)) {
         d->fileTransfers[id] = { job, fileName, true };
         connect(job, &BaseJob::uploadProgress, this,
@@ -2488,9 +2809,23 @@ void Room::uploadFile(const QString& id, const QUrl& localFilename,
                     emit fileTransferProgress(id, sent, total);
                 });
         connect(job, &BaseJob::success, this,
-                [this, id, localFilename, job, fileMetadata]() mutable {
+                [this, id, localFilename, job, fileMetadata
+#ifdef Quotient_E2EE_ENABLED
+                 , encryptor
+#endif
+                ]() mutable {
                     // The lambda is mutable to change encryptedFileMetadata
                     d->fileTransfers[id].status = FileTransferInfo::Completed;
+#ifdef Quotient_E2EE_ENABLED
+                    if (auto* efm =
+                            std::get_if<EncryptedFileMetadata>(&fileMetadata);
+                        efm && encryptor)
+                        efm->hashes.insert(
+                            QStringLiteral("sha256"),
+                            QString::fromLatin1(
+                                encryptor->ciphertextHash().toBase64(
+                                    QByteArray::OmitTrailingEquals)));
+#endif
                     setUrlInSourceInfo(fileMetadata, QUrl(job->contentUri()));
                     emit fileTransferCompleted(id, localFilename, fileMetadata);
                 });
@@ -2589,17 +2924,19 @@ void Room::Private::dropDuplicateEvents(RoomEvents& events) const
     if (events.empty())
         return;
 
-    // Multiple-remove (by different criteria), single-erase
-    // 1. Check for duplicates against the timeline.
-    auto dupsBegin =
+    // Check for duplicates against the timeline and within the batch in
+    // a single pass, remembering ids already seen in the batch; unlike
+    // checking each event against the rest of the batch, this is linear.
+    QSet<QString> batchIds;
+    batchIds.reserve(int(events.size()));
+    const auto dupsBegin =
         remove_if(events.begin(), events.end(), [&](const RoomEventPtr& e) {
-            return eventsIndex.contains(e->id());
-        });
-
-    // 2. Check for duplicates within the batch if there are still events.
-    for (auto eIt = events.begin(); distance(eIt, dupsBegin) > 1; ++eIt)
-        dupsBegin = remove_if(eIt + 1, dupsBegin, [&](const RoomEventPtr& e) {
-            return e->id() == (*eIt)->id();
+            const auto& id = e->id();
+            if (eventsIndex.contains(id))
+                return true;
+            const auto sizeBefore = batchIds.size();
+            batchIds.insert(id);
+            return batchIds.size() == sizeBefore; // Already seen in the batch
         });
     if (dupsBegin == events.end())
         return;
@@ -2612,24 +2949,196 @@ void Room::Private::dropDuplicateEvents(RoomEvents& events) const
 void Room::Private::decryptIncomingEvents(RoomEvents& events)
 {
 #ifdef Quotient_E2EE_ENABLED
+    std::vector<RoomEventPtr*> eventSlots;
+    std::vector<const EncryptedEvent*> encryptedEvents;
+    for (auto& eptr : events)
+        if (const auto& eeptr = eventCast<EncryptedEvent>(eptr);
+            eeptr && !eeptr->isRedacted()) {
+            eventSlots.push_back(&eptr);
+            encryptedEvents.push_back(eeptr);
+        }
+    auto decryptedEvents = decryptEvents(encryptedEvents);
+    for (size_t i = 0; i < eventSlots.size(); ++i)
+        if (auto& decrypted = decryptedEvents[i]) {
+            auto&& oldEvent = exchange(*eventSlots[i], std::move(decrypted));
+            (*eventSlots[i])->setOriginalEvent(std::move(oldEvent));
+        } else
+            connection->addUndecryptedEvent(id, encryptedEvents[i]->sessionId(),
+                                            encryptedEvents[i]->id());
+#endif
+}
+
+#ifdef Quotient_E2EE_ENABLED
+std::vector<RoomEventPtr> Room::Private::decryptEvents(
+    const std::vector<const EncryptedEvent*>& encryptedEvents)
+{
     QElapsedTimer et;
     et.start();
-    size_t totalDecrypted = 0;
-    for (auto& eptr : events)
-        if (const auto& eeptr = eventCast<EncryptedEvent>(eptr)) {
-            if (eeptr->isRedacted())
-                continue;
-            if (auto decrypted = q->decryptMessage(*eeptr)) {
-                ++totalDecrypted;
-                auto&& oldEvent = exchange(eptr, std::move(decrypted));
-                eptr->setOriginalEvent(std::move(oldEvent));
-            } else
-                undecryptedEvents[eeptr->sessionId()] += eeptr->id();
+    std::vector<RoomEventPtr> decryptedEvents(encryptedEvents.size());
+    // Megolm sessions are independent of each other, so events are grouped
+    // by session and the groups are decrypted on a thread pool, each group
+    // by a single thread. Everything else (database access, creating
+    // decrypted events) happens on this thread.
+    struct BatchItem {
+        size_t eventIdx;
+        QByteArray ciphertext;
+        qint64 timestamp;
+        Omittable<std::pair<QByteArray, uint32_t>> result = none;
+    };
+    struct SessionBatch {
+        QString sessionId;
+        std::vector<BatchItem> items {};
+        QOlmInboundGroupSession* session = nullptr;
+    };
+    std::vector<SessionBatch> batches;
+    QHash<QString, size_t> batchIndices;
+    for (size_t i = 0; i < encryptedEvents.size(); ++i) {
+        const auto& encryptedEvent = *encryptedEvents[i];
+        if (const auto algorithm = encryptedEvent.algorithm();
+            !isSupportedAlgorithm(algorithm)) //
+        {
+            qWarning(E2EE) << "Algorithm" << algorithm << "of encrypted event"
+                           << encryptedEvent.id() << "is not supported";
+            continue;
         }
+        const auto sessionId = encryptedEvent.sessionId();
+        auto batchIt = batchIndices.constFind(sessionId);
+        if (batchIt == batchIndices.cend()) {
+            batchIt = batchIndices.insert(sessionId, batches.size());
+            batches.push_back({ sessionId });
+        }
+        batches[*batchIt].items.push_back(
+            { i, encryptedEvent.ciphertext(),
+              encryptedEvent.originTimestamp().toMSecsSinceEpoch() });
+    }
+    // Megolm ratchets forward, so decrypting in the order of message indices
+    // is cheapest; events come newest first from back-pagination, and
+    // timestamps are the best available approximation of the index order
+    for (auto& batch : batches)
+        std::stable_sort(batch.items.begin(), batch.items.end(),
+                         [](const BatchItem& a, const BatchItem& b) {
+                             return a.timestamp < b.timestamp;
+                         });
+
+    size_t totalDecrypted = 0;
+    // Session pointers from Connection::megolmSession() are only valid until
+    // the session is evicted from the cache; take at most as many sessions
+    // at once as the cache can hold
+    const auto chunkSize =
+        size_t(std::max(connection->megolmSessionCacheSize(), 1));
+    for (size_t chunkBegin = 0; chunkBegin < batches.size();
+         chunkBegin += chunkSize) {
+        const std::span chunk { batches.data() + chunkBegin,
+                                std::min(chunkSize, batches.size() - chunkBegin) };
+        for (auto& batch : chunk)
+            batch.session = connection->megolmSession(id, batch.sessionId);
+        runOnPool(QThreadPool::globalInstance(), chunk, [](SessionBatch& batch) {
+            if (!batch.session)
+                return; // The events will be retried once the keys arrive
+            for (auto& item : batch.items)
+                if (auto decryptResult = batch.session->decrypt(item.ciphertext))
+                    item.result = std::move(*decryptResult);
+        });
+        for (auto& batch : chunk)
+            for (auto& item : batch.items) {
+                const auto& encryptedEvent = *encryptedEvents[item.eventIdx];
+                if (!item.result) {
+                    if (batch.session)
+                        qCWarning(E2EE) << "Unable to decrypt event"
+                                        << encryptedEvent.id()
+                                        << "with matching megolm session";
+                    continue;
+                }
+                if (batch.session->senderId() != encryptedEvent.senderId()) {
+                    qCWarning(E2EE) << "Sender from event does not match "
+                                       "sender from session";
+                    continue;
+                }
+                const auto& [content, index] = *item.result;
+                if (!checkMessageIndex(batch.sessionId, index,
+                                       encryptedEvent.id(),
+                                       encryptedEvent.originTimestamp()))
+                    continue;
+                auto& decrypted = decryptedEvents[item.eventIdx];
+                decrypted = makeDecryptedEvent(encryptedEvent,
+                                               QString::fromUtf8(content));
+                if (decrypted)
+                    ++totalDecrypted;
+            }
+    }
+    if (totalDecrypted > 0) {
+        Metrics::decryptionTime.observe(et);
+        Metrics::eventsDecrypted.add(qint64(totalDecrypted));
+    }
     if (totalDecrypted > 5 || et.nsecsElapsed() >= ProfilerMinNsecs)
-        qDebug(PROFILER) << "Decrypted" << totalDecrypted << "events in" << et;
-#endif
+        qDebug(PROFILER).nospace()
+            << "Decrypted " << totalDecrypted << " event(s) from "
+            << batches.size() << " megolm session(s) in " << et << " ("
+            << qint64(double(totalDecrypted) * 1e9
+                      / double(std::max(et.nsecsElapsed(), qint64(1))))
+            << " events/s)";
+    return decryptedEvents;
+}
+
+void Room::Private::retryDecryption(const QSet<QString>& eventIds)
+{
+    std::vector<TimelineItem*> items;
+    std::vector<const EncryptedEvent*> encryptedEvents;
+    for (const auto& eventId : eventIds) {
+        // Events that have left the timeline are no more interesting
+        const auto pIdx = eventsIndex.constFind(eventId);
+        if (pIdx == eventsIndex.cend())
+            continue;
+        auto& ti = timeline[Timeline::size_type(*pIdx - q->minTimelineIndex())];
+        if (const auto* encryptedEvent = ti.viewAs<EncryptedEvent>()) {
+            items.push_back(&ti);
+            encryptedEvents.push_back(encryptedEvent);
+        }
+    }
+    auto decryptedEvents = decryptEvents(encryptedEvents);
+    // Update the whole timeline first and notify clients afterwards, so that
+    // they see a consistent timeline in the slots
+    std::vector<const TimelineItem*> replacedItems;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (auto& decrypted = decryptedEvents[i]) {
+            // The reference will survive the pointer being moved
+            auto& decryptedEvent = *decrypted;
+            auto oldEvent = items[i]->replaceEvent(std::move(decrypted));
+            decryptedEvent.setOriginalEvent(std::move(oldEvent));
+            replacedItems.push_back(items[i]);
+            // The server could only evaluate push rules on the encrypted event
+            if (const auto n = q->checkForNotifications(*items[i]);
+                n.type != Notification::None)
+                notifications.insert(decryptedEvent.id(), n);
+            else
+                notifications.remove(decryptedEvent.id());
+            updateStatsIndex(*items[i]);
+        } else
+            connection->addUndecryptedEvent(id, encryptedEvents[i]->sessionId(),
+                                            encryptedEvents[i]->id());
+    }
+    if (!replacedItems.empty()) {
+        // Decrypted events can become notable or highlighted; exact statistics
+        // are recounted (which is cheap), estimates come from the server and
+        // stay as they are
+        if (!unreadStats.isEstimate)
+            if (const auto s =
+                    EventStats::fromMarker(q, q->localReadReceiptMarker());
+                s != unreadStats) {
+                unreadStats = s;
+                emit q->unreadStatsChanged();
+            }
+        if (!partiallyReadStats.isEstimate)
+            if (const auto s = EventStats::fromMarker(q, q->fullyReadMarker());
+                s != partiallyReadStats) {
+                partiallyReadStats = s;
+                emit q->partiallyReadStatsChanged();
+            }
+    }
+    for (const auto* ti : replacedItems)
+        emit q->replacedEvent(ti->event(), ti->event()->originalEvent());
 }
+#endif
 
 /** Make a redacted event
  *
@@ -2712,6 +3221,7 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
     // Make a new event from the redacted JSON and put it in the timeline
     // instead of the redacted one. oldEvent will be deleted on return.
     auto oldEvent = ti.replaceEvent(makeRedacted(*ti, redaction));
+    updateStatsIndex(ti);
     qCDebug(EVENTS) << "Redacted" << oldEvent->id() << "with" << redaction.id();
     if (oldEvent->isStateEvent()) {
         // Check whether the old event was a part of current state; if it was,
@@ -2726,9 +3236,9 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
                 << "Redacting state " << oldEvent->matrixType() << "/"
                 << oldEvent->stateKey();
             // Retarget the current state to the newly made event.
+            // The display name gets updated along with the rest of the changes
             if (q->processStateEvent(*ti))
                 emit q->namesChanged(q);
-            updateDisplayname();
         }
     }
     if (const auto* reaction = eventCast<ReactionEvent>(oldEvent)) {
@@ -2796,6 +3306,7 @@ bool Room::Private::processReplacement(const RoomMessageEvent& newEvent)
     // Make a new event from the redacted JSON and put it in the timeline
     // instead of the redacted one. oldEvent will be deleted on return.
     auto oldEvent = ti.replaceEvent(makeReplaced(*ti, newEvent));
+    updateStatsIndex(ti);
     qCDebug(STATE) << "Replaced" << oldEvent->id() << "with" << newEvent.id();
     emit q->replacedEvent(ti.event(), std::to_address(oldEvent));
     return true;
@@ -2961,6 +3472,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
     }
 
     Q_ASSERT(timeline.size() == timelineSize + totalInserted);
+    Metrics::eventsIngested.add(qint64(totalInserted));
     if (totalInserted > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
         qCDebug(PROFILER) << "Added" << totalInserted << "new event(s) to"
                           << q->objectName() << "in" << et;
@@ -3003,15 +3515,138 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
 
     addRelations(from, historyEdge());
     Q_ASSERT(timeline.size() == timelineSize + insertedSize);
+    Metrics::eventsIngested.add(qint64(insertedSize));
     if (insertedSize > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
         qCDebug(PROFILER) << "Added" << insertedSize << "historical event(s) to"
                           << q->objectName() << "in" << et;
 
     changes |= updateStats(from, historyEdge());
+    compactTimeline();
     if (changes)
         postprocessChanges(changes);
 }
 
+void Room::Private::evictTimeline()
+{
+    if ((maxTimelineEvents <= 0 && maxTimelineBytes <= 0) || timeline.empty())
+        return;
+
+    const auto frontIndex = timeline.front().index();
+    auto cutIndex = frontIndex;
+    if (maxTimelineEvents > 0)
+        cutIndex = std::max(cutIndex,
+                            timeline.back().index() - maxTimelineEvents + 1);
+    if (maxTimelineBytes > 0) {
+        Q_ASSERT(eventSizes.size() == timeline.size());
+        auto bytes = timelineBytes;
+        auto bytesCutIndex = frontIndex;
+        for (auto it = eventSizes.cbegin();
+             it != eventSizes.cend() && bytes > maxTimelineBytes;
+             ++it, ++bytesCutIndex)
+            bytes -= *it;
+        cutIndex = std::max(cutIndex, bytesCutIndex);
+    }
+    // Keep the displayed range, as well as the events the unread statistics
+    // are counted from
+    for (const auto& eventId :
+         { firstDisplayedEventId, lastDisplayedEventId, fullyReadUntilEventId,
+           lastReadReceipts.value(connection->userId()).eventId })
+        if (const auto it = eventsIndex.constFind(eventId);
+            it != eventsIndex.cend())
+            cutIndex = std::min(cutIndex, *it);
+
+    // Only trim to a batch boundary, to be able to fetch the history again
+    auto tokenIt = batchTokens.upperBound(cutIndex);
+    if (cutIndex <= frontIndex || tokenIt == batchTokens.begin())
+        return;
+    --tokenIt;
+    const auto newFrontIndex = tokenIt.key();
+    if (newFrontIndex <= frontIndex)
+        return;
+    const auto newPrevBatch = tokenIt.value();
+
+    QElapsedTimer et;
+    et.start();
+    emit q->aboutToEvictMessages(frontIndex, newFrontIndex - 1);
+    while (timeline.front().index() < newFrontIndex) {
+        auto& ti = timeline.front();
+        const auto eId = ti.eventId();
+        eventsIndex.remove(eId);
+        notifications.remove(eId);
+        if (!eventSizes.empty()) {
+            timelineBytes -= eventSizes.front();
+            eventSizes.pop_front();
+        }
+        // Packed events are never reactions, undecrypted or state events
+        // (see EventItemBase::pack()); don't unpack them only to drop them
+        if (ti.isPacked()) {
+            timeline.pop_front();
+            continue;
+        }
+        if (const auto* reaction = ti.viewAs<ReactionEvent>()) {
+            const auto& content = reaction->content().value;
+            if (auto relIt = relations.find({ content.eventId, content.type });
+                relIt != relations.end()) {
+                relIt->removeOne(reaction);
+                if (relIt->isEmpty())
+                    relations.erase(relIt);
+            }
+        }
+#ifdef Quotient_E2EE_ENABLED
+        else if (const auto* encrypted = ti.viewAs<EncryptedEvent>()) {
+            connection->removeUndecryptedEvent(id, encrypted->sessionId(),
+                                               eId);
+        }
+#endif
+        // The current state refers to its events by raw pointers; move
+        // the event into baseState instead of deleting it along with the item
+        if (ti->isStateEvent()
+            && currentState.get(ti->matrixType(), ti->stateKey())
+                   == ti.event()) {
+            auto evt = ti.replaceEvent({});
+            const StateEventKey evtKey { evt->matrixType(), evt->stateKey() };
+            baseState[evtKey] =
+                StateEventPtr(static_cast<StateEvent*>(evt.release()));
+        }
+        timeline.pop_front();
+    }
+    statsIndex.dropBefore(newFrontIndex);
+    while (!batchTokens.isEmpty() && batchTokens.firstKey() <= newFrontIndex)
+        batchTokens.erase(batchTokens.begin());
+    prevBatch = newPrevBatch;
+    emit q->evictedMessages();
+    qCDebug(MESSAGES) << "Evicted" << newFrontIndex - frontIndex
+                      << "event(s) from the timeline of" << q->objectName()
+                      << "in" << et << "- the oldest event is now"
+                      << timeline.front();
+}
+
+void Room::Private::compactTimeline()
+{
+    if (compactTimelineWindow <= 0
+        || timeline.size() <= size_t(compactTimelineWindow))
+        return;
+
+    QElapsedTimer et;
+    et.start();
+    // Events in the displayed range are never packed - clients are likely to
+    // hold pointers to them
+    auto keepFromIndex = timeline.back().index() - compactTimelineWindow + 1;
+    for (const auto& markerId : { firstDisplayedEventId, lastDisplayedEventId })
+        if (const auto it = eventsIndex.constFind(markerId);
+            it != eventsIndex.cend())
+            keepFromIndex = std::min(keepFromIndex, *it);
+
+    size_t packedCount = 0;
+    for (auto it = timeline.begin();
+         it != timeline.end() && it->index() < keepFromIndex; ++it)
+        if (!it->isPacked() && it->pack())
+            ++packedCount;
+    if (packedCount > 0 && et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "Packed" << packedCount << "timeline event(s) in"
+                          << q->objectName() << "in" << et;
+}
+
 Room::Changes Room::processStateEvent(const RoomEvent& e)
 {
     if (!e.isStateEvent())
@@ -3036,16 +3671,16 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
                                                : Membership::Leave;
             switch (prevMembership) {
             case Membership::Invite:
-                if (rme.membership() != prevMembership) {
-                    d->usersInvited.removeOne(u);
-                    Q_ASSERT(!d->usersInvited.contains(u));
-                }
+                if (rme.membership() != prevMembership)
+                    d->removeFromMemberList(d->usersInvited, u);
                 break;
             case Membership::Join:
                 if (rme.membership() == Membership::Join) {
                     // rename/avatar change or no-op
                     if (rme.newDisplayName()) {
-                        emit memberAboutToRename(u, *rme.newDisplayName());
+                        if (!d->membersBulkUpdate)
+                            emit memberAboutToRename(u,
+                                                     *rme.newDisplayName());
                         d->removeMemberFromMap(u);
                     }
                     if (!rme.newDisplayName() && !rme.newAvatarUrl()) {
@@ -3061,17 +3696,16 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
                             << "Membership change from Join to Invite:" << rme;
                     // whatever the new membership, it's no more Join
                     d->removeMemberFromMap(u);
-                    emit userRemoved(u);
+                    if (!d->membersBulkUpdate)
+                        emit userRemoved(u);
                 }
                 break;
             case Membership::Ban:
             case Membership::Knock:
             case Membership::Leave:
                 if (rme.membership() == Membership::Invite
-                    || rme.membership() == Membership::Join) {
-                    d->membersLeft.removeOne(u);
-                    Q_ASSERT(!d->membersLeft.contains(u));
-                }
+                    || rme.membership() == Membership::Join)
+                    d->removeFromMemberList(d->membersLeft, u);
                 break;
             case Membership::Undefined:
                 ; // A warning will be dropped in the post-processing block below
@@ -3109,6 +3743,7 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
     // Change the state
     const auto* const oldStateEvent =
         std::exchange(curStateEvent, static_cast<const StateEvent*>(&e));
+    d->unsavedStateKeys.insert({ e.matrixType(), e.stateKey() });
     Q_ASSERT(!oldStateEvent
              || (oldStateEvent->matrixType() == e.matrixType()
                  && oldStateEvent->stateKey() == e.stateKey()));
@@ -3165,31 +3800,34 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
             const auto prevMembership = oldMemberEvent
                                             ? oldMemberEvent->membership()
                                             : Membership::Leave;
+            d->invalidateDisplaynameForMember(oldMemberEvent, evt);
+            // Bulk updates only signal the whole list change
+            const auto signalMember = !d->membersBulkUpdate;
             switch (evt.membership()) {
             case Membership::Join:
                 if (prevMembership != Membership::Join) {
                     d->insertMemberIntoMap(u);
-                    emit userAdded(u);
+                    if (signalMember)
+                        emit userAdded(u);
                 } else {
                     if (evt.newDisplayName()) {
                         d->insertMemberIntoMap(u);
-                        emit memberRenamed(u);
+                        if (signalMember)
+                            emit memberRenamed(u);
                     }
-                    if (evt.newAvatarUrl())
+                    if (evt.newAvatarUrl() && signalMember)
                         emit memberAvatarChanged(u);
                 }
                 break;
             case Membership::Invite:
-                if (!d->usersInvited.contains(u))
-                    d->usersInvited.push_back(u);
+                d->addToMemberList(d->usersInvited, u);
                 if (u == localUser() && evt.isDirect())
                     connection()->addToDirectChats(this, user(evt.senderId()));
                 break;
             case Membership::Knock:
             case Membership::Ban:
             case Membership::Leave:
-                if (!d->membersLeft.contains(u))
-                    d->membersLeft.append(u);
+                d->addToMemberList(d->membersLeft, u);
                 break;
             case Membership::Undefined:
                 qCWarning(MEMBERS) << "Ignored undefined membership type";
@@ -3223,6 +3861,9 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
         , Change::Other);
     // clang-format on
     Q_ASSERT(result != Change::None);
+    // Member events are checked more selectively in the handler above
+    if (!is<RoomMemberEvent>(e))
+        d->invalidateDisplayname(result);
     return result;
 }
 
@@ -3353,27 +3994,33 @@ Room::Private::buildShortlist(const QStringList& userIds) const
     return buildShortlist(users);
 }
 
-QString Room::Private::calculateDisplayname() const
+QString Room::Private::calculateDisplayname()
 {
     // CS spec, section 13.2.2.5 Calculating the display name for a room
     // Numbers below refer to respective parts in the spec.
+    displaynameShortlist = {};
 
     // 1. Name (from m.room.name)
+    displaynameSource = DisplaynameSource::Name;
     auto dispName = q->name();
     if (!dispName.isEmpty()) {
         return dispName;
     }
 
     // 2. Canonical alias
+    displaynameSource = DisplaynameSource::CanonicalAlias;
     dispName = q->canonicalAlias();
     if (!dispName.isEmpty())
         return dispName;
 
     // 3. m.room.aliases - only local aliases, subject for further removal
+    displaynameSource = DisplaynameSource::Aliases;
     const auto aliases = q->aliases();
     if (!aliases.isEmpty())
         return aliases.front();
 
+    displaynameSource = DisplaynameSource::Members;
+
     // 4. m.heroes and m.room.member
     // From here on, we use a more general algorithm than the spec describes
     // in order to provide back-compatibility with pre-MSC688 servers.
@@ -3398,6 +4045,7 @@ QString Room::Private::calculateDisplayname() const
 
     if (!shortlist.front())
         shortlist = buildShortlist(membersLeft);
+    displaynameShortlist = shortlist;
 
     QStringList names;
     for (const auto* u : shortlist) {
@@ -3436,8 +4084,54 @@ QString Room::Private::calculateDisplayname() const
     return tr("Empty room (%1)").arg(id);
 }
 
+void Room::Private::invalidateDisplayname(Changes changes)
+{
+    if (!displaynameSource)
+        return;
+    const auto source = *displaynameSource;
+    if ((changes & Change::Name)
+        || ((changes & Change::Aliases) && source != DisplaynameSource::Name)
+        || ((changes & (Change::Members | Change::Summary))
+            && source == DisplaynameSource::Members))
+        displaynameSource.reset();
+}
+
+void Room::Private::invalidateDisplaynameForMember(
+    const RoomMemberEvent* oldEvent, const RoomMemberEvent& newEvent)
+{
+    if (!displaynameSource || *displaynameSource != DisplaynameSource::Members)
+        return;
+    const auto prevMembership = oldEvent ? oldEvent->membership()
+                                         : Membership::Leave;
+    if (newEvent.membership() != prevMembership) {
+        displaynameSource.reset();
+        return;
+    }
+    const auto oldName =
+        oldEvent ? oldEvent->newDisplayName() : Omittable<QString>();
+    const auto newName = newEvent.newDisplayName();
+    if (oldName == newName)
+        return; // Avatar changes and no-ops don't affect the display name
+    for (const auto* u : displaynameShortlist) {
+        if (!u)
+            break;
+        if (u->id() == newEvent.userId()) {
+            displaynameSource.reset();
+            return;
+        }
+        // Renaming to or from a name in the shortlist changes disambiguation
+        if (const auto name = q->memberName(u->id());
+            (oldName && *oldName == name) || (newName && *newName == name)) {
+            displaynameSource.reset();
+            return;
+        }
+    }
+}
+
 void Room::Private::updateDisplayname()
 {
+    if (displaynameSource)
+        return; // Nothing the display name depends on has changed
     auto swappedName = calculateDisplayname();
     if (swappedName != displayname) {
         emit q->displaynameAboutToChange(q);
@@ -3448,7 +4142,22 @@ void Room::Private::updateDisplayname()
     }
 }
 
-QJsonObject Room::Private::toJson() const
+inline bool isCacheable(const StateEvent* evt)
+{
+    return evt && (!evt->isRedacted() || is<RoomMemberEvent>(*evt))
+           && !evt->contentJson().isEmpty();
+}
+
+inline QJsonObject stateEventToCacheJson(const StateEvent& evt)
+{
+    auto json = evt.fullJson();
+    auto unsignedJson = evt.unsignedJson();
+    unsignedJson.remove(QStringLiteral("prev_content"));
+    json[UnsignedKeyL] = unsignedJson;
+    return json;
+}
+
+QJsonObject Room::Private::toJson(bool changedStateOnly) const
 {
     QElapsedTimer et;
     et.start();
@@ -3457,18 +4166,21 @@ QJsonObject Room::Private::toJson() const
     {
         QJsonArray stateEvents;
 
-        for (const auto* evt : currentState) {
-            Q_ASSERT(evt->isStateEvent());
-            if ((evt->isRedacted() && !is<RoomMemberEvent>(*evt))
-                || evt->contentJson().isEmpty())
-                continue;
-
-            auto json = evt->fullJson();
-            auto unsignedJson = evt->unsignedJson();
-            unsignedJson.remove(QStringLiteral("prev_content"));
-            json[UnsignedKeyL] = unsignedJson;
-            stateEvents.append(json);
-        }
+        if (changedStateOnly) {
+            for (const auto& evtKey : unsavedStateKeys) {
+                const auto* evt = currentState.get(evtKey.first, evtKey.second);
+                stateEvents.append(
+                    isCacheable(evt)
+                        ? stateEventToCacheJson(*evt)
+                        : QJsonObject { { TypeKey, evtKey.first },
+                                        { StateKeyKey, evtKey.second } });
+            }
+        } else
+            for (const auto* evt : currentState) {
+                Q_ASSERT(evt->isStateEvent());
+                if (isCacheable(evt))
+                    stateEvents.append(stateEventToCacheJson(*evt));
+            }
 
         const auto stateObjName = joinState == JoinState::Invite
                                       ? QStringLiteral("invite_state")
@@ -3514,8 +4226,126 @@ QJsonObject Room::Private::toJson() const
     return result;
 }
 
+QJsonObject Room::Private::summaryRecordToJson() const
+{
+    QJsonObject result;
+    addParam<IfNotEmpty>(result, QStringLiteral("summary"), summary);
+    {
+        QJsonArray stateEvents;
+        const auto addEvent = [this, &stateEvents](const QString& evtType,
+                                                   const QString& stateKey) {
+            if (const auto* evt = currentState.get(evtType, stateKey);
+                isCacheable(evt))
+                stateEvents.append(stateEventToCacheJson(*evt));
+        };
+        for (const auto& evtType :
+             { RoomCreateEvent::TypeId, RoomNameEvent::TypeId,
+               RoomCanonicalAliasEvent::TypeId, RoomAvatarEvent::TypeId,
+               RoomTopicEvent::TypeId, EncryptionEvent::TypeId,
+               RoomTombstoneEvent::TypeId })
+            addEvent(evtType, {});
+
+        auto memberIds = summary.heroes.value_or(QStringList());
+        for (const auto* u : buildShortlist(membersMap))
+            if (u != nullptr && !memberIds.contains(u->id()))
+                memberIds.push_back(u->id());
+        memberIds.push_back(connection->userId());
+        for (const auto& memberId : memberIds)
+            addEvent(RoomMemberEvent::TypeId, memberId);
+
+        result.insert(joinState == JoinState::Invite
+                          ? QStringLiteral("invite_state")
+                          : QStringLiteral("state"),
+                      QJsonObject { { QStringLiteral("events"), stateEvents } });
+    }
+    if (const auto it = accountData.find(TagEvent::TypeId);
+        it != accountData.cend())
+        result.insert(QStringLiteral("account_data"),
+                      QJsonObject { { QStringLiteral("events"),
+                                      QJsonArray { it->second->fullJson() } } });
+
+    result.insert(UnreadNotificationsKey,
+                  QJsonObject { { PartiallyReadCountKey,
+                                  countFromStats(partiallyReadStats) },
+                                { HighlightCountKey, serverHighlightCount } });
+    result.insert(NewUnreadCountKey, countFromStats(unreadStats));
+    return result;
+}
+
 QJsonObject Room::toJson() const { return d->toJson(); }
 
+bool Room::needsFullStateSave() const { return d->fullStateSaveNeeded; }
+
+QJsonObject Room::summaryRecordToJson() const
+{
+    return d->summaryRecordToJson();
+}
+
+bool Room::isCachedStateLoaded() const { return !d->cachedStateToLoad; }
+
+int Room::compactTimelineWindow() const { return d->compactTimelineWindow; }
+
+void Room::setCompactTimelineWindow(int eventsCount)
+{
+    d->compactTimelineWindow = std::max(eventsCount, 0);
+    d->compactTimeline();
+}
+
+int Room::maxTimelineEvents() const { return d->maxTimelineEvents; }
+
+qint64 Room::maxTimelineBytes() const { return d->maxTimelineBytes; }
+
+void Room::setTimelineLimits(int maxEvents, qint64 maxBytes)
+{
+    d->maxTimelineEvents = std::max(maxEvents, 0);
+    d->maxTimelineBytes = std::max(maxBytes, qint64(0));
+    if (d->maxTimelineBytes == 0 || d->eventSizes.size() != d->timeline.size()) {
+        d->eventSizes.clear();
+        d->timelineBytes = 0;
+        if (d->maxTimelineBytes > 0)
+            for (const auto& ti : d->timeline)
+                d->addEventSize(*ti, Newer);
+    }
+    d->evictTimeline();
+}
+
+void Room::loadCachedState()
+{
+    if (!d->cachedStateToLoad)
+        return;
+    d->cachedStateToLoad = false;
+
+    QElapsedTimer et;
+    et.start();
+    const auto roomJson =
+        SyncData::loadRoomJson(connection()->stateCachePath(), id());
+    if (roomJson.isEmpty()) {
+        qCWarning(MAIN) << "Could not load the cached state of" << objectName()
+                        << "- some room state may be missing until updated";
+        return;
+    }
+    SyncRoomData roomData { id(), joinState(), roomJson };
+    // Skip state events already loaded from the summary record
+    std::erase_if(roomData.state, [this](const StateEventPtr& e) {
+        const auto* curEvt =
+            d->currentState.get(e->matrixType(), e->stateKey());
+        return curEvt && curEvt->fullJson() == e->fullJson();
+    });
+    updateData(std::move(roomData), true);
+    if (et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "Loaded the cached state of" << objectName()
+                          << "in" << et;
+}
+
+QJsonObject Room::stateChangesToJson() const { return d->toJson(true); }
+
+void Room::markStateSaved(bool fullSave)
+{
+    d->unsavedStateKeys.clear();
+    if (fullSave)
+        d->fullStateSaveNeeded = false;
+}
+
 MemberSorter Room::memberSorter() const { return MemberSorter(this); }
 
 bool MemberSorter::operator()(User* u1, User* u2) const
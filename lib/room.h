@@ -270,6 +270,19 @@ public:
     QList<User*> membersLeft() const;
 
     Q_INVOKABLE QList<Quotient::User*> users() const;
+    //! \brief Get joined members sorted by their names
+    //!
+    //! Room maintains this order as the members join, leave and rename, so
+    //! that the list doesn't need to be sorted on the client side; members
+    //! are compared by collation keys of their disambiguated names in
+    //! the default locale. Use sortedMemberAt() and sortedMemberPosition()
+    //! along with the sortedMember* signals to back a list model.
+    Q_INVOKABLE QList<Quotient::User*> sortedMembers() const;
+    int sortedMembersCount() const;
+    //! Get the member at \p position of sortedMembers(), or nullptr
+    Q_INVOKABLE Quotient::User* sortedMemberAt(int position) const;
+    //! Get the position of \p member in sortedMembers(), or -1
+    Q_INVOKABLE int sortedMemberPosition(Quotient::User* member) const;
     Q_DECL_DEPRECATED_X("Use safeMemberNames() or htmlSafeMemberNames() instead") //
     QStringList memberNames() const;
     QStringList safeMemberNames() const;
@@ -412,6 +425,74 @@ public:
      * measure that "screen time".
      */
     void setDisplayed(bool displayed = true);
+
+    /// Whether the full room state has been loaded from the cache
+    /**
+     * When Connection::lazyCacheLoading() is on, rooms are initially loaded
+     * from compact summary records that only have what's needed to show
+     * the room in a room list: the name, the avatar, tags, unread counters
+     * and users to build the display name from. The rest of the cached state
+     * and the timeline are loaded when the room is first actually used: when
+     * it's displayed, receives new events from the server, is asked for
+     * history or is saved to the cache; or when loadCachedState() is called.
+     * \sa Connection::setLazyCacheLoading
+     */
+    bool isCachedStateLoaded() const;
+    /// Load the full room state from the cache if it's not loaded yet
+    void loadCachedState();
+
+    /// The number of latest timeline events that are never packed
+    /**
+     * \return the window set by setCompactTimelineWindow(); 0 means that
+     *         timeline events are never packed (the default)
+     */
+    int compactTimelineWindow() const;
+    /// Keep timeline events older than the given number of latest ones packed
+    /**
+     * With a positive \p eventsCount, events beyond that number of latest
+     * timeline events (except those between firstDisplayedEventId() and
+     * lastDisplayedEventId()) are stored as compressed CBOR blobs instead of
+     * event objects. A packed event is turned back into an object when it is
+     * accessed through its TimelineItem, and packed again the next time
+     * events are added to the timeline. Indices of timeline items are not
+     * affected. This is useful for long-running processes that load deep
+     * history; it is off by default.
+     * \warning When this is on, event pointers handed out by the room stay
+     *          valid only until the next batch of events arrives, unless
+     *          the event is within the window or in the displayed range.
+     *          This applies to the events behind timeline iterators (those
+     *          returned by messageEvents(), findInTimeline(), historyEdge(),
+     *          the read marker functions etc.), to the results of
+     *          pinnedEvents(), and to the newEvent argument of
+     *          replacedEvent(). State events, reactions and undecrypted
+     *          events are never packed, so pointers from currentState() and
+     *          relatedEvents() are not affected. Do not turn this on unless the client re-resolves
+     *          events by their ids or timeline indices instead of keeping
+     *          the pointers.
+     * \sa TimelineItem::pack
+     */
+    void setCompactTimelineWindow(int eventsCount);
+
+    /// The maximum number of events kept in the timeline; 0 means no limit
+    int maxTimelineEvents() const;
+    /// The maximum total size of timeline events JSON; 0 means no limit
+    qint64 maxTimelineBytes() const;
+    /// Limit the number of events kept in the timeline
+    /**
+     * Once the timeline exceeds either of the limits after receiving new
+     * events, the oldest events are dropped from it, down to the boundary of
+     * a loaded batch; the history can then be fetched again with
+     * getPreviousContent(). Events between firstDisplayedEventId() and
+     * lastDisplayedEventId(), as well as the fully read marker and the local
+     * user's read receipt, are never dropped. Loading history with
+     * getPreviousContent() is not affected by the limits until the next sync.
+     * Passing zeros (the default) removes the limits.
+     * \param maxEvents the maximum number of events in the timeline
+     * \param maxBytes the maximum total size of compact JSON of the events
+     * \sa aboutToEvictMessages, evictedMessages
+     */
+    void setTimelineLimits(int maxEvents, qint64 maxBytes = 0);
+
     QString firstDisplayedEventId() const;
     rev_iter_t firstDisplayedMarker() const;
     void setFirstDisplayedEventId(const QString& eventId);
@@ -900,6 +981,12 @@ Q_SIGNALS:
     void aboutToAddHistoricalMessages(Quotient::RoomEventsRange events);
     void aboutToAddNewMessages(Quotient::RoomEventsRange events);
     void addedMessages(int fromIndex, int toIndex);
+    /// Events with indices \p fromIndex to \p toIndex are about to be
+    /// dropped from the beginning of the timeline
+    /** \sa setTimelineLimits */
+    void aboutToEvictMessages(int fromIndex, int toIndex);
+    /// Events have been dropped from the beginning of the timeline
+    void evictedMessages();
     /// The event is about to be appended to the list of pending events
     void pendingEventAboutToAdd(Quotient::RoomEvent* event);
     /// An event has been appended to the list of pending events
@@ -961,6 +1048,29 @@ Q_SIGNALS:
      * instead.
      */
     void memberListChanged();
+    //! \brief A large batch of member events is about to be processed
+    //!
+    //! Batches of many member events (the full member list of a big room,
+    //! most notably) are processed in bulk: userAdded, userRemoved,
+    //! memberAboutToRename, memberRenamed and memberAvatarChanged are not
+    //! emitted for them. Instead, this signal is emitted before the member
+    //! list changes and memberListReset() after that, similar to
+    //! QAbstractItemModel::modelAboutToBeReset() and modelReset().
+    void memberListAboutToReset();
+    //! The member list has been updated in bulk
+    //! \sa memberListAboutToReset
+    void memberListReset();
+    //! \brief A member is about to be inserted into sortedMembers()
+    //!
+    //! \p position is where the member will be after insertion. A member's
+    //! position changes by removing it and inserting it again; that happens
+    //! when the member's disambiguated name changes. None of the
+    //! sortedMember* signals is emitted during bulk updates.
+    //! \sa memberListAboutToReset
+    void sortedMemberAboutToBeInserted(Quotient::User* member, int position);
+    void sortedMemberInserted(Quotient::User* member, int position);
+    void sortedMemberAboutToBeRemoved(Quotient::User* member, int position);
+    void sortedMemberRemoved(Quotient::User* member, int position);
     /// The previously lazy-loaded members list is now loaded entirely
     /// \sa setDisplayed
     void allMembersLoaded();
@@ -1032,20 +1142,41 @@ protected:
     {}
     virtual QJsonObject toJson() const;
     virtual void updateData(SyncRoomData&& data, bool fromCache = false);
+    //! \brief Find the notification an event in the timeline should produce
+    //!
+    //! The default implementation evaluates the account's push rules on
+    //! the client side (see Connection::pushRuleEngine()).
     virtual Notification checkForNotifications(const TimelineItem& ti);
 
 private:
     friend class Connection;
+    friend struct EventStats;
 
     class Private;
     Private* d;
 
+    //! Count notable and highlighted events with indices in [from, to)
+    EventStats statsInRange(TimelineItem::index_t from,
+                            TimelineItem::index_t to) const;
+
+    //! Retry decrypting timeline events after keys for them have arrived
+    void retryDecryption(const QSet<QString>& eventIds);
+
     // This is called from Connection, reflecting a state change that
     // arrived from the server. Clients should use
     // Connection::joinRoom() and Room::leaveRoom() to change the state.
     void setJoinState(JoinState state);
+
+    // These are used by Connection to save the room state incrementally
+    bool needsFullStateSave() const;
+    QJsonObject summaryRecordToJson() const;
+    QJsonObject stateChangesToJson() const;
+    void markStateSaved(bool fullSave);
 };
 
+//! \brief Compares room members by their disambiguated names
+//!
+//! Consider Room::sortedMembers() instead of keeping a list sorted with this.
 class QUOTIENT_API MemberSorter {
 public:
     explicit MemberSorter(const Room* r) : room(r) {}
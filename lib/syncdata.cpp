@@ -4,9 +4,12 @@
 #include "syncdata.h"
 
 #include "logging.h"
+#include "metrics.h"
 
+#include <QtCore/QCborStreamReader>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QThreadPool>
 
 using namespace Quotient;
 
@@ -128,7 +131,9 @@ void JsonObjectConverter<DevicesList>::fillFrom(const QJsonObject& jo,
     fromJson(jo["left"_ls], rs.left);
 }
 
-SyncData::SyncData(const QString& cacheFileName)
+SyncData::SyncData(const QString& cacheFileName, bool summariesOnly,
+                   QThreadPool* threadPool)
+    : loadSummariesOnly(summariesOnly), cacheThreadPool(threadPool)
 {
     QFileInfo cacheFileInfo { cacheFileName };
     auto json = loadJson(cacheFileName);
@@ -151,6 +156,11 @@ QString SyncData::fileNameForRoom(QString roomId)
     return roomId + ".json";
 }
 
+QString SyncData::journalFileNameForRoom(const QString& roomId)
+{
+    return fileNameForRoom(roomId) + ".journal";
+}
+
 Events SyncData::takePresenceData() { return std::move(presenceData); }
 
 Events SyncData::takeAccountData() { return std::move(accountData); }
@@ -159,7 +169,7 @@ Events SyncData::takeToDeviceEvents() { return std::move(toDeviceEvents); }
 
 std::pair<int, int> SyncData::cacheVersion()
 {
-    return { MajorCacheVersion, 2 };
+    return { MajorCacheVersion, 3 };
 }
 
 DevicesList SyncData::takeDevicesList() { return std::move(devicesList); }
@@ -176,7 +186,14 @@ QJsonObject SyncData::loadJson(const QString& fileName)
                         << roomFile.fileName();
         return {};
     }
-    auto data = roomFile.readAll();
+    // Map the file rather than read it to a buffer, saving on a copy; both
+    // JSON and CBOR parsers make their own copies of what they need
+    const auto fileSize = roomFile.size();
+    const auto* const mapped = roomFile.map(0, fileSize);
+    const auto data =
+        mapped ? QByteArray::fromRawData(reinterpret_cast<const char*>(mapped),
+                                         int(fileSize))
+               : roomFile.readAll();
 
     const auto json = data.startsWith('{')
                           ? QJsonDocument::fromJson(data).object()
@@ -188,11 +205,100 @@ QJsonObject SyncData::loadJson(const QString& fileName)
     return json;
 }
 
-void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
+//! Apply the journal (see SyncData::journalFileNameForRoom) to the room JSON
+inline void applyJournal(QJsonObject& roomJson, QFile& journalFile)
 {
-    QElapsedTimer et;
-    et.start();
+    const auto stateKey = roomJson.contains("invite_state"_ls)
+                              ? "invite_state"_ls
+                              : "state"_ls;
+    auto stateEvents = roomJson.value(stateKey)
+                           .toObject()
+                           .value("events"_ls)
+                           .toArray();
+    QHash<StateEventKey, int> stateIndex;
+    stateIndex.reserve(stateEvents.size());
+    const auto keyOf = [](const QJsonObject& evtJson) {
+        return StateEventKey { evtJson.value(TypeKeyL).toString(),
+                               evtJson.value(StateKeyKeyL).toString() };
+    };
+    for (int i = 0; i < stateEvents.size(); ++i)
+        stateIndex.insert(keyOf(stateEvents.at(i).toObject()), i);
+
+    int recordsCount = 0;
+    const auto applyRecord = [&](const QJsonObject& record) {
+        for (auto it = record.begin(); it != record.end(); ++it) {
+            if (it.key() != stateKey) {
+                roomJson.insert(it.key(), *it);
+                continue;
+            }
+            const auto changedEvents =
+                it->toObject().value("events"_ls).toArray();
+            for (const auto& evtJson : changedEvents) {
+                const auto evtObj = evtJson.toObject();
+                // A tombstone only has to null the entry in the snapshot
+                const auto newValue = evtObj.contains(ContentKeyL)
+                                          ? QJsonValue(evtObj)
+                                          : QJsonValue::Null;
+                const auto idxIt = stateIndex.constFind(keyOf(evtObj));
+                if (idxIt != stateIndex.cend())
+                    stateEvents.replace(*idxIt, newValue);
+                else if (!newValue.isNull()) {
+                    stateIndex.insert(keyOf(evtObj), stateEvents.size());
+                    stateEvents.append(newValue);
+                }
+            }
+        }
+        ++recordsCount;
+    };
+
+    const auto head = journalFile.peek(1);
+    if (head.startsWith('{')) {
+        while (!journalFile.atEnd()) {
+            const auto line = journalFile.readLine();
+            QJsonParseError error;
+            const auto record = QJsonDocument::fromJson(line, &error);
+            if (error.error != QJsonParseError::NoError) {
+                qCWarning(MAIN) << "Broken record in" << journalFile.fileName()
+                                << "- discarding the rest of the journal";
+                break;
+            }
+            applyRecord(record.object());
+        }
+    } else {
+        QCborStreamReader reader(&journalFile);
+        while (reader.lastError() == QCborError::NoError && reader.isMap()) {
+            const auto record = QCborValue::fromCbor(reader);
+            if (reader.lastError() != QCborError::NoError) {
+                qCWarning(MAIN) << "Broken record in" << journalFile.fileName()
+                                << "- discarding the rest of the journal";
+                break;
+            }
+            applyRecord(record.toJsonValue().toObject());
+        }
+    }
 
+    QJsonArray compactedEvents;
+    for (const auto& evtJson : qAsConst(stateEvents))
+        if (!evtJson.isNull())
+            compactedEvents.append(evtJson);
+    roomJson.insert(stateKey,
+                    QJsonObject { { "events"_ls, compactedEvents } });
+    qCDebug(MAIN) << "Applied" << recordsCount << "journal record(s) from"
+                  << journalFile.fileName();
+}
+
+QJsonObject SyncData::loadRoomJson(const QString& baseDir,
+                                   const QString& roomId)
+{
+    auto roomJson = loadJson(baseDir + fileNameForRoom(roomId));
+    if (QFile journalFile { baseDir + journalFileNameForRoom(roomId) };
+        !roomJson.isEmpty() && journalFile.open(QIODevice::ReadOnly))
+        applyJournal(roomJson, journalFile);
+    return roomJson;
+}
+
+void SyncData::parseNonRoomData(const QJsonObject& json)
+{
     nextBatch_ = json.value("next_batch"_ls).toString();
     presenceData = load<Events>(json, "presence"_ls);
     accountData = load<Events>(json, "account_data"_ls);
@@ -204,40 +310,381 @@ void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
     if(json.contains("device_lists")) {
         fromJson(json.value("device_lists"), devicesList);
     }
+}
 
-    auto rooms = json.value("rooms"_ls).toObject();
-    auto totalRooms = 0;
-    auto totalEvents = 0;
+qsizetype SyncData::addRoomData(SyncRoomData&& rd)
+{
+    const auto eventsCount = rd.state.size() + rd.ephemeral.size()
+                             + rd.accountData.size() + rd.timeline.size();
+    if (roomDataHandler)
+        roomDataHandler(std::move(rd));
+    else
+        roomData.emplace_back(std::move(rd));
+    return qsizetype(eventsCount);
+}
+
+void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
+{
+    QElapsedTimer et;
+    et.start();
+
+    parseNonRoomData(json);
+
+    struct RoomSlot {
+        QString roomId;
+        JoinState joinState;
+        QJsonObject roomJson; //< Empty if the room has to be loaded from file
+        Omittable<SyncRoomData> roomData = none;
+    };
+    std::vector<RoomSlot> roomSlots;
+    const auto rooms = json.value("rooms"_ls).toObject();
     for (size_t i = 0; i < JoinStateStrings.size(); ++i) {
         // This assumes that MemberState values go over powers of 2: 1,2,4,...
         const auto joinState = JoinState(1U << i);
         const auto rs = rooms.value(JoinStateStrings[i]).toObject();
         // We have a Qt container on the right and an STL one on the left
-        roomData.reserve(roomData.size() + static_cast<size_t>(rs.size()));
-        for (auto roomIt = rs.begin(); roomIt != rs.end(); ++roomIt) {
-            QJsonObject roomJson;
-            if (!baseDir.isEmpty()) {
-                // Loading data from the local cache, with room objects saved in
-                // individual files rather than inline
-                roomJson = loadJson(baseDir + fileNameForRoom(roomIt.key()));
-                if (roomJson.isEmpty()) {
-                    unresolvedRoomIds.push_back(roomIt.key());
-                    continue;
+        roomSlots.reserve(roomSlots.size() + static_cast<size_t>(rs.size()));
+        for (auto roomIt = rs.begin(); roomIt != rs.end(); ++roomIt)
+            // When loading from /sync response, everything is inline; when
+            // loading from the local cache, room objects are saved
+            // in individual files, with summary records in the top-level
+            // file since cache version 11.3 (older versions have nulls there)
+            roomSlots.push_back({ roomIt.key(), joinState,
+                                  baseDir.isEmpty() || loadSummariesOnly
+                                      ? roomIt->toObject()
+                                      : QJsonObject() });
+    }
+    const auto loadRoom = [&baseDir](RoomSlot& slot) {
+        const auto summaryOnly = !baseDir.isEmpty() && !slot.roomJson.isEmpty();
+        if (!baseDir.isEmpty() && !summaryOnly) {
+            slot.roomJson = loadRoomJson(baseDir, slot.roomId);
+            if (slot.roomJson.isEmpty())
+                return;
+        }
+        slot.roomData.emplace(slot.roomId, slot.joinState, slot.roomJson);
+        slot.roomData->summaryOnly = summaryOnly;
+        slot.roomJson = {};
+    };
+    if (cacheThreadPool && !baseDir.isEmpty())
+        runOnPool(cacheThreadPool, roomSlots, loadRoom);
+    else
+        std::for_each(roomSlots.begin(), roomSlots.end(), loadRoom);
+
+    // Merge in the original order, regardless of the order of loading
+    roomData.reserve(roomData.size() + roomSlots.size());
+    qsizetype totalEvents = 0;
+    for (auto& slot : roomSlots)
+        if (slot.roomData)
+            totalEvents += addRoomData(std::move(*slot.roomData));
+        else
+            unresolvedRoomIds.push_back(slot.roomId);
+
+    if (!unresolvedRoomIds.empty())
+        qCWarning(MAIN) << "Unresolved rooms:" << unresolvedRoomIds.join(',');
+    (baseDir.isEmpty() ? Metrics::syncParseTime : Metrics::cacheLoadTime)
+        .observe(et);
+    if (roomSlots.size() > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "*** SyncData::parseJson(): batch with"
+                          << roomSlots.size() << "room(s)," << totalEvents
+                          << "event(s) in" << et;
+}
+
+//! \brief An incremental scanner of /sync responses
+//!
+//! The scanner only descends into the top-level object, `rooms` and its
+//! join state objects; any other value (a top-level value except `rooms`, or
+//! a single room) is treated as a whole: once its end is found, it is cut
+//! out of the buffer and parsed with QJsonDocument. Scanning of values is
+//! resumable so that a value spanning many chunks is only scanned once.
+class SyncData::StreamParser {
+public:
+    bool feed(SyncData& sd, const QByteArray& chunk);
+    bool finish(SyncData& sd);
+
+private:
+    enum Expecting {
+        Object,
+        KeyOrEnd, //< Right after the opening brace
+        Key, //< After a comma
+        Colon,
+        Value,
+        CommaOrEnd,
+        Done,
+        Error
+    };
+
+    QByteArray buffer;
+    qsizetype pos = 0;
+    Expecting expecting = Object;
+    //! Nesting of objects the scanner has descended into: 1 for the top-level
+    //! object, 2 for `rooms`, 3 for a join state object inside `rooms`
+    int level = 0;
+    QString key;
+    QString joinStateKey;
+    QJsonObject nonRoomData;
+
+    // State of scanning a value that's not complete yet
+    qsizetype scanPos = -1;
+    int valueDepth = 0;
+    bool inString = false;
+    bool escaped = false;
+
+    int totalRooms = 0;
+    qsizetype totalEvents = 0;
+    QElapsedTimer et;
+    //! Time spent in the parser itself, without waiting for chunks
+    qint64 parsingNsecs = 0;
+
+    bool fail(const char* message);
+    bool readKey();
+    bool scanValue();
+    //! Process a single token or value at pos; false if it needs more data
+    bool step(SyncData& sd);
+    //! Parse a complete value at the current level; false if it's malformed
+    bool processValue(SyncData& sd, QByteArray&& valueJson);
+};
+
+bool SyncData::StreamParser::fail(const char* message)
+{
+    qCWarning(SYNCJOB).nospace() << "Malformed sync response at byte " << pos
+                                 << " of the buffer: " << message;
+    expecting = Error;
+    buffer.clear();
+    return false;
+}
+
+bool SyncData::StreamParser::readKey()
+{
+    Q_ASSERT(buffer.at(pos) == '"');
+    for (auto i = pos + 1; i < buffer.size(); ++i)
+        if (buffer.at(i) == '\\')
+            ++i; // Skip the escaped character, whatever it is
+        else if (buffer.at(i) == '"') {
+            // Let QJsonDocument deal with escape sequences, if any
+            const auto keyJson = QJsonDocument::fromJson(
+                '[' + buffer.mid(pos, i + 1 - pos) + ']');
+            key = keyJson.array().at(0).toString();
+            pos = i + 1;
+            return true;
+        }
+    return false; // The key is not complete yet
+}
+
+bool SyncData::StreamParser::scanValue()
+{
+    if (scanPos == -1) { // Start a new value
+        scanPos = pos;
+        valueDepth = 0;
+        inString = escaped = false;
+    }
+    for (; scanPos < buffer.size(); ++scanPos) {
+        const auto c = buffer.at(scanPos);
+        if (inString) {
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"') {
+                inString = false;
+                if (valueDepth == 0) { // A string value
+                    ++scanPos;
+                    return true;
                 }
-            } else // When loading from /sync response, everything is inline
-                roomJson = roomIt->toObject();
+            }
+            continue;
+        }
+        switch (c) {
+        case '"':
+            inString = true;
+            break;
+        case '{':
+        case '[':
+            ++valueDepth;
+            break;
+        case '}':
+        case ']':
+            if (valueDepth == 0) // The end of a literal, and of its container
+                return true;
+            if (--valueDepth == 0) {
+                ++scanPos;
+                return true;
+            }
+            break;
+        case ',':
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+            if (valueDepth == 0) // The end of a literal
+                return true;
+            break;
+        default:;
+        }
+    }
+    return false;
+}
+
+bool SyncData::StreamParser::processValue(SyncData& sd, QByteArray&& valueJson)
+{
+    QJsonParseError error { 0, QJsonParseError::NoError };
+    if (level == 1) {
+        // Wrapping into an array because Qt 5 only accepts objects and
+        // arrays at the top level of a JSON document
+        const auto valueDoc =
+            QJsonDocument::fromJson('[' + valueJson + ']', &error);
+        if (error.error != QJsonParseError::NoError)
+            return fail("a malformed top-level value");
+        nonRoomData.insert(key, valueDoc.array().at(0));
+        return true;
+    }
+    if (level != 3) // Not an object in place of a join state, ignore
+        return true;
+    const auto* const joinStateIt = std::find(JoinStateStrings.cbegin(),
+                                              JoinStateStrings.cend(),
+                                              joinStateKey);
+    if (joinStateIt == JoinStateStrings.cend()) {
+        qCDebug(SYNCJOB) << "Skipping room" << key << "in unknown join state"
+                         << joinStateKey;
+        return true;
+    }
+    const auto roomDoc = QJsonDocument::fromJson(valueJson, &error);
+    valueJson.clear(); // Drop the raw data before parsing events
+    if (error.error != QJsonParseError::NoError || !roomDoc.isObject())
+        return fail("a malformed room object");
+    const auto roomJson = roomDoc.object();
+    const auto joinState =
+        JoinState(1U << (joinStateIt - JoinStateStrings.cbegin()));
+    totalEvents += sd.addRoomData({ key, joinState, roomJson });
+    ++totalRooms;
+    return true;
+}
 
-            roomData.emplace_back(roomIt.key(), joinState, roomJson);
-            const auto& r = roomData.back();
-            totalEvents += r.state.size() + r.ephemeral.size()
-                           + r.accountData.size() + r.timeline.size();
+bool SyncData::StreamParser::step(SyncData& sd)
+{
+    const auto c = buffer.at(pos);
+    if (scanPos == -1 && (c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+        ++pos; // Skip whitespace between tokens
+        return true;
+    }
+    switch (expecting) {
+    case Object:
+        if (c != '{')
+            return fail("an object expected");
+        ++level;
+        ++pos;
+        expecting = KeyOrEnd;
+        return true;
+    case KeyOrEnd:
+    case Key:
+        if (c == '"') {
+            if (!readKey())
+                return false;
+            expecting = Colon;
+            return true;
+        }
+        if (expecting == Key) // No trailing commas in JSON
+            return fail("a key expected after a comma");
+        [[fallthrough]];
+    case CommaOrEnd:
+        if (c == ',' && expecting == CommaOrEnd) {
+            ++pos;
+            expecting = Key;
+            return true;
+        }
+        if (c != '}')
+            return fail("a key, a comma or the end of the object expected");
+        ++pos;
+        expecting = --level == 0 ? Done : CommaOrEnd;
+        return true;
+    case Colon:
+        if (c != ':')
+            return fail("a colon expected");
+        ++pos;
+        expecting = Value;
+        return true;
+    case Value:
+        if (c == '{' && ((level == 1 && key == "rooms"_ls) || level == 2)) {
+            // Descend into `rooms` and join state objects
+            if (level == 2)
+                joinStateKey = key;
+            expecting = Object;
+            return true;
         }
-        totalRooms += rs.size();
+        if (!scanValue())
+            return false;
+        if (!processValue(sd, buffer.mid(pos, scanPos - pos)))
+            return false;
+        pos = scanPos;
+        scanPos = -1;
+        expecting = CommaOrEnd;
+        return true;
+    case Done:
+        return fail("unexpected data after the end of the response");
+    case Error:;
     }
-    if (!unresolvedRoomIds.empty())
-        qCWarning(MAIN) << "Unresolved rooms:" << unresolvedRoomIds.join(',');
+    return false;
+}
+
+bool SyncData::StreamParser::feed(SyncData& sd, const QByteArray& chunk)
+{
+    if (expecting == Error)
+        return false;
+    if (!et.isValid())
+        et.start();
+    QElapsedTimer chunkEt;
+    chunkEt.start();
+
+    buffer += chunk;
+    while (pos < buffer.size() && step(sd))
+        ;
+    parsingNsecs += chunkEt.nsecsElapsed();
+    if (expecting == Error)
+        return false;
+
+    // Drop everything already processed; if a value is being scanned,
+    // it starts at pos so its beginning stays in the buffer
+    buffer.remove(0, pos);
+    if (scanPos != -1)
+        scanPos -= pos;
+    pos = 0;
+    return true;
+}
+
+bool SyncData::StreamParser::finish(SyncData& sd)
+{
+    if (expecting == Error)
+        return false;
+    if (expecting != Done)
+        return fail("the response ended prematurely");
+
+    QElapsedTimer finishEt;
+    finishEt.start();
+    sd.parseNonRoomData(nonRoomData);
+    Metrics::syncParseTime.observe(parsingNsecs + finishEt.nsecsElapsed());
     if (totalRooms > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
-        qCDebug(PROFILER) << "*** SyncData::parseJson(): batch with"
+        qCDebug(PROFILER) << "*** SyncData::parseChunk(): batch with"
                           << totalRooms << "room(s)," << totalEvents
                           << "event(s) in" << et;
+    return true;
+}
+
+bool SyncData::parseChunk(const QByteArray& chunk)
+{
+    if (!streamParser)
+        streamParser = makeImpl<StreamParser>();
+    return streamParser->feed(*this, chunk);
+}
+
+bool SyncData::finishStreaming()
+{
+    if (!streamParser) // Nothing has been fed at all
+        return false;
+    const auto result = streamParser->finish(*this);
+    streamParser.reset();
+    return result;
+}
+
+void SyncData::setRoomDataHandler(RoomDataHandler handler)
+{
+    roomDataHandler = std::move(handler);
 }
@@ -7,6 +7,10 @@
 
 #include "events/stateevent.h"
 
+#include <functional>
+
+class QThreadPool;
+
 namespace Quotient {
 
 constexpr auto UnreadNotificationsKey = "unread_notifications"_ls;
@@ -77,6 +81,12 @@ public:
     Omittable<int> partiallyReadCount;
     Omittable<int> unreadCount;
     Omittable<int> highlightCount;
+    //! \brief Whether this is only a summary record of a cached room
+    //!
+    //! Summary records are used to quickly set up rooms when the state cache
+    //! is loaded lazily; the full state is loaded later, see
+    //! Room::loadCachedState()
+    bool summaryOnly = false;
 
     SyncRoomData(QString roomId, JoinState joinState,
                  const QJsonObject& roomJson);
@@ -87,10 +97,18 @@ public:
 // QVector cannot work with non-copyable objects, std::vector can.
 using SyncDataList = std::vector<SyncRoomData>;
 
-class SyncData {
+class QUOTIENT_API SyncData {
 public:
     SyncData() = default;
-    explicit SyncData(const QString& cacheFileName);
+    //! \brief Load the state cache
+    //! \param cacheFileName the path to the top-level cache file
+    //! \param summariesOnly if true and the cache has summary records for
+    //!        rooms, use those instead of loading full room files
+    //! \param threadPool if not nullptr, room files are read and decoded
+    //!        in parallel on this pool; the resulting room data are in the same
+    //!        order as if they were loaded sequentially
+    explicit SyncData(const QString& cacheFileName, bool summariesOnly = false,
+                      QThreadPool* threadPool = nullptr);
     /** Parse sync response into room events
      * \param json response from /sync or a room state cache
      * \return the list of rooms with missing cache files; always
@@ -98,6 +116,35 @@ public:
      */
     void parseJson(const QJsonObject& json, const QString& baseDir = {});
 
+    //! \brief Parse the next chunk of a /sync response as it arrives
+    //!
+    //! This is an incremental alternative to parseJson() for responses coming
+    //! from the network. Instead of requiring the whole response as a single
+    //! JSON document, the incoming bytes are scanned as they come and each
+    //! room is turned into SyncRoomData as soon as its JSON subtree is
+    //! complete, dropping the raw bytes of that room right after. This keeps
+    //! the memory spent on the raw response bounded by the largest room
+    //! rather than by the whole payload. Call finishStreaming() after
+    //! the last chunk.
+    //! \return false if the data fed so far is not a valid /sync response;
+    //!         further chunks are ignored in that case
+    bool parseChunk(const QByteArray& chunk);
+
+    //! \brief Complete parsing started with parseChunk()
+    //! \return true if the response has been fully and correctly parsed
+    bool finishStreaming();
+
+    using RoomDataHandler = std::function<void(SyncRoomData&&)>;
+
+    //! \brief Set a function to receive rooms as soon as they are parsed
+    //!
+    //! By default, parseChunk() accumulates rooms to be taken with
+    //! takeRoomData() in the end. If a handler is set, each room is passed
+    //! to it instead, right after its subtree is parsed. Note that the rest of
+    //! the response (account data, to-device events etc.) may come after
+    //! some or all rooms.
+    void setRoomDataHandler(RoomDataHandler handler);
+
     Events takePresenceData();
     Events takeAccountData();
     Events takeToDeviceEvents();
@@ -115,8 +162,22 @@ public:
     static constexpr int MajorCacheVersion = 11;
     static std::pair<int, int> cacheVersion();
     static QString fileNameForRoom(QString roomId);
+    //! \brief The name of the file with room state changes since the last save
+    //!
+    //! Each room is cached as a full snapshot in fileNameForRoom() and
+    //! a journal of changes made after the snapshot. A journal is a sequence
+    //! of records in the same format as the snapshot, either concatenated
+    //! CBOR items or JSON objects one per line; state events in records
+    //! override those with the same type and state key in the snapshot,
+    //! and tombstones (state events without content) remove them.
+    static QString journalFileNameForRoom(const QString& roomId);
+    //! Load the cached room JSON, with the journal applied, from \p baseDir
+    static QJsonObject loadRoomJson(const QString& baseDir,
+                                    const QString& roomId);
 
 private:
+    class StreamParser;
+
     QString nextBatch_;
     Events presenceData;
     Events accountData;
@@ -125,6 +186,14 @@ private:
     QStringList unresolvedRoomIds;
     QHash<QString, int> deviceOneTimeKeysCount_;
     DevicesList devicesList;
+    RoomDataHandler roomDataHandler;
+    ImplPtr<StreamParser> streamParser = ZeroImpl<StreamParser>();
+
+    void parseNonRoomData(const QJsonObject& json);
+    qsizetype addRoomData(SyncRoomData&& roomData);
+
+    bool loadSummariesOnly = false;
+    QThreadPool* cacheThreadPool = nullptr;
 
     static QJsonObject loadJson(const QString& fileName);
 };
@@ -63,7 +63,7 @@ Connection* User::connection() const
 void User::load()
 {
     auto* profileJob =
-        connection()->callApi<GetUserProfileJob>(id());
+        connection()->callApiShared<GetUserProfileJob>(ForegroundRequest, id());
     connect(profileJob, &BaseJob::result, this, [this, profileJob] {
         d->defaultName = profileJob->displayname();
         d->defaultAvatar = Avatar(QUrl(profileJob->avatarUrl()));
@@ -8,7 +8,10 @@
 
 #include <QtCore/QLatin1String>
 #include <QtCore/QHashFunctions>
+#include <QtCore/QSemaphore>
+#include <QtCore/QThreadPool>
 
+#include <atomic>
 #include <memory>
 #include <unordered_map>
 
@@ -278,6 +281,32 @@ QUOTIENT_API qreal stringToHueF(const QString& s);
 /** Extract the serverpart from MXID */
 QUOTIENT_API QString serverPart(const QString& mxId);
 
+//! \brief Apply \p fn to each element of \p items using threads of \p pool
+//!
+//! The calling thread takes part in the work too; the function returns
+//! once all items have been processed. Elements are picked dynamically so
+//! that a few big items don't make other threads idle.
+template <typename ContT, typename FnT>
+inline void runOnPool(QThreadPool* pool, ContT& items, const FnT& fn)
+{
+    std::atomic<size_t> nextIdx = 0;
+    const auto worker = [&items, &fn, &nextIdx] {
+        for (auto i = nextIdx++; i < size_t(items.size()); i = nextIdx++)
+            fn(items[i]);
+    };
+    QSemaphore helpersDone;
+    int helpersCount = 0;
+    // Don't queue helpers if the pool is busy - the work will be done anyway
+    while (size_t(helpersCount + 1) < size_t(items.size())
+           && pool->tryStart([&worker, &helpersDone] {
+                  worker();
+                  helpersDone.release();
+              }))
+        ++helpersCount;
+    worker();
+    helpersDone.acquire(helpersCount);
+}
+
 QUOTIENT_API QString versionString();
 QUOTIENT_API int majorVersion();
 QUOTIENT_API int minorVersion();